@@ -0,0 +1,77 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+arena::arena(size_t chunk_size)
+  : m_next(NULL),
+    m_end(NULL),
+    m_chunk_size(chunk_size)
+{}
+
+arena::~arena()
+{
+  for (unsigned i = 0; i < m_chunks.size(); i++) {
+    free(m_chunks[i].m_base);
+  }
+}
+
+/* Start a new chunk, big enough for "size" bytes, and allocate them
+   from it.  The rest of the current chunk is wasted.  */
+void *arena::alloc_chunk(size_t size)
+{
+  chunk c;
+  c.m_size = size > m_chunk_size ? size : m_chunk_size;
+  c.m_base = (char *)malloc(c.m_size);
+  assert(c.m_base); // FIXME
+  m_chunks.push_back(c);
+  m_next = c.m_base + size;
+  m_end = c.m_base + c.m_size;
+  return c.m_base;
+}
+
+void arena::release()
+{
+  if (m_chunks.size() > 1) {
+    size_t total = 0;
+    for (unsigned i = 0; i < m_chunks.size(); i++) {
+      total += m_chunks[i].m_size;
+      free(m_chunks[i].m_base);
+    }
+    m_chunks.clear();
+    m_chunk_size = total;
+    alloc_chunk(0);
+  }
+  m_next = m_chunks.empty() ? NULL : m_chunks.back().m_base;
+}
+
+size_t arena::get_bytes_used() const
+{
+  size_t used = 0;
+  for (unsigned i = 0; i + 1 < m_chunks.size(); i++) {
+    used += m_chunks[i].m_size;
+  }
+  if (!m_chunks.empty()) {
+    used += m_next - m_chunks.back().m_base;
+  }
+  return used;
+}
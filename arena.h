@@ -0,0 +1,154 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <new>
+#include <vector>
+
+/* A bump-pointer allocator for short-lived data, such as the
+   temporaries made while lowering or compiling a function.
+
+   Allocating just advances a pointer through the current chunk,
+   taking a new chunk from malloc when that runs out.  Nothing is freed
+   on its own: release frees everything at once.  If more than one
+   chunk was needed, release replaces them with a single chunk big
+   enough for all of it, so that an arena reused for one function
+   after another soon stops calling malloc at all.  */
+class arena
+{
+public:
+  static const size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+  explicit arena(size_t chunk_size = DEFAULT_CHUNK_SIZE);
+  ~arena();
+
+  void *alloc(size_t size)
+  {
+    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    if (size > (size_t)(m_end - m_next)) {
+      return alloc_chunk(size);
+    }
+    void *result = m_next;
+    m_next += size;
+    return result;
+  }
+
+  /* Free everything allocated from the arena.  */
+  void release();
+
+  /* The number of bytes allocated since the last release, including
+     the unused ends of any chunks that filled up.  */
+  size_t get_bytes_used() const;
+
+private:
+  static const size_t ALIGNMENT = 16;
+
+  struct chunk
+  {
+    char *m_base;
+    size_t m_size;
+  };
+
+  void *alloc_chunk(size_t size);
+
+  // Not copyable, as we own the chunks:
+  arena(const arena &);
+  arena &operator=(const arena &);
+
+private:
+  /* The chunks, the current one last.  */
+  std::vector<chunk> m_chunks;
+  char *m_next;
+  char *m_end;
+  size_t m_chunk_size;
+};
+
+/* An allocator for standard containers, taking their storage from an
+   arena.  deallocate does nothing, so a container that grows leaves its
+   old buffers in the arena until it is released; reserve up front
+   where the size is known.  */
+template <class T>
+class arena_allocator
+{
+public:
+  typedef T value_type;
+  typedef T *pointer;
+  typedef const T *const_pointer;
+  typedef T &reference;
+  typedef const T &const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <class U>
+  struct rebind
+  {
+    typedef arena_allocator<U> other;
+  };
+
+  arena_allocator(arena *a) : m_arena(a) {}
+
+  template <class U>
+  arena_allocator(const arena_allocator<U> &other)
+    : m_arena(other.get_arena())
+  {}
+
+  arena *get_arena() const { return m_arena; }
+
+  pointer address(reference x) const { return &x; }
+  const_pointer address(const_reference x) const { return &x; }
+
+  pointer allocate(size_type n, const void * = 0)
+  {
+    return (pointer)m_arena->alloc(n * sizeof(T));
+  }
+  void deallocate(pointer, size_type) {}
+
+  size_type max_size() const { return (size_t)-1 / sizeof(T); }
+
+  void construct(pointer p, const T &value) { new ((void *)p) T(value); }
+  void destroy(pointer p) { p->~T(); }
+
+  template <class U>
+  bool operator==(const arena_allocator<U> &other) const
+  {
+    return m_arena == other.get_arena();
+  }
+  template <class U>
+  bool operator!=(const arena_allocator<U> &other) const
+  {
+    return m_arena != other.get_arena();
+  }
+
+private:
+  arena *m_arena;
+};
+
+/* The type of a vector in an arena, as in:
+
+     arena_vector<int>::type v(n, 0, scratch);  */
+template <class T>
+struct arena_vector
+{
+  typedef std::vector<T, arena_allocator<T> > type;
+};
+
+#endif
@@ -0,0 +1,1101 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+/* Timings of the various execution engines.
+
+   Results are written to stderr; stdout is redirected to /dev/null
+   so that the traced interpreters can be timed without the cost of
+   a terminal.  */
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stackvm.h"
+#include "regvm.h"
+#include "diskcache.h"
+#include "programs.h"
+#include "profile.h"
+#include "jitqueue.h"
+#include "threadpool.h"
+#include "runtime.h"
+
+typedef int (*compiled_code) (int);
+typedef void (*compiled_batch) (const int *in, int *out, size_t n);
+
+static FILE *report;
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+template <class VM, class TRACE>
+static double
+time_interpret(VM *v, int n, int *result)
+{
+  double start = now();
+  *result = v->template interpret<TRACE>(n);
+  return now() - start;
+}
+
+template <class VM>
+static void
+bench_tracing(const char *name, VM *v, int n)
+{
+  int traced_result, untraced_result, profiled_result;
+  double traced = time_interpret<VM, stdout_trace>(v, n, &traced_result);
+  double untraced = time_interpret<VM, no_trace>(v, n, &untraced_result);
+  exec_profile profile;
+  v->set_profile(&profile);
+  double profiled = time_interpret<VM, profile_trace>(v, n, &profiled_result);
+  v->set_profile(NULL);
+  fprintf(report,
+          "%s: fib(%i): traced %.3fms, untraced %.3fms, speedup %.1fx;"
+          " profiled %.3fms\n",
+          name, n, traced * 1e3, untraced * 1e3, traced / untraced,
+          profiled * 1e3);
+  if (traced_result != untraced_result) {
+    fprintf(report, "  MISMATCH: %i vs %i\n",
+            traced_result, untraced_result);
+  }
+  if (profiled_result != untraced_result) {
+    fprintf(report, "  MISMATCH: %i vs %i\n",
+            profiled_result, untraced_result);
+  }
+}
+
+/* Compare opcodes/second between the stackvm engines.  The number of
+   opcodes executed is taken from a counted run of the switch engine.  */
+static void
+bench_engines(const char *name, stackvm::vm *sv, int n)
+{
+  sv->get_counts() = exec_counts();
+  int expected = sv->interpret<count_trace>(n);
+  long num_opcodes = sv->get_counts().m_opcodes;
+
+  static const struct {
+    const char *m_name;
+    enum stackvm::engine m_engine;
+  } engines[] = {
+    {"switch", stackvm::ENGINE_SWITCH},
+    {"threaded", stackvm::ENGINE_THREADED},
+    {"frame stack", stackvm::ENGINE_FRAME_STACK},
+  };
+  for (unsigned i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+    sv->set_engine(engines[i].m_engine);
+    double start = now();
+    int result = sv->interpret(n);
+    double elapsed = now() - start;
+    fprintf(report,
+            "%s, %s engine: fib(%i): %.3fms, %.1fM ops/sec\n",
+            name, engines[i].m_name, n, elapsed * 1e3,
+            num_opcodes / elapsed * 1e-6);
+    if (result != expected) {
+      fprintf(report, "  MISMATCH: %i vs %i\n", result, expected);
+    }
+  }
+  sv->set_engine(stackvm::ENGINE_SWITCH);
+}
+
+/* Compare the recursive and frame-stack regvm engines on a call-heavy
+   workload.  */
+static void
+bench_regvm_engines(const char *name, regvm::vm *rv, int n)
+{
+  static const struct {
+    const char *m_name;
+    enum regvm::engine m_engine;
+  } engines[] = {
+    {"switch", regvm::ENGINE_SWITCH},
+    {"frame stack", regvm::ENGINE_FRAME_STACK},
+  };
+  for (unsigned i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+    rv->set_engine(engines[i].m_engine);
+    double start = now();
+    int result = rv->interpret(n);
+    double elapsed = now() - start;
+    fprintf(report, "%s, %s engine: fib(%i) = %i: %.3fms\n",
+            name, engines[i].m_name, n, result, elapsed * 1e3);
+  }
+  rv->set_engine(regvm::ENGINE_SWITCH);
+}
+
+/* Hardware performance counters, via perf_event_open.  These are often
+   unavailable (e.g. in containers, or with a restrictive
+   perf_event_paranoid), in which case only timings are reported.  */
+enum counter {
+  COUNTER_INSTRUCTIONS,
+  COUNTER_CYCLES,
+  COUNTER_L1D_MISSES,
+
+  NUM_COUNTERS
+};
+
+static int
+open_counter(unsigned type, unsigned long long config, int group_fd)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = (group_fd == -1);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/* Open a group of counters, returning false (having explained why) if
+   that isn't possible.  */
+static bool
+open_counters(int *fds)
+{
+  fds[COUNTER_INSTRUCTIONS] =
+    open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1);
+  if (fds[COUNTER_INSTRUCTIONS] == -1) {
+    fprintf(report, "(hardware counters unavailable: %s)\n",
+            strerror(errno));
+    return false;
+  }
+  int group = fds[COUNTER_INSTRUCTIONS];
+  fds[COUNTER_CYCLES] =
+    open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, group);
+  fds[COUNTER_L1D_MISSES] =
+    open_counter(PERF_TYPE_HW_CACHE,
+                 PERF_COUNT_HW_CACHE_L1D
+                 | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                 | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                 group);
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    if (fds[i] == -1) {
+      fprintf(report, "(hardware counters unavailable: %s)\n",
+              strerror(errno));
+      for (int j = 0; j < NUM_COUNTERS; j++) {
+        if (fds[j] != -1) {
+          close(fds[j]);
+        }
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+static void
+close_counters(int *fds)
+{
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    close(fds[i]);
+  }
+}
+
+static void
+start_counters(int *fds)
+{
+  ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void
+stop_counters(int *fds, long long *values)
+{
+  ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    if (read(fds[i], &values[i], sizeof(values[i])) != sizeof(values[i])) {
+      values[i] = 0;
+    }
+  }
+}
+
+/* Compare the packed and wide instruction layouts within each regvm
+   engine, by time and (where available) IPC and L1 data-cache
+   misses.  */
+static void
+bench_layouts(const char *name, regvm::vm *rv, int n)
+{
+  static const struct {
+    const char *m_name;
+    enum regvm::engine m_engine;
+  } engines[] = {
+    {"switch", regvm::ENGINE_SWITCH},
+    {"frame stack", regvm::ENGINE_FRAME_STACK},
+  };
+  static const struct {
+    const char *m_name;
+    enum regvm::layout m_layout;
+  } layouts[] = {
+    {"packed", regvm::LAYOUT_PACKED},
+    {"wide", regvm::LAYOUT_WIDE},
+  };
+
+  int fds[NUM_COUNTERS];
+  bool have_counters = open_counters(fds);
+  for (unsigned i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+    for (unsigned j = 0; j < sizeof(layouts) / sizeof(layouts[0]); j++) {
+      rv->set_engine(engines[i].m_engine);
+      rv->set_layout(layouts[j].m_layout);
+      long long values[NUM_COUNTERS];
+      if (have_counters) {
+        start_counters(fds);
+      }
+      double start = now();
+      int result = rv->interpret(n);
+      double elapsed = now() - start;
+      fprintf(report, "%s, %s engine, %s layout: fib(%i) = %i: %.3fms",
+              name, engines[i].m_name, layouts[j].m_name, n, result,
+              elapsed * 1e3);
+      if (have_counters) {
+        stop_counters(fds, values);
+        fprintf(report, ", IPC %.2f, %lli L1d misses",
+                values[COUNTER_CYCLES]
+                ? (double)values[COUNTER_INSTRUCTIONS] / values[COUNTER_CYCLES]
+                : 0.0,
+                values[COUNTER_L1D_MISSES]);
+      }
+      fprintf(report, "\n");
+    }
+  }
+  if (have_counters) {
+    close_counters(fds);
+  }
+  rv->set_engine(regvm::ENGINE_SWITCH);
+  rv->set_layout(regvm::LAYOUT_PACKED);
+}
+
+/* Recursion far deeper than the native stack would allow, followed by
+   a run which hits the limit on call depth.  */
+static void
+bench_deep_recursion(int n)
+{
+  stackvm::vm *sv = new stackvm::vm(make_sum_module());
+  sv->set_engine(stackvm::ENGINE_FRAME_STACK);
+  sv->set_max_call_depth(n + 1);
+  double start = now();
+  int result = sv->interpret(n);
+  double elapsed = now() - start;
+  fprintf(report, "stackvm, frame stack engine: sum(%i) = %i: %.3fms\n",
+          n, result, elapsed * 1e3);
+
+  sv->set_max_call_depth(n / 2);
+  sv->interpret(n);
+  fprintf(report, "  with max depth %i: error: %s\n",
+          n / 2, sv->get_error() ? sv->get_error() : "(none)");
+  delete sv;
+}
+
+/* Self-calls turned into loops by regvm::eliminate_self_calls: the
+   frames entered by fib, whose second call goes into an accumulator,
+   and sum, whose only call does, so that even the switch engine, which
+   recurses on the native stack, can run it to any depth, as can the
+   compiled code.  */
+static void
+bench_self_calls(int fib_n, int sum_n)
+{
+  stackvm::module *fib = make_fibonacci_module();
+  regvm::module *naive = fib->compile_to_regvm_optimized();
+  regvm::module *looped = naive->optimize();
+  long frames[2];
+  for (int i = 0; i < 2; i++) {
+    regvm::vm rv(i ? looped : naive);
+    rv.interpret<count_trace>(fib_n);
+    frames[i] = rv.get_counts().m_frames;
+  }
+  fprintf(report, "self calls: fib(%i) enters %li frames (vs %li)\n",
+          fib_n, frames[1], frames[0]);
+  delete looped;
+  delete naive;
+  delete fib;
+
+  stackvm::module *sum = make_sum_module();
+  naive = sum->compile_to_regvm_optimized();
+  looped = naive->optimize();
+  regvm::vm rv(looped);
+  double start = now();
+  int result = rv.interpret(sum_n);
+  fprintf(report, "self calls: regvm, switch engine: sum(%i) = %i: %.3fms\n",
+          sum_n, result, (now() - start) * 1e3);
+  compiled_code code = (compiled_code)looped->compile(0);
+  if (code) {
+    start = now();
+    result = code(sum_n);
+    fprintf(report, "self calls: compiled: sum(%i) = %i: %.3fms\n",
+            sum_n, result, (now() - start) * 1e3);
+  }
+  delete looped;
+  delete naive;
+  delete sum;
+}
+
+/* Time JIT compilation of freshly-lowered copies of a module with
+   various options, along with a repeated (cached) compile.  */
+static void
+bench_jit_compile(stackvm::module *smod, int num_fns)
+{
+  regvm::jit_options unoptimized;
+  unoptimized.m_optimization_level = 0;
+  regvm::jit_options debuginfo;
+  debuginfo.m_debuginfo = true;
+
+  const struct {
+    const char *m_name;
+    regvm::jit_options m_opts;
+  } profiles[] = {
+    {"default", regvm::jit_options()},
+    {"-O0", unoptimized},
+    {"debuginfo", debuginfo},
+    {"verbose", regvm::jit_options::verbose()},
+  };
+  for (unsigned i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+    double total = 0;
+    for (int j = 0; j < num_fns; j++) {
+      regvm::module *code = smod->compile_to_regvm_optimized();
+      double start = now();
+      code->compile(0, profiles[i].m_opts);
+      total += now() - start;
+      delete code;
+    }
+    fprintf(report, "jit, %s profile: %.3fms per function\n",
+            profiles[i].m_name, total / num_fns * 1e3);
+  }
+
+  regvm::module *code = smod->compile_to_regvm_optimized();
+  code->compile(0);
+  double start = now();
+  code->compile(0);
+  fprintf(report, "jit, cached: %.6fms\n", (now() - start) * 1e3);
+  delete code;
+}
+
+/* A regvm module with a single function of "num_segments" segments of
+   four instructions, each:
+
+     R1 = R1 + 1;
+     R2 = R1 < R0;
+     IF (R2) GOTO (the next segment);
+     R1 = R1 - 1;
+
+   followed by a return of R1: i.e. two basic blocks per segment, as
+   nothing can be folded away.  */
+static regvm::module *
+make_long_module(int num_segments)
+{
+  using namespace regvm;
+  location loc = {NULL, 0, 0};
+  std::vector<instr> instrs;
+  instrs.push_back(instr(COPY_INT, 1, input(REGISTER, 0), loc));
+  for (int i = 0; i < num_segments; i++) {
+    int next = instrs.size() + 4;
+    instrs.push_back(instr(BINARY_INT_ADD, 1,
+                           input(REGISTER, 1), input(CONSTANT, 1), loc));
+    instrs.push_back(instr(BINARY_INT_COMPARE_LT, 2,
+                           input(REGISTER, 1), input(REGISTER, 0), loc));
+    instrs.push_back(instr(JUMP_ABS_IF_TRUE, 0,
+                           input(REGISTER, 2), input(CONSTANT, next), loc));
+    instrs.push_back(instr(BINARY_INT_SUBTRACT, 1,
+                           input(REGISTER, 1), input(CONSTANT, 1), loc));
+  }
+  instrs.push_back(instr(RETURN_INT, 0, input(REGISTER, 1), loc));
+  module *m = new module();
+  m->add_function(new wordcode(&instrs));
+  return m;
+}
+
+/* Lowering throughput, in functions per second, for a module of
+   "num_fns" functions (alternately fibonacci and sum): each lowering
+   of the whole module, whose functions share an arena, the optimized
+   one again with an arena per function, and module::optimize.  A
+   single lowering of the module takes only a few milliseconds, so each
+   is timed "num_runs" times, and the fastest run is reported.  */
+static void
+bench_lowering(int num_fns, int num_runs)
+{
+  stackvm::module smod;
+  for (int i = 0; i < num_fns; i++) {
+    smod.add_function(i & 1 ? make_sum_bytecode() : make_fibonacci_bytecode());
+  }
+
+  double naive_time = 0, optimized_time = 0;
+  double unshared_time = 0, optimize_time = 0;
+  for (int run = 0; run < num_runs; run++) {
+    double start = now();
+    regvm::module *naive = smod.compile_to_regvm();
+    double elapsed = now() - start;
+    if (run == 0 || elapsed < naive_time) {
+      naive_time = elapsed;
+    }
+
+    start = now();
+    delete smod.compile_to_regvm_optimized();
+    elapsed = now() - start;
+    if (run == 0 || elapsed < optimized_time) {
+      optimized_time = elapsed;
+    }
+
+    start = now();
+    for (int i = 0; i < num_fns; i++) {
+      delete smod.get_function(i)->compile_to_regvm_optimized();
+    }
+    elapsed = now() - start;
+    if (run == 0 || elapsed < unshared_time) {
+      unshared_time = elapsed;
+    }
+
+    start = now();
+    delete naive->optimize();
+    elapsed = now() - start;
+    if (run == 0 || elapsed < optimize_time) {
+      optimize_time = elapsed;
+    }
+    delete naive;
+  }
+
+  fprintf(report,
+          "lowering %i functions: %.0f/s naive, %.0f/s optimized"
+          " (%.0f/s with an arena each), %.0f/s through module::optimize\n",
+          num_fns, num_fns / naive_time, num_fns / optimized_time,
+          num_fns / unshared_time, num_fns / optimize_time);
+}
+
+/* JIT compile time against the length of the function, with a
+   gcc_jit_block per basic block, and with one per instruction.  */
+static void
+bench_jit_blocks()
+{
+  regvm::jit_options per_instr;
+  per_instr.m_block_per_instr = true;
+
+  const int lengths[] = {10, 100, 1000, 4000};
+  for (unsigned i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    double times[2];
+    int num_instrs = 0;
+    for (int j = 0; j < 2; j++) {
+      regvm::module *m = make_long_module(lengths[i]);
+      num_instrs = m->get_function(0)->get_num_instrs();
+      double start = now();
+      m->compile(0, j ? per_instr : regvm::jit_options());
+      times[j] = now() - start;
+      delete m;
+    }
+    fprintf(report,
+            "jit blocks, %i instructions: %.3fms per basic block,"
+            " %.3fms per instruction\n",
+            num_instrs, times[0] * 1e3, times[1] * 1e3);
+  }
+}
+
+/* Startup with a disk_cache: compiling the module into an empty cache
+   ("cold"), against loading it from there in a later run ("warm"),
+   with a compile without the cache for comparison.  Each module is
+   deleted before the next is made, so that the warm load isn't
+   satisfied by the object which the cold run still has open.  */
+static void
+bench_disk_cache(stackvm::module *smod)
+{
+  char dir[] = "/tmp/jitbench-cache-XXXXXX";
+  if (!mkdtemp(dir)) {
+    fprintf(report, "disk cache: couldn't create %s\n", dir);
+    return;
+  }
+  disk_cache cache(dir, 64 * 1024 * 1024);
+
+  const char *names[] = {"uncached", "cold", "warm"};
+  for (int i = 0; i < 3; i++) {
+    regvm::module *code = smod->compile_to_regvm_optimized();
+    if (i > 0) {
+      code->set_disk_cache(&cache);
+    }
+    double start = now();
+    code->compile(0);
+    fprintf(report, "disk cache, %s: %.3fms\n",
+            names[i], (now() - start) * 1e3);
+    delete code;
+  }
+  fprintf(report, "disk cache: %li hits, %li misses\n",
+          cache.get_num_hits(), cache.get_num_misses());
+
+  cache.clear();
+  rmdir(dir);
+}
+
+static void
+report_batch(const char *name, const char *program, size_t n,
+             double single, double batch,
+             const int *out, const int *expected, size_t num_done)
+{
+  fprintf(report,
+          "batch, %s: %s over %zu inputs: %.1fns/call single,"
+          " %.1fns/call batched, speedup %.2fx\n",
+          name, program, n, single / n * 1e9, batch / n * 1e9,
+          single / batch);
+  if (num_done != n) {
+    fprintf(report, "  FAILED after %zu inputs\n", num_done);
+  }
+  for (size_t i = 0; i < num_done; i++) {
+    if (out[i] != expected[i]) {
+      fprintf(report, "  MISMATCH at %zu: %i vs %i\n",
+              i, out[i], expected[i]);
+      break;
+    }
+  }
+}
+
+/* Compare a loop of single calls to "interpret" with one call to
+   "interpret_batch", for a vm with its engine already selected.  */
+template <class VM>
+static void
+bench_batch_vm(const char *name, const char *program, VM *v,
+               const int *in, int *out, const int *expected, size_t n)
+{
+  double start = now();
+  for (size_t i = 0; i < n; i++) {
+    out[i] = v->interpret(in[i]);
+  }
+  double single = now() - start;
+
+  start = now();
+  size_t num_done = v->interpret_batch(in, out, n);
+  double batch = now() - start;
+  report_batch(name, program, n, single, batch, out, expected, num_done);
+}
+
+/* Batch throughput of each engine, and of the JIT, on a module's
+   function 0 over the given inputs.  */
+static void
+bench_batch(const char *program, stackvm::module *smod,
+            const int *in, size_t n)
+{
+  int *expected = new int[n];
+  int *out = new int[n];
+
+  stackvm::vm *sv = new stackvm::vm(smod);
+  for (size_t i = 0; i < n; i++) {
+    expected[i] = sv->interpret(in[i]);
+  }
+
+  static const struct {
+    const char *m_name;
+    enum stackvm::engine m_engine;
+  } engines[] = {
+    {"stackvm switch", stackvm::ENGINE_SWITCH},
+    {"stackvm threaded", stackvm::ENGINE_THREADED},
+    {"stackvm frame stack", stackvm::ENGINE_FRAME_STACK},
+  };
+  for (unsigned i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+    sv->set_engine(engines[i].m_engine);
+    bench_batch_vm(engines[i].m_name, program, sv, in, out, expected, n);
+  }
+  delete sv;
+
+  regvm::module *regcode = smod->compile_to_regvm_optimized();
+  regvm::vm *rv = new regvm::vm(regcode);
+  bench_batch_vm("regvm switch", program, rv, in, out, expected, n);
+  rv->set_engine(regvm::ENGINE_FRAME_STACK);
+  bench_batch_vm("regvm frame stack", program, rv, in, out, expected, n);
+  delete rv;
+
+  compiled_code code = (compiled_code)regcode->compile(0);
+  compiled_batch batch_code = (compiled_batch)regcode->compile_batch(0);
+  if (code && batch_code) {
+    double start = now();
+    for (size_t i = 0; i < n; i++) {
+      out[i] = code(in[i]);
+    }
+    double single = now() - start;
+
+    start = now();
+    batch_code(in, out, n);
+    double batch = now() - start;
+    report_batch("jit", program, n, single, batch, out, expected, n);
+  }
+  delete regcode;
+
+  delete[] out;
+  delete[] expected;
+}
+
+/* The naive lowering before and after the wordcode optimizer: its
+   size, the speed of interpreting it, and the time taken to compile
+   it.  */
+static void
+bench_wordcode_optimizer(stackvm::module *smod, int n)
+{
+  regvm::module *naive = smod->compile_to_regvm();
+  regvm::module *simplified = naive->optimize();
+  fprintf(report, "wordcode optimizer: %i instructions (vs %i)\n",
+          simplified->get_function(0)->get_num_instrs(),
+          naive->get_function(0)->get_num_instrs());
+
+  const struct {
+    const char *m_name;
+    regvm::module *m_module;
+  } versions[] = {
+    {"unoptimized", naive},
+    {"optimized", simplified},
+  };
+  for (unsigned i = 0; i < sizeof(versions) / sizeof(versions[0]); i++) {
+    regvm::vm rv(versions[i].m_module);
+    rv.set_engine(regvm::ENGINE_FRAME_STACK);
+    double start = now();
+    int result = rv.interpret(n);
+    double interpreted = now() - start;
+
+    start = now();
+    versions[i].m_module->compile(0);
+    double compile_time = now() - start;
+    fprintf(report,
+            "wordcode optimizer, %s: fib(%i) = %i: %.3fms interpreted,"
+            " %.3fms to compile\n",
+            versions[i].m_name, n, result, interpreted * 1e3,
+            compile_time * 1e3);
+  }
+  delete simplified;
+  delete naive;
+}
+
+/* Compiled code with and without a branch_profile, gathered by
+   interpreting a call with "train_arg", then timed over "num_calls"
+   calls with "arg".  The profile of each jump is written too, as the
+   hints only help where the jumps are biased: fib's base case is
+   taken about as often as not, whereas a loop's exit test rarely is.  */
+static void
+bench_branch_profile(const char *program, stackvm::module *smod,
+                     int train_arg, int arg, int num_calls)
+{
+  regvm::module *regcode = smod->compile_to_regvm_optimized();
+  regvm::branch_profile profile;
+  regvm::vm rv(regcode);
+  rv.set_branch_profile(&profile);
+  rv.interpret<regvm::branch_trace>(train_arg);
+  profile.write(report);
+
+  regvm::jit_options guided;
+  guided.m_branch_profile = &profile;
+  double times[2];
+  int result = 0;
+  for (int i = 0; i < 2; i++) {
+    compiled_code code =
+      (compiled_code)regcode->compile(0, i ? guided : regvm::jit_options());
+    if (!code) {
+      fprintf(report, "branch profile, %s: compilation failed\n", program);
+      delete regcode;
+      return;
+    }
+    double start = now();
+    for (int j = 0; j < num_calls; j++) {
+      result += code(arg);
+    }
+    times[i] = now() - start;
+  }
+  fprintf(report,
+          "branch profile, %s(%i) x %i: %.3fms unguided, %.3fms guided"
+          " (checksum %i)\n",
+          program, arg, num_calls, times[0] * 1e3, times[1] * 1e3, result);
+  delete regcode;
+}
+
+/* fib(n) for n in 30..40, with and without memoization of CALL_INT.
+   Unmemoized, the interpreters take too long beyond
+   "max_unmemoized_interpreted", so they are skipped there.  Each
+   memoized run starts with empty caches: the JIT's caches live in the
+   compiled code, so that is compiled afresh for each run.  */
+static void
+bench_memoize(stackvm::module *smod, int max_unmemoized_interpreted)
+{
+  regvm::module *regcode = smod->compile_to_regvm_optimized();
+  regvm::vm rv(regcode);
+  rv.set_engine(regvm::ENGINE_FRAME_STACK);
+
+  regvm::jit_options memoized;
+  memoized.m_memoize = true;
+  compiled_code code = (compiled_code)regcode->compile(0);
+
+  for (int n = 30; n <= 40; n += 2) {
+    if (n <= max_unmemoized_interpreted) {
+      rv.set_memoize(false);
+      double start = now();
+      int result = rv.interpret(n);
+      fprintf(report, "memoize, regvm: fib(%i) = %i: %.3fms unmemoized\n",
+              n, result, (now() - start) * 1e3);
+    }
+
+    rv.set_memoize(true);
+    double start = now();
+    int result = rv.interpret(n);
+    fprintf(report, "memoize, regvm: fib(%i) = %i: %.3fms memoized\n",
+            n, result, (now() - start) * 1e3);
+
+    regvm::module *memo_regcode = smod->compile_to_regvm_optimized();
+    compiled_code memo_code =
+      (compiled_code)memo_regcode->compile(0, memoized);
+    if (code && memo_code) {
+      start = now();
+      result = code(n);
+      double unmemoized = now() - start;
+      start = now();
+      int memo_result = memo_code(n);
+      double memoized = now() - start;
+      fprintf(report,
+              "memoize, jit: fib(%i) = %i: %.3fms unmemoized,"
+              " %.3fms memoized\n",
+              n, result, unmemoized * 1e3, memoized * 1e3);
+      if (result != memo_result) {
+        fprintf(report, "  MISMATCH: %i vs %i\n", memo_result, result);
+      }
+    }
+    delete memo_regcode;
+  }
+  rv.set_memoize(false);
+  delete regcode;
+}
+
+/* Time a batch on thread pools of 1, 2, 4... up to "max_threads"
+   threads, reporting the speedup over a single thread.  */
+static void
+bench_scaling(const char *name, batch_runner *runner,
+              const int *in, int *out, const int *expected, size_t n,
+              int max_threads)
+{
+  double base_time = 0;
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    thread_pool pool(threads);
+    double start = now();
+    bool ok = pool.run_batch(runner, in, out, n, 16);
+    double elapsed = now() - start;
+    if (threads == 1) {
+      base_time = elapsed;
+    }
+    fprintf(report,
+            "parallel, %s: %i threads: %.3fms, speedup %.2fx, %li steals\n",
+            name, threads, elapsed * 1e3, base_time / elapsed,
+            pool.get_num_steals());
+    if (!ok) {
+      fprintf(report, "  FAILED\n");
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (out[i] != expected[i]) {
+        fprintf(report, "  MISMATCH at %zu: %i vs %i\n",
+                i, out[i], expected[i]);
+        break;
+      }
+    }
+  }
+}
+
+/* Scaling of a batch of fibonacci calls across threads, with the cost
+   of each input rising steeply through the batch, so that an even
+   split of the inputs would leave most threads idle.  */
+static void
+bench_parallel(stackvm::module *smod, size_t n)
+{
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+
+  int *in = new int[n];
+  int *out = new int[n];
+  int *expected = new int[n];
+  for (size_t i = 0; i < n; i++) {
+    in[i] = i * 21 / n;
+  }
+  regvm::module *regcode = smod->compile_to_regvm_optimized();
+  regvm::vm rv(regcode);
+  rv.interpret_batch(in, expected, n);
+
+  std::vector<regvm::vm *> vms;
+  for (int i = 0; i < max_threads; i++) {
+    vms.push_back(new regvm::vm(regcode));
+    vms[i]->set_engine(regvm::ENGINE_FRAME_STACK);
+  }
+  vm_batch_runner<regvm::vm> interpreted(vms);
+  bench_scaling("regvm frame stack", &interpreted,
+                in, out, expected, n, max_threads);
+  for (int i = 0; i < max_threads; i++) {
+    delete vms[i];
+  }
+
+  compiled_batch_runner::compiled_batch code =
+    (compiled_batch_runner::compiled_batch)regcode->compile_batch(0);
+  if (code) {
+    compiled_batch_runner compiled(code);
+    bench_scaling("jit", &compiled, in, out, expected, n, max_threads);
+  }
+
+  delete regcode;
+  delete[] expected;
+  delete[] out;
+  delete[] in;
+}
+
+/* The worst-case latency of a call through a runtime which tiers up
+   part-way through, compiling either synchronously or on a jit_queue.  */
+static void
+bench_tier_up(jit_queue *queue, int num_calls)
+{
+  runtime rt;
+  rt.set_threshold(1000);
+  rt.set_jit_queue(queue);
+  int fib = rt.add_function(make_fibonacci_bytecode());
+
+  double total = 0, worst = 0;
+  for (int i = 0; i < num_calls; i++) {
+    double start = now();
+    rt.call(fib, 15);
+    double elapsed = now() - start;
+    total += elapsed;
+    if (elapsed > worst) {
+      worst = elapsed;
+    }
+  }
+  const function_stats &stats = rt.get_stats(fib);
+  fprintf(report,
+          "tier-up, %s: %i calls of fib(15): mean %.3fms, worst %.3fms"
+          " (%li interpreted frames, %li regvm calls, %li compiled calls)\n",
+          queue ? "background" : "synchronous", num_calls,
+          total / num_calls * 1e3, worst * 1e3,
+          stats.m_frames, stats.m_regvm_calls, stats.m_compiled_calls);
+}
+
+/* The benchmark suite: each workload run in each of the three tiers,
+   with the results written to "report" as JSON, for tracking
+   regressions from one build to the next.  */
+
+/* Calling a function in one of the tiers.  */
+struct stackvm_tier
+{
+  stackvm::vm *m_vm;
+  int call(int arg) { return m_vm->interpret(arg); }
+};
+
+struct regvm_tier
+{
+  regvm::vm *m_vm;
+  int call(int arg) { return m_vm->interpret(arg); }
+};
+
+struct jit_tier
+{
+  compiled_code m_code;
+  int call(int arg) { return m_code(arg); }
+};
+
+/* Call the function repeatedly, doubling the number of calls until
+   they take at least MIN_SUITE_TIME, returning the time per call.  */
+static const double MIN_SUITE_TIME = 0.02;
+
+template <class TIER>
+static double
+time_calls(TIER &tier, int arg, int *result)
+{
+  for (long num_calls = 1; ; num_calls *= 2) {
+    double start = now();
+    for (long i = 0; i < num_calls; i++) {
+      *result = tier.call(arg);
+    }
+    double elapsed = now() - start;
+    if (elapsed >= MIN_SUITE_TIME) {
+      return elapsed / num_calls;
+    }
+  }
+}
+
+template <class TIER>
+static bool
+report_tier(const char *name, TIER &tier, int arg, long instrs_per_call,
+            int expected, bool last)
+{
+  int result;
+  double per_call = time_calls(tier, arg, &result);
+  fprintf(report,
+          "        \"%s\": {\"ns_per_call\": %.1f,"
+          " \"guest_instrs_per_sec\": %.0f, \"result\": %i}%s\n",
+          name, per_call * 1e9, instrs_per_call / per_call, result,
+          last ? "" : ",");
+  return result == expected;
+}
+
+static long
+get_peak_rss_kb()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+/* Each workload is run for each of a range of arguments.  Guest
+   instructions are counted in the stackvm tier as bytecode opcodes,
+   and in the others as regvm instructions (the compiled code runs the
+   same regvm code as the regvm tier).  The regvm code is lowered and
+   optimized as the runtime does it.  */
+static void
+bench_suite()
+{
+  static const struct {
+    const char *m_name;
+    const char *m_kind;
+    stackvm::module *(*m_make) ();
+    int m_entry;
+    int m_args[4];
+    int m_num_args;
+  } workloads[] = {
+    {"fib", "calls", make_fibonacci_module, 0, {10, 15, 20, 25}, 4},
+    {"sum", "calls", make_sum_module, 0, {100, 1000, 10000}, 3},
+    {"sum_fib", "calls", make_sum_fib_module, 1, {10, 20}, 2},
+    {"countdown", "loop", make_countdown_module, 0, {1000, 100000, 1000000}, 3},
+    {"linear", "straight-line", make_linear_module, 0, {1000}, 1},
+  };
+  const int num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+
+  fprintf(report, "{\n  \"workloads\": [\n");
+  for (int i = 0; i < num_workloads; i++) {
+    stackvm::module *smod = workloads[i].m_make();
+    regvm::module *lowered = smod->compile_to_regvm();
+    regvm::module *rmod = lowered->optimize();
+    delete lowered;
+
+    double start = now();
+    compiled_code code = (compiled_code)rmod->compile(workloads[i].m_entry);
+    double compile_time = now() - start;
+
+    stackvm::vm sv(smod, workloads[i].m_entry);
+    regvm::vm rv(rmod, workloads[i].m_entry);
+    stackvm_tier stier = {&sv};
+    regvm_tier rtier = {&rv};
+    jit_tier jtier = {code};
+
+    fprintf(report,
+            "    {\"name\": \"%s\", \"kind\": \"%s\","
+            " \"jit_compile_ms\": %.3f, \"runs\": [\n",
+            workloads[i].m_name, workloads[i].m_kind, compile_time * 1e3);
+    for (int j = 0; j < workloads[i].m_num_args; j++) {
+      int arg = workloads[i].m_args[j];
+
+      sv.get_counts() = exec_counts();
+      int expected = sv.interpret<count_trace>(arg);
+      long stackvm_instrs = sv.get_counts().m_opcodes;
+      rv.get_counts() = exec_counts();
+      rv.interpret<count_trace>(arg);
+      long regvm_instrs = rv.get_counts().m_opcodes;
+
+      fprintf(report,
+              "      {\"arg\": %i, \"expected\": %i,"
+              " \"stackvm_instrs_per_call\": %li,"
+              " \"regvm_instrs_per_call\": %li, \"tiers\": {\n",
+              arg, expected, stackvm_instrs, regvm_instrs);
+      bool ok = report_tier("stackvm", stier, arg, stackvm_instrs, expected,
+                            false);
+      ok &= report_tier("regvm", rtier, arg, regvm_instrs, expected, !code);
+      if (code) {
+        ok &= report_tier("jit", jtier, arg, regvm_instrs, expected, true);
+      }
+      fprintf(report, "      }, \"results_match\": %s}%s\n",
+              ok ? "true" : "false",
+              j + 1 < workloads[i].m_num_args ? "," : "");
+    }
+    fprintf(report, "    ], \"peak_rss_kb\": %li}%s\n",
+            get_peak_rss_kb(), i + 1 < num_workloads ? "," : "");
+
+    delete rmod;
+    delete smod;
+  }
+  fprintf(report, "  ],\n  \"peak_rss_kb\": %li\n}\n", get_peak_rss_kb());
+}
+
+int main(int argc, const char **argv)
+{
+  report = fdopen(dup(fileno(stdout)), "w");
+  setvbuf(report, NULL, _IOLBF, 0);
+  if (!freopen("/dev/null", "w", stdout)) {
+    return 1;
+  }
+
+  // "jitbench --json" runs just the suite:
+  if (argc > 1 && strcmp(argv[1], "--json") == 0) {
+    bench_suite();
+    return 0;
+  }
+
+  stackvm::module *smod = make_fibonacci_module();
+  stackvm::vm *sv = new stackvm::vm(smod);
+  regvm::module *regcode = smod->compile_to_regvm();
+  regvm::vm *rv = new regvm::vm(regcode);
+
+  bench_tracing("stackvm", sv, 18);
+  bench_tracing("regvm", rv, 18);
+
+  bench_engines("stackvm", sv, 27);
+
+  stackvm::vm *fv = new stackvm::vm(smod->fuse_superinstructions());
+  bench_engines("stackvm superinstructions", fv, 27);
+
+  bench_regvm_engines("regvm", rv, 27);
+  regvm::module *optcode = smod->compile_to_regvm_optimized();
+  fprintf(report, "optimized lowering: %i instructions (vs %i)\n",
+          optcode->get_function(0)->get_num_instrs(),
+          regcode->get_function(0)->get_num_instrs());
+  regvm::vm *ov = new regvm::vm(optcode);
+  bench_regvm_engines("regvm optimized", ov, 27);
+  bench_wordcode_optimizer(smod, 27);
+  bench_layouts("regvm", rv, 27);
+  bench_layouts("regvm optimized", ov, 27);
+  bench_deep_recursion(1000000);
+  bench_self_calls(20, 1000000);
+  bench_jit_compile(smod, 10);
+  bench_jit_blocks();
+  bench_lowering(2000, 10);
+  bench_disk_cache(smod);
+
+  const size_t num_inputs = 1000000;
+  int *inputs = new int[num_inputs];
+  for (size_t i = 0; i < num_inputs; i++) {
+    inputs[i] = i % 8;
+  }
+  bench_batch("fib(0..7)", smod, inputs, num_inputs);
+  for (size_t i = 0; i < num_inputs; i++) {
+    inputs[i] = i;
+  }
+  stackvm::module *linear = make_linear_module();
+  bench_batch("linear", linear, inputs, num_inputs);
+  delete linear;
+  delete[] inputs;
+
+  bench_parallel(smod, 2400);
+  bench_memoize(smod, 32);
+
+  bench_branch_profile("fib", smod, 20, 25, 10);
+  stackvm::module *countdown = make_countdown_module();
+  bench_branch_profile("countdown", countdown, 3000, 3000000, 100);
+  delete countdown;
+
+  bench_tier_up(NULL, 1000);
+  jit_queue queue;
+  bench_tier_up(&queue, 1000);
+  return 0;
+}
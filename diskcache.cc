@@ -0,0 +1,195 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "libgccjit.h"
+#include "diskcache.h"
+
+/* Temporary files older than this (in seconds) were abandoned by a
+   process which died while writing them.  */
+static const int STALE_TEMP_FILE_AGE = 3600;
+
+/* Identify the libgccjit we're linked against by the path, size and
+   mtime of its file.  */
+static unsigned long long
+get_compiler_id()
+{
+  disk_cache_key key;
+  Dl_info info;
+  struct stat st;
+  if (dladdr((void *)gcc_jit_context_compile, &info)
+      && info.dli_fname
+      && stat(info.dli_fname, &st) == 0) {
+    key.add_string(info.dli_fname);
+    key.add(&st.st_size, sizeof(st.st_size));
+    key.add(&st.st_mtime, sizeof(st.st_mtime));
+  }
+  return key.get();
+}
+
+disk_cache::disk_cache(const char *dir, long max_size)
+  : m_dir(dir),
+    m_max_size(max_size),
+    m_compiler_id(get_compiler_id()),
+    m_num_hits(0),
+    m_num_misses(0),
+    m_num_temp_files(0)
+{
+  // Failure shows up later, as misses and failed insertions:
+  mkdir(dir, 0777);
+}
+
+std::string disk_cache::get_path(unsigned long long key) const
+{
+  char buf[64];
+  sprintf(buf, "/%016llx.so", key ^ m_compiler_id);
+  return m_dir + buf;
+}
+
+void *disk_cache::lookup(unsigned long long key)
+{
+  std::string path = get_path(key);
+  void *handle = NULL;
+  if (access(path.c_str(), R_OK) == 0) {
+    handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  }
+  if (!handle) {
+    __sync_fetch_and_add(&m_num_misses, 1);
+    return NULL;
+  }
+  // Mark it as recently used:
+  utimensat(AT_FDCWD, path.c_str(), NULL, 0);
+  __sync_fetch_and_add(&m_num_hits, 1);
+  return handle;
+}
+
+void *disk_cache::insert(unsigned long long key, gcc_jit_context *ctxt)
+{
+  std::string path = get_path(key);
+  char suffix[64];
+  sprintf(suffix, ".tmp.%i.%i", (int)getpid(),
+          __sync_fetch_and_add(&m_num_temp_files, 1));
+  std::string temp_path = path + suffix;
+
+  gcc_jit_context_compile_to_file (ctxt,
+                                   GCC_JIT_OUTPUT_KIND_DYNAMIC_LIBRARY,
+                                   temp_path.c_str());
+  if (gcc_jit_context_get_first_error (ctxt)) {
+    unlink(temp_path.c_str());
+    return NULL;
+  }
+
+  // Open it before renaming it into place, so that another process
+  // can't evict it in between:
+  void *handle = dlopen(temp_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!handle || rename(temp_path.c_str(), path.c_str()) != 0) {
+    unlink(temp_path.c_str());
+    if (handle) {
+      dlclose(handle);
+    }
+    return NULL;
+  }
+
+  evict();
+  return handle;
+}
+
+struct cached_file
+{
+  std::string m_path;
+  struct timespec m_mtime;
+  long m_size;
+
+  bool operator<(const cached_file &other) const
+  {
+    if (m_mtime.tv_sec != other.m_mtime.tv_sec) {
+      return m_mtime.tv_sec < other.m_mtime.tv_sec;
+    }
+    return m_mtime.tv_nsec < other.m_mtime.tv_nsec;
+  }
+};
+
+/* Does "name" end with "suffix"?  */
+static bool
+ends_with(const char *name, const char *suffix)
+{
+  size_t len = strlen(name);
+  size_t suffix_len = strlen(suffix);
+  return len >= suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+void disk_cache::evict()
+{
+  evict_to(m_max_size);
+}
+
+void disk_cache::clear()
+{
+  evict_to(0);
+}
+
+void disk_cache::evict_to(long max_size)
+{
+  DIR *dir = opendir(m_dir.c_str());
+  if (!dir) {
+    return;
+  }
+  std::vector<cached_file> files;
+  long total_size = 0;
+  time_t now = time(NULL);
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    bool is_temp = strstr(ent->d_name, ".so.tmp.") != NULL;
+    if (!is_temp && !ends_with(ent->d_name, ".so")) {
+      continue;
+    }
+    cached_file f;
+    f.m_path = m_dir + "/" + ent->d_name;
+    struct stat st;
+    if (stat(f.m_path.c_str(), &st) != 0) {
+      continue; // deleted by another process
+    }
+    if (is_temp) {
+      if (now - st.st_mtime > STALE_TEMP_FILE_AGE) {
+        unlink(f.m_path.c_str());
+      }
+      continue;
+    }
+    f.m_mtime = st.st_mtim;
+    f.m_size = st.st_size;
+    files.push_back(f);
+    total_size += f.m_size;
+  }
+  closedir(dir);
+
+  std::sort(files.begin(), files.end());
+  for (unsigned i = 0; i < files.size() && total_size > max_size; i++) {
+    unlink(files[i].m_path.c_str());
+    total_size -= files[i].m_size;
+  }
+}
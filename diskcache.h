@@ -0,0 +1,117 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <string.h>
+#include <string>
+
+struct gcc_jit_context;
+
+/* A directory of shared objects built by libgccjit, which persists
+   between runs, so that a process can dlopen code compiled by an
+   earlier one, rather than compiling it again.
+
+   Each object is named after a 64-bit key, which the caller computes
+   from everything that affects the code (see disk_cache_key), mixed
+   with the identity of the libgccjit in use, so that upgrading the
+   compiler doesn't pick up stale code.
+
+   Any number of processes (and threads) can share a directory.  An
+   object is written to a temporary file of its own and then renamed
+   into place, which is atomic, so a reader sees either a complete
+   object or none at all; if two processes compile the same code at
+   once, the last rename wins, and both objects are good.
+
+   The total size of the objects is capped: after each insertion the
+   least-recently used ones are deleted until the rest fit.  Use is
+   recorded in the mtime of each file, which a lookup touches.
+   Deleting an object that another process has open is harmless, as
+   its mapping outlives the name.  */
+
+class disk_cache
+{
+public:
+  /* Use the given directory (creating it, if need be), keeping at
+     most "max_size" bytes in it.  */
+  disk_cache(const char *dir, long max_size);
+
+  const char *get_dir() const { return m_dir.c_str(); }
+
+  /* dlopen the object for "key", returning its handle, or NULL if it
+     isn't in the cache.  */
+  void *lookup(unsigned long long key);
+
+  /* Compile "ctxt" to an object for "key", and dlopen it, returning
+     the handle, or NULL on failure.  */
+  void *insert(unsigned long long key, gcc_jit_context *ctxt);
+
+  /* Delete the least-recently used objects until the rest fit within
+     the maximum size, along with any abandoned temporary files.  */
+  void evict();
+
+  /* Delete every object in the cache.  */
+  void clear();
+
+  long get_num_hits() const { return m_num_hits; }
+  long get_num_misses() const { return m_num_misses; }
+
+private:
+  std::string get_path(unsigned long long key) const;
+  void evict_to(long max_size);
+
+private:
+  std::string m_dir;
+  long m_max_size;
+  unsigned long long m_compiler_id;
+  long m_num_hits;
+  long m_num_misses;
+  int m_num_temp_files;
+};
+
+/* Building the keys for a disk_cache: a 64-bit FNV-1a hash.  */
+class disk_cache_key
+{
+public:
+  disk_cache_key()
+    : m_hash(14695981039346656037ULL)
+  {}
+
+  void add(const void *data, size_t len)
+  {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+      m_hash ^= bytes[i];
+      m_hash *= 1099511628211ULL;
+    }
+  }
+
+  void add_int(int value) { add(&value, sizeof(value)); }
+
+  /* Strings include their terminator, so that "ab" + "c" doesn't hash
+     the same as "a" + "bc".  NULL hashes as an empty string.  */
+  void add_string(const char *str)
+  {
+    add(str ? str : "", str ? strlen(str) + 1 : 1);
+  }
+
+  unsigned long long get() const { return m_hash; }
+
+private:
+  unsigned long long m_hash;
+};
@@ -0,0 +1,141 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "regvm.h"
+#include "jitqueue.h"
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+jit_queue::jit_queue()
+  : m_stopping(false)
+{
+  pthread_mutex_init(&m_lock, NULL);
+  pthread_cond_init(&m_work_cond, NULL);
+  pthread_cond_init(&m_done_cond, NULL);
+  int err = pthread_create(&m_thread, NULL, worker_main, this);
+  assert(err == 0); // FIXME
+  (void)err;
+}
+
+jit_queue::~jit_queue()
+{
+  pthread_mutex_lock(&m_lock);
+  while (!m_pending.empty()) {
+    finish_job(m_pending.front(), JOB_CANCELLED);
+    m_pending.pop_front();
+  }
+  m_stopping = true;
+  pthread_cond_signal(&m_work_cond);
+  pthread_mutex_unlock(&m_lock);
+
+  pthread_join(m_thread, NULL);
+  pthread_cond_destroy(&m_done_cond);
+  pthread_cond_destroy(&m_work_cond);
+  pthread_mutex_destroy(&m_lock);
+}
+
+jit_job *jit_queue::submit(regvm::module *mod, int fn,
+                           const regvm::jit_options &opts)
+{
+  jit_job *job = new jit_job(mod, fn, opts);
+  pthread_mutex_lock(&m_lock);
+  m_pending.push_back(job);
+  pthread_cond_signal(&m_work_cond);
+  pthread_mutex_unlock(&m_lock);
+  return job;
+}
+
+void jit_queue::cancel(jit_job *job)
+{
+  pthread_mutex_lock(&m_lock);
+  for (std::deque<jit_job *>::iterator it = m_pending.begin();
+       it != m_pending.end();
+       ++it) {
+    if (*it == job) {
+      m_pending.erase(it);
+      finish_job(job, JOB_CANCELLED);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&m_lock);
+  wait(job);
+}
+
+void jit_queue::wait(jit_job *job)
+{
+  pthread_mutex_lock(&m_lock);
+  while (job->get_state() == JOB_PENDING
+         || job->get_state() == JOB_RUNNING) {
+    pthread_cond_wait(&m_done_cond, &m_lock);
+  }
+  pthread_mutex_unlock(&m_lock);
+}
+
+void *jit_queue::worker_main(void *arg)
+{
+  ((jit_queue *)arg)->run_worker();
+  return NULL;
+}
+
+void jit_queue::run_worker()
+{
+  pthread_mutex_lock(&m_lock);
+  while (1) {
+    while (m_pending.empty() && !m_stopping) {
+      pthread_cond_wait(&m_work_cond, &m_lock);
+    }
+    if (m_pending.empty()) {
+      break;
+    }
+    jit_job *job = m_pending.front();
+    m_pending.pop_front();
+    __atomic_store_n(&job->m_state, JOB_RUNNING, __ATOMIC_RELEASE);
+
+    // Compile without holding the lock, so that other threads can
+    // submit and poll meanwhile:
+    pthread_mutex_unlock(&m_lock);
+    double start = now();
+    job->m_code = job->m_module->compile(job->m_fn, job->m_options);
+    job->m_compile_time = now() - start;
+    pthread_mutex_lock(&m_lock);
+
+    finish_job(job, job->m_code ? JOB_DONE : JOB_FAILED);
+  }
+  pthread_mutex_unlock(&m_lock);
+}
+
+/* Publish the outcome of a job, and wake anyone waiting for it.  The
+   caller must hold m_lock.  */
+void jit_queue::finish_job(jit_job *job, enum jit_job_state state)
+{
+  // The release store ensures that a thread seeing the new state also
+  // sees m_code and m_compile_time:
+  __atomic_store_n(&job->m_state, state, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&m_done_cond);
+}
@@ -0,0 +1,129 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+#include <deque>
+#include <pthread.h>
+
+/* Compiling regvm code on a background thread.
+
+   A jit_queue owns one worker thread, which takes jobs from the queue
+   in order and runs module::compile on each.  The thread submitting
+   a job can carry on (e.g. interpreting the same module) and poll
+   jit_job::get_code, which returns NULL until the code is ready.  The
+   result of each job is published with release/acquire atomics, so
+   any thread which sees the code also sees it fully built.
+
+   submit, cancel and wait may be called from any number of threads at
+   once, and jit_job::get_code from any thread.  Compilation happens
+   only on the worker thread, so a module submitted to a queue must
+   not be compiled directly while its job is outstanding, and must
+   outlive the job (see jit_queue::cancel).  */
+
+enum jit_job_state {
+  JOB_PENDING,
+  JOB_RUNNING,
+  JOB_DONE,
+  JOB_FAILED,
+  JOB_CANCELLED,
+};
+
+class jit_job
+{
+public:
+  jit_job(regvm::module *mod, int fn, const regvm::jit_options &opts)
+    : m_module(mod),
+      m_fn(fn),
+      m_options(opts),
+      m_code(NULL),
+      m_compile_time(0),
+      m_state(JOB_PENDING)
+  {}
+
+  enum jit_job_state get_state() const
+  {
+    return (enum jit_job_state)__atomic_load_n(&m_state, __ATOMIC_ACQUIRE);
+  }
+
+  /* The compiled code of the job's function, or NULL if it isn't ready
+     (or compilation failed).  */
+  void *get_code() const
+  {
+    return get_state() == JOB_DONE ? m_code : NULL;
+  }
+
+  /* The time taken by module::compile, in seconds; valid once the job
+     is JOB_DONE or JOB_FAILED.  */
+  double get_compile_time() const { return m_compile_time; }
+
+private:
+  friend class jit_queue;
+
+  regvm::module *m_module;
+  int m_fn;
+  regvm::jit_options m_options;
+  void *m_code;
+  double m_compile_time;
+  int m_state;
+};
+
+class jit_queue
+{
+public:
+  /* Start the worker thread.  */
+  jit_queue();
+
+  /* Cancel any jobs not yet started, finish the current one, and stop
+     the worker thread.  */
+  ~jit_queue();
+
+  /* Queue the module for compilation, for the sake of function "fn",
+     returning a job owned by the caller, which must not delete it until
+     it is finished (or has been cancelled).  */
+  jit_job *submit(regvm::module *mod, int fn,
+                  const regvm::jit_options &opts);
+
+  /* Remove the job from the queue if it hasn't started, otherwise wait
+     for it to finish.  Afterwards, the job and its module can
+     safely be deleted.  */
+  void cancel(jit_job *job);
+
+  /* Block until the job is finished.  */
+  void wait(jit_job *job);
+
+private:
+  static void *worker_main(void *arg);
+  void run_worker();
+  void finish_job(jit_job *job, enum jit_job_state state);
+
+  // Not copyable, as we own a thread:
+  jit_queue(const jit_queue &);
+  jit_queue &operator=(const jit_queue &);
+
+private:
+  pthread_t m_thread;
+
+  /* m_lock guards m_pending and m_stopping.  m_work_cond is signalled
+     when a job is added (or we're stopping), and m_done_cond when a
+     job finishes.  */
+  pthread_mutex_t m_lock;
+  pthread_cond_t m_work_cond;
+  pthread_cond_t m_done_cond;
+  std::deque<jit_job *> m_pending;
+  bool m_stopping;
+};
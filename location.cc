@@ -0,0 +1,110 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "location.h"
+
+filename_pool::~filename_pool()
+{
+  for (unsigned i = 0; i < m_filenames.size(); i++) {
+    free(m_filenames[i]);
+  }
+}
+
+/* There are typically only a handful of source files, so a linear
+   search suffices.  */
+const char *
+filename_pool::intern(const char *filename)
+{
+  if (!filename) {
+    return NULL;
+  }
+  for (unsigned i = 0; i < m_filenames.size(); i++) {
+    if (0 == strcmp(m_filenames[i], filename)) {
+      return m_filenames[i];
+    }
+  }
+  m_filenames.push_back(strdup(filename));
+  return m_filenames.back();
+}
+
+void
+location_table::set(int pc, const char *filename, int linenum, int colnum)
+{
+  run r;
+  r.m_pc = pc;
+  r.m_loc.m_filename = m_filenames.intern(filename);
+  r.m_loc.m_linenum = linenum;
+  r.m_loc.m_colnum = colnum;
+
+  // Find the first run starting at or after pc; locations are usually
+  // set in order, so check the end of the table first:
+  int idx = m_runs.size();
+  if (!m_runs.empty() && m_runs.back().m_pc >= pc) {
+    int lo = 0;
+    int hi = m_runs.size();
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (m_runs[mid].m_pc < pc) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    idx = lo;
+  }
+
+  if (idx < (int)m_runs.size() && m_runs[idx].m_pc == pc) {
+    m_runs[idx].m_loc = r.m_loc;
+  } else {
+    m_runs.insert(m_runs.begin() + idx, r);
+  }
+
+  // Merge with neighbouring runs that have the same location:
+  if (idx + 1 < (int)m_runs.size() && m_runs[idx + 1].m_loc == r.m_loc) {
+    m_runs.erase(m_runs.begin() + idx + 1);
+  }
+  if (idx > 0 && m_runs[idx - 1].m_loc == r.m_loc) {
+    m_runs.erase(m_runs.begin() + idx);
+  }
+}
+
+const location &
+location_table::lookup(int pc) const
+{
+  static const location unknown = {NULL, 0, 0};
+
+  // Find the last run starting at or before pc:
+  int lo = 0;
+  int hi = m_runs.size();
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (m_runs[mid].m_pc <= pc) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) {
+    return unknown;
+  }
+  return m_runs[lo - 1].m_loc;
+}
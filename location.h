@@ -20,12 +20,79 @@
 #ifndef LOCATION_H
 #define LOCATION_H
 
+#include <vector>
+
 /* Location within source code, for use in debuginfo.  */
 struct location
 {
   const char *m_filename;
   int m_linenum;
   int m_colnum;
+
+  bool operator==(const location &other) const
+  {
+    return (m_filename == other.m_filename
+            && m_linenum == other.m_linenum
+            && m_colnum == other.m_colnum);
+  }
+  bool operator!=(const location &other) const { return !(*this == other); }
+};
+
+/* A set of filenames, each held as a copy of our own, so that
+   locations referring to them needn't depend on the caller keeping
+   theirs alive.  */
+class filename_pool
+{
+public:
+  filename_pool() {}
+  ~filename_pool();
+
+  /* Find our copy of "filename" (which may be NULL), making one if this
+     is the first time we've seen it.  */
+  const char *intern(const char *filename);
+
+private:
+  // Not copyable, as we own the filenames:
+  filename_pool(const filename_pool &);
+  filename_pool &operator=(const filename_pool &);
+
+private:
+  std::vector<char *> m_filenames;
+};
+
+/* A map from pc to location, held as a sorted table of runs: a location
+   applies from the pc it was set for up to the next pc that has one,
+   and consecutive pcs with the same location share a single run.  Hence
+   the space used grows with the number of distinct source lines, rather
+   than with the length of the code.  Filenames are interned into the
+   table's own filename_pool.  */
+class location_table
+{
+public:
+  location_table() {}
+
+  void set(int pc, const char *filename, int linenum, int colnum);
+
+  /* Find the location of "pc", by binary search.  A pc before any
+     location was set gets a location with a NULL filename.  */
+  const location &lookup(int pc) const;
+
+  int get_num_runs() const { return m_runs.size(); }
+
+private:
+  // Not copyable, as we own the interned filenames:
+  location_table(const location_table &);
+  location_table &operator=(const location_table &);
+
+  struct run
+  {
+    int m_pc;
+    location m_loc;
+  };
+
+private:
+  std::vector<run> m_runs;
+  filename_pool m_filenames;
 };
 
 #endif
@@ -19,120 +19,251 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "stackvm.h"
 #include "regvm.h"
-
-/*
-   Simple recursive fibonacci implementation, roughly equivalent to:
-
-   int fibonacci(int arg)
-   {
-      if (arg < 2) {
-          return arg
-      }
-      return fibonacci(arg-1) + fibonacci(arg-2)
-   }
- */
-using namespace stackvm;
-const int FIRST_LINE = __LINE__ + 5;
-const char fibonacci[] = {
-  // stack: [arg]
-
-  // 0:
-  DUP,
-  // stack: [arg, arg]
-
-  // 1:
-  PUSH_INT_CONST, 2,
-  // stack: [arg, arg, 2]
-
-  // 3:
-  BINARY_INT_COMPARE_LT,
-  // stack: [arg, (arg < 2)]
-
-  // 4:
-  JUMP_ABS_IF_TRUE, 17,
-  // stack: [arg]
-
-  // 6:
-  DUP,
-  // stack: [arg, arg]
-
-  // 7:
-  PUSH_INT_CONST,  1,
-  // stack: [arg, arg, 1]
-
-  // 9:
-  BINARY_INT_SUBTRACT,
-  // stack: [arg,  (arg - 1)
-
-  // 10:
-  CALL_INT,
-  // stack: [arg, fib(arg - 1)]
-
-  // 11:
-  ROT,
-  // stack: [fib(arg - 1), arg]
-
-  // 12:
-  PUSH_INT_CONST,  2,
-  // stack: [fib(arg - 1), arg, 2]
-
-  // 14:
-  BINARY_INT_SUBTRACT,
-  // stack: [fib(arg - 1), arg,  (arg - 2)
-
-  // 15:
-  CALL_INT,
-  // stack: [fib(arg - 1), fib(arg - 1)]
-
-  // 16:
-  BINARY_INT_ADD,
-  // stack: [fib(arg - 1) + fib(arg - 1)]
-
-  // 17:
-  RETURN_INT
-};
+#include "programs.h"
+#include "profile.h"
+#include "runtime.h"
 
 typedef int (*compiled_code) (int);
+typedef void (*compiled_batch) (const int *in, int *out, size_t n);
+
+/* The number of failed checks; the demo exits with a non-zero status
+   if there are any.  */
+static int num_failures;
+
+static void
+check(bool ok, const char *what)
+{
+  if (!ok) {
+    printf("FAILED: %s\n", what);
+    num_failures++;
+  }
+}
+
+/* Check that the stackvm engines, both lowerings of "smod", and the
+   wordcode optimizer, all give the same results from function "entry",
+   for inputs "lo" to "hi".  */
+static void
+check_lowerings(const char *name, stackvm::module *smod, int entry,
+                int lo, int hi)
+{
+  regvm::module *naive = smod->compile_to_regvm();
+  regvm::module *optimized = smod->compile_to_regvm_optimized();
+  regvm::module *simplified = naive->optimize();
+  stackvm::vm sv(smod, entry), tv(smod, entry), fv(smod, entry);
+  tv.set_engine(stackvm::ENGINE_THREADED);
+  fv.set_engine(stackvm::ENGINE_FRAME_STACK);
+  regvm::vm nv(naive, entry), ov(optimized, entry);
+  regvm::vm simplified_vm(simplified, entry);
+  bool ok = true;
+  for (int i = lo; i <= hi; i++) {
+    int expected = sv.interpret(i);
+    if (tv.interpret(i) != expected
+        || fv.interpret(i) != expected
+        || nv.interpret(i) != expected
+        || ov.interpret(i) != expected
+        || simplified_vm.interpret(i) != expected) {
+      ok = false;
+    }
+  }
+  printf("%s: lowerings %s\n", name, ok ? "agree" : "differ");
+  check(ok, name);
+  delete simplified;
+  delete optimized;
+  delete naive;
+}
+
+/* Check location_table::lookup, and that lowered code keeps its
+   locations after the bytecode it came from has gone.  */
+static void
+check_locations()
+{
+  // The table keeps its own copies of the filenames:
+  char filename[16];
+  location_table table;
+  strcpy(filename, "a.c");
+  table.set(2, filename, 10, 1);
+  table.set(4, filename, 10, 1); // merged into the run from 2
+  strcpy(filename, "b.c");
+  table.set(6, filename, 20, 2);
+  strcpy(filename, "x.c");
+  check(table.get_num_runs() == 2, "location runs are merged");
+  check(table.lookup(0).m_filename == NULL,
+        "no location before the first run");
+  check(0 == strcmp(table.lookup(2).m_filename, "a.c")
+        && table.lookup(2).m_linenum == 10,
+        "location at the start of a run");
+  check(0 == strcmp(table.lookup(5).m_filename, "a.c")
+        && table.lookup(5).m_linenum == 10,
+        "location in the middle of a run");
+  check(0 == strcmp(table.lookup(7).m_filename, "b.c")
+        && table.lookup(7).m_linenum == 20,
+        "location after the last run");
+
+  stackvm::module *smod = make_fibonacci_module();
+  regvm::module *lowered = smod->compile_to_regvm_optimized();
+  delete smod;
+  const char *lowered_filename =
+    lowered->get_function(0)->get_location(0).m_filename;
+  check(lowered_filename && strstr(lowered_filename, "programs.cc"),
+        "lowered code outlives its bytecode's locations");
+  delete lowered;
+}
+
+static void
+print_tier_up(void *, int fn, const function_stats &stats)
+{
+  printf("tier-up: function %i after %li frames, %li backward jumps:"
+         " %s in %.3fms\n",
+         fn, stats.m_frames, stats.m_backward_jumps,
+         stats.m_tier == TIER_COMPILED ? "compiled" : "failed",
+         stats.m_compile_time * 1e3);
+}
 
 int main(int argc, const char **argv)
 {
-  stackvm::bytecode * scode = new stackvm::bytecode(fibonacci,
-                                                    sizeof(fibonacci));
-
-  /* Set up line-numbering in bytecode to point into the array
-     initializer above, so that stepping through the JIT-generated
-     code in the debugger will step through the above.
-     We do it "by hand" here; in a real interpreter you'd presumably set
-     this up with information from your parser.  */
-  scode->set_location(0, __FILE__, FIRST_LINE + 0, 2);
-  scode->set_location(1, __FILE__, FIRST_LINE + 4, 2);
-  scode->set_location(3, __FILE__, FIRST_LINE + 8, 2);
-  scode->set_location(4, __FILE__, FIRST_LINE + 12, 2);
-  scode->set_location(6, __FILE__, FIRST_LINE + 16, 2);
-  scode->set_location(7, __FILE__, FIRST_LINE + 20, 2);
-  scode->set_location(9, __FILE__, FIRST_LINE + 24, 2);
-  scode->set_location(10, __FILE__, FIRST_LINE + 28, 2);
-  scode->set_location(11, __FILE__, FIRST_LINE + 32, 2);
-  scode->set_location(12, __FILE__, FIRST_LINE + 36, 2);
-  scode->set_location(14, __FILE__, FIRST_LINE + 40, 2);
-  scode->set_location(15, __FILE__, FIRST_LINE + 44, 2);
-  scode->set_location(16, __FILE__, FIRST_LINE + 48, 2);
-  scode->set_location(17, __FILE__, FIRST_LINE + 52, 2);
-
-  scode->disassemble(stdout);
-
-  stackvm::vm *sv = new stackvm::vm(scode);
-  printf("sv->interpret(8) = %i\n", sv->interpret(8));
-
-  regvm::wordcode * regcode = scode->compile_to_regvm();
+  bool trace = false;
+  bool profile = false;
+  regvm::jit_options jit_opts;
+  for (int i = 1; i < argc; i++) {
+    if (0 == strcmp(argv[i], "--trace")) {
+      trace = true;
+    } else if (0 == strcmp(argv[i], "--profile")) {
+      profile = true;
+    } else if (0 == strcmp(argv[i], "--dump-jit")) {
+      jit_opts = regvm::jit_options::verbose();
+    }
+  }
+
+  stackvm::module *smod = make_fibonacci_module();
+
+  smod->disassemble(stdout);
+
+  stackvm::vm *sv = new stackvm::vm(smod);
+  printf("sv->interpret(8) = %i\n",
+         trace ? sv->interpret<stdout_trace>(8) : sv->interpret(8));
+  sv->set_engine(stackvm::ENGINE_THREADED);
+  printf("sv->interpret(8) [threaded] = %i\n", sv->interpret(8));
+  sv->set_engine(stackvm::ENGINE_FRAME_STACK);
+  printf("sv->interpret(8) [frame stack] = %i\n", sv->interpret(8));
+
+  stackvm::module *fused = smod->fuse_superinstructions();
+  fused->disassemble(stdout);
+  stackvm::vm *fv = new stackvm::vm(fused);
+  printf("fv->interpret(8) = %i\n", fv->interpret(8));
+
+  regvm::module * regcode = smod->compile_to_regvm();
   regcode->disassemble(stdout);
 
   regvm::vm *rv = new regvm::vm(regcode);
-  printf("rv->interpret(8) = %i\n", rv->interpret(8));
+  printf("rv->interpret(8) = %i\n",
+         trace ? rv->interpret<stdout_trace>(8) : rv->interpret(8));
+  rv->set_engine(regvm::ENGINE_FRAME_STACK);
+  printf("rv->interpret(8) [frame stack] = %i\n", rv->interpret(8));
+
+  // The same code, after the wordcode optimizer:
+  regvm::module *simplified = regcode->optimize();
+  simplified->disassemble(stdout);
+  printf("wordcode optimizer: %i instructions (vs %i)\n",
+         simplified->get_function(0)->get_num_instrs(),
+         regcode->get_function(0)->get_num_instrs());
+  regvm::vm *simplified_vm = new regvm::vm(simplified);
+  printf("simplified_vm->interpret(8) = %i\n", simplified_vm->interpret(8));
+
+  regvm::module *optcode = smod->compile_to_regvm_optimized();
+  optcode->disassemble(stdout);
+  printf("optimized lowering: %i instructions (vs %i)\n",
+         optcode->get_function(0)->get_num_instrs(),
+         regcode->get_function(0)->get_num_instrs());
+  check(optcode->get_function(0)->get_num_instrs()
+        < regcode->get_function(0)->get_num_instrs(),
+        "optimized lowering is shorter");
+
+  regvm::vm *ov = new regvm::vm(optcode);
+  printf("ov->interpret(8) = %i\n", ov->interpret(8));
 
-  compiled_code code = (compiled_code)regcode->compile();
+  compiled_code code = (compiled_code)regcode->compile(0, jit_opts);
   printf("code (8) = %i\n", code (8));
+
+  // The lowerings must agree with the stackvm, including on code they
+  // find awkward:
+  check_lowerings("fibonacci", smod, 0, 0, 12);
+  check_lowerings("sum_fib", make_sum_fib_module(), 1, 0, 12);
+  check_lowerings("late_target", make_late_target_module(), 0, -5, 5);
+  check_lowerings("dead_code", make_dead_code_module(), 0, -5, 5);
+  check_lowerings("far_call", make_far_call_module(), 0, -5, 5);
+  check_locations();
+
+  // Evaluating the function over an array of inputs at once:
+  int inputs[10], outputs[10];
+  for (int i = 0; i < 10; i++) {
+    inputs[i] = i;
+  }
+  ov->interpret_batch(inputs, outputs, 10);
+  printf("ov->interpret_batch(0..9) =");
+  for (int i = 0; i < 10; i++) {
+    printf(" %i", outputs[i]);
+  }
+  printf("\n");
+  compiled_batch batch_code =
+    (compiled_batch)regcode->compile_batch(0, jit_opts);
+  batch_code(inputs, outputs, 10);
+  printf("batch_code (0..9) =");
+  for (int i = 0; i < 10; i++) {
+    printf(" %i", outputs[i]);
+  }
+  printf("\n");
+
+  // A module of two functions, one calling the other:
+  stackvm::module *sum_fib = make_sum_fib_module();
+  sum_fib->disassemble(stdout);
+  stackvm::vm *sfv = new stackvm::vm(sum_fib, 1);
+  printf("sfv->interpret(8) = %i\n", sfv->interpret(8));
+  regvm::module *sum_fib_code = sum_fib->compile_to_regvm_optimized();
+  regvm::vm *sfrv = new regvm::vm(sum_fib_code, 1);
+  printf("sfrv->interpret(8) = %i\n", sfrv->interpret(8));
+  code = (compiled_code)sum_fib_code->compile(1, jit_opts);
+  printf("code (8) = %i\n", code (8));
+
+  // Where the interpreters spend their time, written as a report, and
+  // as folded stacks for flamegraph.pl:
+  if (profile) {
+    exec_profile sprof, rprof;
+    sfv->set_profile(&sprof);
+    sfv->interpret<profile_trace>(20);
+    printf("stackvm profile of sum_fib(20):\n");
+    sprof.write_report(stdout);
+    sfrv->set_profile(&rprof);
+    sfrv->interpret<profile_trace>(20);
+    printf("regvm profile of sum_fib(20):\n");
+    rprof.write_report(stdout);
+
+    FILE *f = fopen("stackvm.folded", "w");
+    if (f) {
+      sprof.write_folded(f);
+      fclose(f);
+    }
+    f = fopen("regvm.folded", "w");
+    if (f) {
+      rprof.write_folded(f);
+      fclose(f);
+    }
+  }
+
+  // The same again, but letting a runtime decide when to compile:
+  runtime rt;
+  rt.set_threshold(100);
+  rt.set_jit_options(jit_opts);
+  rt.set_tier_up_callback(print_tier_up, NULL);
+  int fib = rt.add_function(make_fibonacci_bytecode());
+  for (int i = 0; i < 12; i++) {
+    printf("rt.call(fib, %i) = %i\n", i, rt.call(fib, i));
+  }
+  printf("%li interpreted frames, %li compiled calls\n",
+         rt.get_stats(fib).m_frames, rt.get_stats(fib).m_compiled_calls);
+
+  return num_failures ? 1 : 0;
 }
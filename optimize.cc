@@ -0,0 +1,756 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+/* Optimization of regvm code.
+
+   We split the instructions into basic blocks, at jump targets and
+   after jumps and returns, and then repeatedly run these passes until
+   none of them finds anything more to do:
+
+     * constant propagation and folding: inputs which are known to hold
+       a constant become CONSTANT inputs, arithmetic on constants is
+       done at compile-time, and conditional jumps on a constant become
+       either unconditional ("IF (1)") or are deleted
+
+     * copy propagation: reads of the destination of a copy are
+       replaced with reads of its source, while both are unchanged
+
+     * dead-store elimination: instructions writing registers which
+       are never read again are deleted (other than calls)
+
+     * removal of unreachable instructions, and of jumps to the next
+       instruction
+
+   Constant and copy propagation are global, using the usual
+   iterative dataflow over the blocks; blocks not yet reached contribute
+   nothing at a join, so that values flowing around loops are found.
+   Deleted instructions are removed with remove_instrs, which fixes up
+   the jump destinations; the survivors keep their locations.
+
+   eliminate_self_calls is separate, as it needs to know which function
+   the instructions belong to; module::optimize runs it after the
+   others, and then runs them again to clean up after it.  */
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "regvm.h"
+
+using namespace regvm;
+
+/* A range of instructions [m_begin, m_end) with a single entry point
+   (the first) and exit point (the last).  */
+struct basic_block
+{
+  int m_begin;
+  int m_end;
+  std::vector<int> m_succs;
+  std::vector<int> m_preds;
+};
+
+/* Does the instruction read its second input as a value?  (For jumps
+   it's the destination, and for calls the function index.)  */
+static bool
+reads_input_b(const instr &ins)
+{
+  return (ins.get_num_inputs() == 2
+          && ins.m_op != JUMP_ABS_IF_TRUE
+          && ins.m_op != CALL_INT);
+}
+
+static int
+count_registers(const std::vector<instr> &instrs)
+{
+  int num_regs = 1; // the argument
+  for (unsigned pc = 0; pc < instrs.size(); pc++) {
+    const instr &ins = instrs[pc];
+    if (ins.has_output() && ins.m_output_reg >= num_regs) {
+      num_regs = ins.m_output_reg + 1;
+    }
+    if (ins.m_inputA.m_addrmode == REGISTER
+        && ins.m_inputA.m_value >= num_regs) {
+      num_regs = ins.m_inputA.m_value + 1;
+    }
+    if (reads_input_b(ins)
+        && ins.m_inputB.m_addrmode == REGISTER
+        && ins.m_inputB.m_value >= num_regs) {
+      num_regs = ins.m_inputB.m_value + 1;
+    }
+  }
+  return num_regs;
+}
+
+/* Split the instructions into basic blocks, in order, and link them by
+   their possible successors, taking account of jumps on constants.  */
+static void
+build_cfg(const std::vector<instr> &instrs, std::vector<basic_block> &blocks)
+{
+  int n = instrs.size();
+  std::vector<bool> is_leader(n + 1, false);
+  is_leader[0] = true;
+  for (int pc = 0; pc < n; pc++) {
+    const instr &ins = instrs[pc];
+    if (ins.m_op == JUMP_ABS_IF_TRUE) {
+      assert(ins.m_inputB.m_addrmode == CONSTANT);
+      is_leader[ins.m_inputB.m_value] = true;
+      is_leader[pc + 1] = true;
+    } else if (ins.m_op == RETURN_INT) {
+      is_leader[pc + 1] = true;
+    }
+  }
+
+  std::vector<int> block_of(n + 1, -1);
+  blocks.clear();
+  for (int pc = 0; pc < n; pc++) {
+    if (is_leader[pc]) {
+      basic_block b;
+      b.m_begin = b.m_end = pc;
+      blocks.push_back(b);
+    }
+    block_of[pc] = blocks.size() - 1;
+    blocks.back().m_end = pc + 1;
+  }
+
+  for (unsigned i = 0; i < blocks.size(); i++) {
+    basic_block &b = blocks[i];
+    const instr &last = instrs[b.m_end - 1];
+    bool falls_through = true;
+    if (last.m_op == RETURN_INT) {
+      falls_through = false;
+    } else if (last.m_op == JUMP_ABS_IF_TRUE) {
+      const input &flag = last.m_inputA;
+      if (flag.m_addrmode == REGISTER || flag.m_value != 0) {
+        b.m_succs.push_back(block_of[last.m_inputB.m_value]);
+      }
+      if (flag.m_addrmode == CONSTANT && flag.m_value != 0) {
+        falls_through = false;
+      }
+    }
+    if (falls_through && b.m_end < n) {
+      b.m_succs.push_back(block_of[b.m_end]);
+    }
+    for (unsigned j = 0; j < b.m_succs.size(); j++) {
+      blocks[b.m_succs[j]].m_preds.push_back(i);
+    }
+  }
+}
+
+/* Run a forward dataflow analysis to a fixed point.  STATE is the
+   per-register information at a point, with:
+
+     static void STATE::meet(STATE &into, const STATE &from);
+     static void STATE::transfer(STATE &s, const instr &ins);
+
+   "entry" is the state on entry to the function.  On return, in[b] is
+   the state on entry to block b, and reached[b] is false for blocks
+   which can't be reached.  */
+template <class STATE>
+static void
+solve_forward(const std::vector<instr> &instrs,
+              const std::vector<basic_block> &blocks,
+              const STATE &entry,
+              std::vector<STATE> &in,
+              std::vector<bool> &reached)
+{
+  int num_blocks = blocks.size();
+  in.assign(num_blocks, entry);
+  std::vector<STATE> out(num_blocks, entry);
+  reached.assign(num_blocks, false);
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < num_blocks; i++) {
+      const basic_block &b = blocks[i];
+      // Meet the states of those predecessors reached so far:
+      bool have_state = (i == 0);
+      STATE s(entry);
+      for (unsigned j = 0; j < b.m_preds.size(); j++) {
+        int pred = b.m_preds[j];
+        if (!reached[pred]) {
+          continue;
+        }
+        if (have_state) {
+          STATE::meet(s, out[pred]);
+        } else {
+          s = out[pred];
+          have_state = true;
+        }
+      }
+      if (!have_state) {
+        continue;
+      }
+      if (!reached[i] || !(s == in[i])) {
+        reached[i] = true;
+        in[i] = s;
+        for (int pc = b.m_begin; pc < b.m_end; pc++) {
+          STATE::transfer(s, instrs[pc]);
+        }
+        out[i] = s;
+        changed = true;
+      }
+    }
+  }
+}
+
+/* Constant propagation.  */
+
+/* Which registers are known to hold a constant, and its value.  */
+struct const_state
+{
+  const_state(int num_regs)
+    : m_known(num_regs, false),
+      m_values(num_regs, 0)
+  {}
+
+  bool operator==(const const_state &other) const
+  {
+    return m_known == other.m_known && m_values == other.m_values;
+  }
+
+  /* The input as a constant, if it's known to be one.  */
+  bool get_constant(const input &in, int *value) const
+  {
+    if (in.m_addrmode == CONSTANT) {
+      *value = in.m_value;
+      return true;
+    }
+    if (m_known[in.m_value]) {
+      *value = m_values[in.m_value];
+      return true;
+    }
+    return false;
+  }
+
+  void set(int reg, bool known, int value)
+  {
+    m_known[reg] = known;
+    m_values[reg] = known ? value : 0;
+  }
+
+  static void meet(const_state &into, const const_state &from)
+  {
+    for (unsigned i = 0; i < into.m_known.size(); i++) {
+      if (into.m_known[i]
+          && (!from.m_known[i] || from.m_values[i] != into.m_values[i])) {
+        into.set(i, false, 0);
+      }
+    }
+  }
+
+  static void transfer(const_state &s, const instr &ins);
+
+  std::vector<bool> m_known;
+  std::vector<int> m_values;
+};
+
+/* Evaluate an arithmetic instruction on constants, wrapping on
+   overflow (as the interpreters and machine code do in practice).  */
+static int
+fold(enum opcode op, int lhs, int rhs)
+{
+  switch (op) {
+    case BINARY_INT_ADD:
+      return (int)((unsigned)lhs + (unsigned)rhs);
+    case BINARY_INT_SUBTRACT:
+      return (int)((unsigned)lhs - (unsigned)rhs);
+    case BINARY_INT_COMPARE_LT:
+      return lhs < rhs;
+    default:
+      assert(0); // FIXME
+      return 0;
+  }
+}
+
+void const_state::transfer(const_state &s, const instr &ins)
+{
+  if (!ins.has_output()) {
+    return;
+  }
+  int a, b;
+  switch (ins.m_op) {
+    case COPY_INT:
+      if (s.get_constant(ins.m_inputA, &a)) {
+        s.set(ins.m_output_reg, true, a);
+        return;
+      }
+      break;
+
+    case BINARY_INT_ADD:
+    case BINARY_INT_SUBTRACT:
+    case BINARY_INT_COMPARE_LT:
+      if (s.get_constant(ins.m_inputA, &a)
+          && s.get_constant(ins.m_inputB, &b)) {
+        s.set(ins.m_output_reg, true, fold(ins.m_op, a, b));
+        return;
+      }
+      break;
+
+    default:
+      break;
+  }
+  s.set(ins.m_output_reg, false, 0);
+}
+
+/* Replace a register input with a constant, if that's what it holds.  */
+static bool
+propagate_constant(const const_state &s, input &in)
+{
+  int value;
+  if (in.m_addrmode == REGISTER && s.get_constant(in, &value)) {
+    in = input(CONSTANT, value);
+    return true;
+  }
+  return false;
+}
+
+static bool
+propagate_constants(std::vector<instr> &instrs,
+                    const std::vector<basic_block> &blocks,
+                    int num_regs)
+{
+  std::vector<const_state> in;
+  std::vector<bool> reached;
+  solve_forward(instrs, blocks, const_state(num_regs), in, reached);
+
+  bool changed = false;
+  for (unsigned i = 0; i < blocks.size(); i++) {
+    if (!reached[i]) {
+      continue;
+    }
+    const_state s(in[i]);
+    for (int pc = blocks[i].m_begin; pc < blocks[i].m_end; pc++) {
+      instr &ins = instrs[pc];
+      if (propagate_constant(s, ins.m_inputA)) {
+        changed = true;
+      }
+      if (reads_input_b(ins) && propagate_constant(s, ins.m_inputB)) {
+        changed = true;
+      }
+      if (ins.m_op != COPY_INT
+          && ins.m_op != CALL_INT
+          && ins.has_output()
+          && ins.m_inputA.m_addrmode == CONSTANT
+          && ins.m_inputB.m_addrmode == CONSTANT) {
+        int value = fold(ins.m_op, ins.m_inputA.m_value,
+                         ins.m_inputB.m_value);
+        ins = instr(COPY_INT, ins.m_output_reg, input(CONSTANT, value),
+                    ins.m_loc);
+        changed = true;
+      }
+      if (ins.m_op == JUMP_ABS_IF_TRUE
+          && ins.m_inputA.m_addrmode == CONSTANT
+          && ins.m_inputA.m_value != 0
+          && ins.m_inputA.m_value != 1) {
+        ins.m_inputA.m_value = 1;
+        changed = true;
+      }
+      const_state::transfer(s, ins);
+    }
+  }
+  return changed;
+}
+
+/* Copy propagation.  */
+
+/* For each register, the register it's a copy of, or -1.  The source
+   is never itself a copy of another.  */
+struct copy_state
+{
+  copy_state(int num_regs)
+    : m_copy_of(num_regs, -1)
+  {}
+
+  bool operator==(const copy_state &other) const
+  {
+    return m_copy_of == other.m_copy_of;
+  }
+
+  static void meet(copy_state &into, const copy_state &from)
+  {
+    for (unsigned i = 0; i < into.m_copy_of.size(); i++) {
+      if (into.m_copy_of[i] != from.m_copy_of[i]) {
+        into.m_copy_of[i] = -1;
+      }
+    }
+  }
+
+  static void transfer(copy_state &s, const instr &ins)
+  {
+    if (!ins.has_output()) {
+      return;
+    }
+    int dst = ins.m_output_reg;
+    int src = -1;
+    if (ins.m_op == COPY_INT && ins.m_inputA.m_addrmode == REGISTER) {
+      src = ins.m_inputA.m_value;
+      if (s.m_copy_of[src] >= 0) {
+        src = s.m_copy_of[src];
+      }
+    }
+    // Anything copied from the old value of dst is now stale:
+    for (unsigned i = 0; i < s.m_copy_of.size(); i++) {
+      if (s.m_copy_of[i] == dst) {
+        s.m_copy_of[i] = -1;
+      }
+    }
+    s.m_copy_of[dst] = (src == dst) ? -1 : src;
+  }
+
+  std::vector<int> m_copy_of;
+};
+
+static bool
+propagate_copy(const copy_state &s, input &in)
+{
+  if (in.m_addrmode == REGISTER && s.m_copy_of[in.m_value] >= 0) {
+    in.m_value = s.m_copy_of[in.m_value];
+    return true;
+  }
+  return false;
+}
+
+static bool
+propagate_copies(std::vector<instr> &instrs,
+                 const std::vector<basic_block> &blocks,
+                 int num_regs)
+{
+  std::vector<copy_state> in;
+  std::vector<bool> reached;
+  solve_forward(instrs, blocks, copy_state(num_regs), in, reached);
+
+  bool changed = false;
+  for (unsigned i = 0; i < blocks.size(); i++) {
+    if (!reached[i]) {
+      continue;
+    }
+    copy_state s(in[i]);
+    for (int pc = blocks[i].m_begin; pc < blocks[i].m_end; pc++) {
+      instr &ins = instrs[pc];
+      if (propagate_copy(s, ins.m_inputA)) {
+        changed = true;
+      }
+      if (reads_input_b(ins) && propagate_copy(s, ins.m_inputB)) {
+        changed = true;
+      }
+      copy_state::transfer(s, ins);
+    }
+  }
+  return changed;
+}
+
+/* Dead-store elimination.  */
+
+static void
+add_uses(const instr &ins, std::vector<bool> &live)
+{
+  if (ins.m_inputA.m_addrmode == REGISTER) {
+    live[ins.m_inputA.m_value] = true;
+  }
+  if (reads_input_b(ins) && ins.m_inputB.m_addrmode == REGISTER) {
+    live[ins.m_inputB.m_value] = true;
+  }
+}
+
+/* Flag the instructions (other than calls) which write a register that
+   isn't read before being overwritten, and copies of a register to
+   itself.  */
+static bool
+find_dead_stores(const std::vector<instr> &instrs,
+                 const std::vector<basic_block> &blocks,
+                 int num_regs,
+                 std::vector<bool> &to_remove)
+{
+  // Compute the registers live on entry to each block:
+  int num_blocks = blocks.size();
+  std::vector<std::vector<bool> > live_in(num_blocks,
+                                          std::vector<bool>(num_regs, false));
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = num_blocks - 1; i >= 0; i--) {
+      const basic_block &b = blocks[i];
+      std::vector<bool> live(num_regs, false);
+      for (unsigned j = 0; j < b.m_succs.size(); j++) {
+        const std::vector<bool> &succ_live = live_in[b.m_succs[j]];
+        for (int r = 0; r < num_regs; r++) {
+          if (succ_live[r]) {
+            live[r] = true;
+          }
+        }
+      }
+      for (int pc = b.m_end - 1; pc >= b.m_begin; pc--) {
+        const instr &ins = instrs[pc];
+        if (ins.has_output()) {
+          live[ins.m_output_reg] = false;
+        }
+        add_uses(ins, live);
+      }
+      if (live != live_in[i]) {
+        live_in[i] = live;
+        changed = true;
+      }
+    }
+  }
+
+  // Walk each block backwards again, finding the dead stores:
+  bool found = false;
+  for (int i = 0; i < num_blocks; i++) {
+    const basic_block &b = blocks[i];
+    std::vector<bool> live(num_regs, false);
+    for (unsigned j = 0; j < b.m_succs.size(); j++) {
+      const std::vector<bool> &succ_live = live_in[b.m_succs[j]];
+      for (int r = 0; r < num_regs; r++) {
+        if (succ_live[r]) {
+          live[r] = true;
+        }
+      }
+    }
+    for (int pc = b.m_end - 1; pc >= b.m_begin; pc--) {
+      const instr &ins = instrs[pc];
+      if (ins.has_output() && ins.m_op != CALL_INT) {
+        bool is_self_copy =
+          (ins.m_op == COPY_INT
+           && ins.m_inputA == input(REGISTER, ins.m_output_reg));
+        if (!live[ins.m_output_reg] || is_self_copy) {
+          to_remove[pc] = true;
+          found = true;
+          continue;
+        }
+      }
+      if (ins.has_output()) {
+        live[ins.m_output_reg] = false;
+      }
+      add_uses(ins, live);
+    }
+  }
+  return found;
+}
+
+/* Flag the instructions in unreachable blocks, conditional jumps which
+   are never taken, and jumps to the next instruction.  */
+static bool
+find_unreachable(const std::vector<instr> &instrs,
+                 const std::vector<basic_block> &blocks,
+                 std::vector<bool> &to_remove)
+{
+  std::vector<bool> reached(blocks.size(), false);
+  std::vector<int> worklist;
+  reached[0] = true;
+  worklist.push_back(0);
+  while (!worklist.empty()) {
+    const basic_block &b = blocks[worklist.back()];
+    worklist.pop_back();
+    for (unsigned j = 0; j < b.m_succs.size(); j++) {
+      if (!reached[b.m_succs[j]]) {
+        reached[b.m_succs[j]] = true;
+        worklist.push_back(b.m_succs[j]);
+      }
+    }
+  }
+
+  bool found = false;
+  for (unsigned i = 0; i < blocks.size(); i++) {
+    for (int pc = blocks[i].m_begin; pc < blocks[i].m_end; pc++) {
+      const instr &ins = instrs[pc];
+      bool is_noop_jump =
+        (ins.m_op == JUMP_ABS_IF_TRUE
+         && ((ins.m_inputA.m_addrmode == CONSTANT
+              && ins.m_inputA.m_value == 0)
+             || ins.m_inputB.m_value == pc + 1));
+      if (!reached[i] || is_noop_jump) {
+        to_remove[pc] = true;
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+void
+regvm::optimize(std::vector<instr> &instrs)
+{
+  std::vector<basic_block> blocks;
+  bool changed = true;
+  while (changed) {
+    int num_regs = count_registers(instrs);
+    changed = false;
+
+    build_cfg(instrs, blocks);
+    if (propagate_constants(instrs, blocks, num_regs)) {
+      changed = true;
+      // Jumps may now be on constants, changing the CFG:
+      build_cfg(instrs, blocks);
+    }
+    if (propagate_copies(instrs, blocks, num_regs)) {
+      changed = true;
+    }
+
+    std::vector<bool> to_remove(instrs.size(), false);
+    if (find_unreachable(instrs, blocks, to_remove)) {
+      changed = true;
+    } else if (find_dead_stores(instrs, blocks, num_regs, to_remove)) {
+      changed = true;
+    }
+    remove_instrs(instrs, to_remove);
+  }
+}
+
+/* Self-recursion.  */
+
+/* If "ins" combines the result of a call held in "call_reg" with some
+   other value, in a way that can be applied to an accumulator instead
+   (x + f(a), f(a) + x or f(a) - x), set *operand to that value and
+   return the opcode with which to apply it, or NUM_OPCODES if not.
+   The arithmetic wraps, so reassociating it gives the same result.  */
+static enum opcode
+match_accumulation(const instr &ins, int call_reg, input *operand)
+{
+  input call_result(REGISTER, call_reg);
+  if (ins.m_op == BINARY_INT_ADD) {
+    if (ins.m_inputA == call_result && ins.m_inputB != call_result) {
+      *operand = ins.m_inputB;
+      return BINARY_INT_ADD;
+    }
+    if (ins.m_inputB == call_result && ins.m_inputA != call_result) {
+      *operand = ins.m_inputA;
+      return BINARY_INT_ADD;
+    }
+  }
+  if (ins.m_op == BINARY_INT_SUBTRACT
+      && ins.m_inputA == call_result
+      && ins.m_inputB != call_result) {
+    *operand = ins.m_inputB;
+    return BINARY_INT_SUBTRACT;
+  }
+  return NUM_OPCODES;
+}
+
+/* Is the value of register "reg" on reaching "pc" returned, unchanged
+   but for being copied, or jumped with?  */
+static bool
+is_returned(const std::vector<instr> &instrs, int pc, int reg)
+{
+  int n = instrs.size();
+  // (The limit stops us following a loop of jumps forever.)
+  for (int steps = 0; pc < n && steps < n; steps++) {
+    const instr &ins = instrs[pc];
+    if (ins.m_op == RETURN_INT) {
+      return ins.m_inputA == input(REGISTER, reg);
+    }
+    if (ins.m_op == COPY_INT && ins.m_inputA == input(REGISTER, reg)) {
+      reg = ins.m_output_reg;
+      pc++;
+    } else if (ins.m_op == JUMP_ABS_IF_TRUE
+               && ins.m_inputA == input(CONSTANT, 1)) {
+      pc = ins.m_inputB.m_value;
+    } else if (ins.m_op == JUMP_ABS_IF_TRUE
+               && ins.m_inputA == input(CONSTANT, 0)) {
+      pc++;
+    } else {
+      return false;
+    }
+  }
+  return false;
+}
+
+bool
+regvm::eliminate_self_calls(std::vector<instr> &instrs, int fn)
+{
+  int n = instrs.size();
+
+  // Find the self-calls whose result is returned, either directly
+  // ("tail calls"), or after one accumulatable operation:
+  std::vector<enum opcode> accumulate(n, NUM_OPCODES);
+  std::vector<input> operands(n, input(CONSTANT, 0));
+  std::vector<bool> is_tail_call(n, false);
+  bool found = false;
+  bool need_accumulator = false;
+  for (int pc = 0; pc + 1 < n; pc++) {
+    const instr &ins = instrs[pc];
+    if (ins.m_op != CALL_INT || ins.m_inputB.m_value != fn) {
+      continue;
+    }
+    if (is_returned(instrs, pc + 1, ins.m_output_reg)) {
+      is_tail_call[pc] = true;
+      found = true;
+      continue;
+    }
+    const instr &next = instrs[pc + 1];
+    if (next.has_output() && is_returned(instrs, pc + 2, next.m_output_reg)) {
+      accumulate[pc] = match_accumulation(next, ins.m_output_reg,
+                                          &operands[pc]);
+      if (accumulate[pc] != NUM_OPCODES) {
+        found = need_accumulator = true;
+      }
+    }
+  }
+  if (!found) {
+    return false;
+  }
+
+  // Replace each such call with a jump back to the start, with the
+  // argument in R0.  When there's an accumulator, it starts at zero in
+  // each frame (before the start of the loop), and every other return
+  // adds it to its result.  The instructions after the calls are left
+  // for the other passes to delete, as other paths may still use them:
+  int acc = count_registers(instrs);
+  std::vector<instr> result;
+  result.reserve(n + 8);
+  if (need_accumulator) {
+    result.push_back(instr(COPY_INT, acc, input(CONSTANT, 0),
+                           instrs[0].m_loc));
+  }
+  std::vector<int> index_map(n + 1);
+  for (int pc = 0; pc < n; pc++) {
+    index_map[pc] = result.size();
+    const instr &ins = instrs[pc];
+    // (Jumps are emitted with their old destinations, and fixed up
+    // below; pc 0 maps to the start of the loop.)
+    input loop_start(CONSTANT, 0);
+    if (is_tail_call[pc]) {
+      result.push_back(instr(COPY_INT, 0, ins.m_inputA, ins.m_loc));
+      result.push_back(instr(JUMP_ABS_IF_TRUE, 0, input(CONSTANT, 1),
+                             loop_start, ins.m_loc));
+    } else if (accumulate[pc] != NUM_OPCODES) {
+      result.push_back(instr(accumulate[pc], acc, input(REGISTER, acc),
+                             operands[pc], instrs[pc + 1].m_loc));
+      result.push_back(instr(COPY_INT, 0, ins.m_inputA, ins.m_loc));
+      result.push_back(instr(JUMP_ABS_IF_TRUE, 0, input(CONSTANT, 1),
+                             loop_start, ins.m_loc));
+    } else if (ins.m_op == RETURN_INT && need_accumulator) {
+      result.push_back(instr(BINARY_INT_ADD, acc, input(REGISTER, acc),
+                             ins.m_inputA, ins.m_loc));
+      result.push_back(instr(RETURN_INT, 0, input(REGISTER, acc),
+                             ins.m_loc));
+    } else {
+      result.push_back(ins);
+    }
+  }
+  index_map[n] = result.size();
+
+  for (unsigned pc = 0; pc < result.size(); pc++) {
+    instr &ins = result[pc];
+    if (ins.m_op == JUMP_ABS_IF_TRUE) {
+      ins.m_inputB.m_value = index_map[ins.m_inputB.m_value];
+    }
+  }
+  instrs.swap(result);
+  return true;
+}
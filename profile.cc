@@ -0,0 +1,200 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <map>
+#include <string.h>
+#include <string>
+
+#include "profile.h"
+
+void exec_profile::clear()
+{
+  m_fns.clear();
+  m_frames.clear();
+  m_nodes.clear();
+
+  // The root of the tree of calls:
+  call_node root;
+  root.m_fn = -1;
+  root.m_parent = -1;
+  root.m_cycles = 0;
+  m_nodes.push_back(root);
+}
+
+void exec_profile::enter(int fn, unsigned long long now)
+{
+  int parent = 0;
+  if (!m_frames.empty()) {
+    // Stop the clock on the caller's CALL_INT:
+    charge(now);
+    parent = m_frames.back().m_node;
+  }
+  if (fn >= (int)m_fns.size()) {
+    m_fns.resize(fn + 1);
+  }
+
+  int node = -1;
+  const std::vector<int> &children = m_nodes[parent].m_children;
+  for (unsigned i = 0; i < children.size(); i++) {
+    if (m_nodes[children[i]].m_fn == fn) {
+      node = children[i];
+      break;
+    }
+  }
+  if (node == -1) {
+    call_node n;
+    n.m_fn = fn;
+    n.m_parent = parent;
+    n.m_cycles = 0;
+    node = m_nodes.size();
+    m_nodes.push_back(n);
+    m_nodes[parent].m_children.push_back(node);
+  }
+
+  frame f;
+  f.m_fn = fn;
+  f.m_node = node;
+  f.m_pc = 0;
+  f.m_start = now;
+  m_frames.push_back(f);
+}
+
+void exec_profile::leave(unsigned long long now)
+{
+  // The RETURN_INT ends the frame, rather than an end_opcode:
+  charge(now);
+  m_frames.pop_back();
+  if (!m_frames.empty()) {
+    // Restart the clock on the caller's CALL_INT:
+    m_frames.back().m_start = now;
+  }
+}
+
+struct opcode_totals
+{
+  opcode_totals()
+    : m_hits(0),
+      m_cycles(0)
+  {}
+
+  long m_hits;
+  unsigned long long m_cycles;
+};
+
+struct hot_pc
+{
+  int m_fn;
+  int m_pc;
+  unsigned long long m_cycles;
+
+  bool operator<(const hot_pc &other) const
+  {
+    return m_cycles > other.m_cycles;
+  }
+};
+
+/* The number of pcs listed in the report.  */
+static const unsigned NUM_HOT_PCS = 20;
+
+void exec_profile::write_report(FILE *out) const
+{
+  std::map<std::string, opcode_totals> by_opcode;
+  std::vector<hot_pc> pcs;
+  long total_hits = 0;
+  unsigned long long total_cycles = 0;
+  for (unsigned fn = 0; fn < m_fns.size(); fn++) {
+    for (unsigned pc = 0; pc < m_fns[fn].size(); pc++) {
+      const pc_stats &s = m_fns[fn][pc];
+      if (!s.m_hits) {
+        continue;
+      }
+      opcode_totals &t = by_opcode[s.m_opcode];
+      t.m_hits += s.m_hits;
+      t.m_cycles += s.m_cycles;
+      total_hits += s.m_hits;
+      total_cycles += s.m_cycles;
+      hot_pc h = {(int)fn, (int)pc, s.m_cycles};
+      pcs.push_back(h);
+    }
+  }
+
+  fprintf(out, "%li opcodes, %llu cycles\n", total_hits, total_cycles);
+  fprintf(out, "%-36s %12s %14s %8s %6s\n",
+          "opcode", "count", "cycles", "per op", "%");
+  for (std::map<std::string, opcode_totals>::const_iterator it
+         = by_opcode.begin();
+       it != by_opcode.end(); ++it) {
+    const opcode_totals &t = it->second;
+    fprintf(out, "%-36s %12li %14llu %8.1f %6.2f\n",
+            it->first.c_str(), t.m_hits, t.m_cycles,
+            (double)t.m_cycles / t.m_hits,
+            total_cycles ? t.m_cycles * 100.0 / total_cycles : 0.0);
+  }
+
+  std::sort(pcs.begin(), pcs.end());
+  fprintf(out, "hottest pcs:\n");
+  for (unsigned i = 0; i < pcs.size() && i < NUM_HOT_PCS; i++) {
+    const pc_stats &s = m_fns[pcs[i].m_fn][pcs[i].m_pc];
+    fprintf(out, "  fn%i [%i] %-36s %12li %14llu\n",
+            pcs[i].m_fn, pcs[i].m_pc, s.m_opcode, s.m_hits, s.m_cycles);
+  }
+
+  // Every opcode which can jump has "JUMP" in its name:
+  fprintf(out, "jumps:\n");
+  for (unsigned fn = 0; fn < m_fns.size(); fn++) {
+    for (unsigned pc = 0; pc < m_fns[fn].size(); pc++) {
+      const pc_stats &s = m_fns[fn][pc];
+      if (!s.m_hits || !strstr(s.m_opcode, "JUMP")) {
+        continue;
+      }
+      fprintf(out, "  fn%i [%i] %s: taken %li", fn, pc, s.m_opcode,
+              s.m_taken);
+      if (s.m_taken) {
+        fprintf(out, " (to [%i])", s.m_dest);
+      }
+      fprintf(out, ", not taken %li\n", s.m_hits - s.m_taken);
+    }
+  }
+}
+
+void exec_profile::write_folded(FILE *out) const
+{
+  // Walk the tree depth-first, without recursing, as it's as deep as
+  // the deepest call: "path" holds the nodes from the top level down to
+  // the current one, along with the index of the next child to visit:
+  std::vector<std::pair<int, unsigned> > path;
+  path.push_back(std::make_pair(0, 0u));
+  while (!path.empty()) {
+    int node = path.back().first;
+    unsigned child = path.back().second++;
+    if (child == 0 && node != 0 && m_nodes[node].m_cycles) {
+      for (unsigned i = 1; i < path.size(); i++) {
+        fprintf(out, "%sfn%i", i > 1 ? ";" : "",
+                m_nodes[path[i].first].m_fn);
+      }
+      fprintf(out, " %llu\n", m_nodes[node].m_cycles);
+    }
+    if (child < m_nodes[node].m_children.size()) {
+      path.push_back(std::make_pair(m_nodes[node].m_children[child], 0u));
+    } else {
+      path.pop_back();
+    }
+  }
+}
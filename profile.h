@@ -0,0 +1,211 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "trace.h"
+
+/* Profiling the interpreters.
+
+   Running a vm with the profile_trace policy records, in the
+   exec_profile given to the vm's set_profile:
+
+     * for each pc of each function: how many times it ran, and how
+       many cycles were spent on it (excluding the callees of calls)
+
+     * for each conditional jump: how many times it was taken
+
+     * the cycles spent in each chain of calls, for flame graphs
+
+   Per-opcode totals are added up from the per-pc ones when the report
+   is written, so that the interpreter loop only has to bump counters.
+   Cycles come from the timestamp counter where there is one (rdtsc),
+   and are nanoseconds otherwise.  Reading it twice per opcode costs
+   some tens of cycles, which land in the totals, so the figures are
+   for comparing opcodes and pcs with each other, rather than with
+   untraced runs.  Like the other policies, this costs nothing unless
+   the vm is instantiated with it.  */
+
+static inline unsigned long long
+read_cycle_counter()
+{
+#if defined(__i386__) || defined(__x86_64__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+class exec_profile
+{
+public:
+  exec_profile() { clear(); }
+
+  void clear();
+
+  /* Write a summary: totals per opcode, the hottest pcs, and the
+     edges of each conditional jump.  */
+  void write_report(FILE *out) const;
+
+  /* Write the cycles spent in each chain of calls in the "folded"
+     format read by flamegraph.pl: one line per chain, naming the
+     functions from the outermost inwards, separated by semicolons,
+     followed by the count.  */
+  void write_folded(FILE *out) const;
+
+  /* The hooks, called by profile_trace.  */
+  void enter(int fn, unsigned long long now);
+  void leave(unsigned long long now);
+
+  /* Has "pc" of the current function not run before?  If so, the
+     caller names its opcode with set_opcode_name.  */
+  bool is_new_pc(int pc)
+  {
+    std::vector<pc_stats> &pcs = m_fns[m_frames.back().m_fn];
+    if (pc >= (int)pcs.size()) {
+      pcs.resize(pc + 1);
+    }
+    return pcs[pc].m_opcode == NULL;
+  }
+
+  void set_opcode_name(int pc, const char *name)
+  {
+    m_fns[m_frames.back().m_fn][pc].m_opcode = name;
+  }
+
+  void begin_opcode(int pc, unsigned long long now)
+  {
+    frame &f = m_frames.back();
+    f.m_pc = pc;
+    f.m_start = now;
+    m_fns[f.m_fn][pc].m_hits++;
+  }
+
+  void end_opcode(unsigned long long now) { charge(now); }
+
+  void jump(int dest)
+  {
+    frame &f = m_frames.back();
+    pc_stats &s = m_fns[f.m_fn][f.m_pc];
+    s.m_taken++;
+    s.m_dest = dest;
+  }
+
+private:
+  struct pc_stats
+  {
+    pc_stats()
+      : m_opcode(NULL),
+        m_hits(0),
+        m_cycles(0),
+        m_taken(0),
+        m_dest(-1)
+    {}
+
+    const char *m_opcode;
+    long m_hits;
+    unsigned long long m_cycles;
+
+    /* For jumps: how often, and where to.  */
+    long m_taken;
+    int m_dest;
+  };
+
+  /* A function being run, and the opcode within it.  */
+  struct frame
+  {
+    int m_fn;
+    int m_node;
+    int m_pc;
+    unsigned long long m_start;
+  };
+
+  /* A node of the tree of calls: a function, as called by the chain
+     of functions leading to "m_parent" (or from the top level, for
+     the children of node 0).  */
+  struct call_node
+  {
+    int m_fn;
+    int m_parent;
+    unsigned long long m_cycles;
+    std::vector<int> m_children;
+  };
+
+  /* Add the cycles since the current opcode began to it.  */
+  void charge(unsigned long long now)
+  {
+    frame &f = m_frames.back();
+    unsigned long long cycles = now - f.m_start;
+    m_fns[f.m_fn][f.m_pc].m_cycles += cycles;
+    m_nodes[f.m_node].m_cycles += cycles;
+  }
+
+private:
+  /* The stats of each pc, for each function.  */
+  std::vector<std::vector<pc_stats> > m_fns;
+
+  std::vector<frame> m_frames;
+  std::vector<call_node> m_nodes;
+};
+
+/* Profile into the vm's exec_profile, which must be set.  */
+struct profile_trace
+{
+  template <class VM>
+  static void begin_frame(VM &vm, int) {
+    vm.get_profile()->enter(vm.get_current_fn(), read_cycle_counter());
+  }
+
+  template <class VM>
+  static void end_frame(VM &vm, int, int) {
+    vm.get_profile()->leave(read_cycle_counter());
+  }
+
+  template <class VM, class FRAME>
+  static void begin_opcode(VM &vm, const FRAME &, int pc) {
+    exec_profile *profile = vm.get_profile();
+    if (profile->is_new_pc(pc)) {
+      profile->set_opcode_name(pc, vm.get_opcode_name(pc));
+    }
+    profile->begin_opcode(pc, read_cycle_counter());
+  }
+
+  template <class VM>
+  static void end_opcode(VM &vm, int) {
+    vm.get_profile()->end_opcode(read_cycle_counter());
+  }
+
+  template <class VM>
+  static void jump(VM &vm, int, int to) { vm.get_profile()->jump(to); }
+
+  template <class VM>
+  static void branch(VM &, int, bool) {}
+};
+
+#endif
@@ -0,0 +1,436 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+
+#include "stackvm.h"
+#include "programs.h"
+
+using namespace stackvm;
+
+/*
+   Simple recursive fibonacci implementation, which must be function 0
+   of its module, roughly equivalent to:
+
+   int fibonacci(int arg)
+   {
+      if (arg < 2) {
+          return arg
+      }
+      return fibonacci(arg-1) + fibonacci(arg-2)
+   }
+ */
+const int FIRST_LINE = __LINE__ + 5;
+const char fibonacci[] = {
+  // stack: [arg]
+
+  // 0:
+  DUP,
+  // stack: [arg, arg]
+
+  // 1:
+  PUSH_INT_CONST, 2,
+  // stack: [arg, arg, 2]
+
+  // 3:
+  BINARY_INT_COMPARE_LT,
+  // stack: [arg, (arg < 2)]
+
+  // 4:
+  JUMP_ABS_IF_TRUE, 19,
+  // stack: [arg]
+
+  // 6:
+  DUP,
+  // stack: [arg, arg]
+
+  // 7:
+  PUSH_INT_CONST,  1,
+  // stack: [arg, arg, 1]
+
+  // 9:
+  BINARY_INT_SUBTRACT,
+  // stack: [arg,  (arg - 1)
+
+  // 10:
+  CALL_INT, 0,
+  // stack: [arg, fib(arg - 1)]
+
+  // 12:
+  ROT,
+  // stack: [fib(arg - 1), arg]
+
+  // 13:
+  PUSH_INT_CONST,  2,
+  // stack: [fib(arg - 1), arg, 2]
+
+  // 15:
+  BINARY_INT_SUBTRACT,
+  // stack: [fib(arg - 1), arg,  (arg - 2)
+
+  // 16:
+  CALL_INT, 0,
+  // stack: [fib(arg - 1), fib(arg - 1)]
+
+  // 18:
+  BINARY_INT_ADD,
+  // stack: [fib(arg - 1) + fib(arg - 1)]
+
+  // 19:
+  RETURN_INT
+};
+
+stackvm::bytecode *
+make_fibonacci_bytecode()
+{
+  stackvm::bytecode * scode = new stackvm::bytecode(fibonacci,
+                                                    sizeof(fibonacci));
+
+  /* Set up line-numbering in bytecode to point into the array
+     initializer above, so that stepping through the JIT-generated
+     code in the debugger will step through the above.
+     We do it "by hand" here; in a real interpreter you'd presumably set
+     this up with information from your parser.  */
+  scode->set_location(0, __FILE__, FIRST_LINE + 0, 2);
+  scode->set_location(1, __FILE__, FIRST_LINE + 4, 2);
+  scode->set_location(3, __FILE__, FIRST_LINE + 8, 2);
+  scode->set_location(4, __FILE__, FIRST_LINE + 12, 2);
+  scode->set_location(6, __FILE__, FIRST_LINE + 16, 2);
+  scode->set_location(7, __FILE__, FIRST_LINE + 20, 2);
+  scode->set_location(9, __FILE__, FIRST_LINE + 24, 2);
+  scode->set_location(10, __FILE__, FIRST_LINE + 28, 2);
+  scode->set_location(12, __FILE__, FIRST_LINE + 32, 2);
+  scode->set_location(13, __FILE__, FIRST_LINE + 36, 2);
+  scode->set_location(15, __FILE__, FIRST_LINE + 40, 2);
+  scode->set_location(16, __FILE__, FIRST_LINE + 44, 2);
+  scode->set_location(18, __FILE__, FIRST_LINE + 48, 2);
+  scode->set_location(19, __FILE__, FIRST_LINE + 52, 2);
+
+  return scode;
+}
+
+stackvm::module *
+make_fibonacci_module()
+{
+  stackvm::module *mod = new stackvm::module();
+  mod->add_function(make_fibonacci_bytecode());
+  return mod;
+}
+
+/*
+   Recursive sum of the integers up to "arg", roughly equivalent to:
+
+   int sum(int arg)
+   {
+      if (arg < 1) {
+          return arg
+      }
+      return arg + sum(arg - 1)
+   }
+
+   This recurses "arg" levels deep.  It must be function 0 of its
+   module.
+ */
+const char sum[] = {
+  // 0:
+  DUP,
+  // 1:
+  PUSH_INT_CONST, 1,
+  // 3:
+  BINARY_INT_COMPARE_LT,
+  // 4:
+  JUMP_ABS_IF_TRUE, 13,
+  // 6:
+  DUP,
+  // 7:
+  PUSH_INT_CONST, 1,
+  // 9:
+  BINARY_INT_SUBTRACT,
+  // 10:
+  CALL_INT, 0,
+  // stack: [arg, sum(arg - 1)]
+  // 12:
+  BINARY_INT_ADD,
+  // 13:
+  RETURN_INT
+};
+
+stackvm::bytecode *
+make_sum_bytecode()
+{
+  return new stackvm::bytecode(sum, sizeof(sum));
+}
+
+stackvm::module *
+make_sum_module()
+{
+  stackvm::module *mod = new stackvm::module();
+  mod->add_function(make_sum_bytecode());
+  return mod;
+}
+
+/*
+   The sum of the first "arg" + 1 fibonacci numbers, calling fibonacci
+   (function 0) from function 1, roughly equivalent to:
+
+   int sum_fib(int arg)
+   {
+      if (arg < 0) {
+          return 0
+      }
+      return fibonacci(arg) + sum_fib(arg - 1)
+   }
+ */
+const char sum_fib[] = {
+  // 0:
+  DUP,
+  // 1:
+  PUSH_INT_CONST, 0,
+  // 3:
+  BINARY_INT_COMPARE_LT,
+  // 4:
+  JUMP_ABS_IF_TRUE, 17,
+  // 6:
+  DUP,
+  // 7:
+  CALL_INT, 0,
+  // stack: [arg, fibonacci(arg)]
+  // 9:
+  ROT,
+  // 10:
+  PUSH_INT_CONST, 1,
+  // 12:
+  BINARY_INT_SUBTRACT,
+  // 13:
+  CALL_INT, 1,
+  // stack: [fibonacci(arg), sum_fib(arg - 1)]
+  // 15:
+  BINARY_INT_ADD,
+  // 16:
+  RETURN_INT,
+  // 17:
+  PUSH_INT_CONST, 0,
+  // 19:
+  RETURN_INT
+};
+
+stackvm::module *
+make_sum_fib_module()
+{
+  stackvm::module *mod = new stackvm::module();
+  mod->add_function(make_fibonacci_bytecode());
+  mod->add_function(new stackvm::bytecode(sum_fib, sizeof(sum_fib)));
+  return mod;
+}
+
+/*
+   A straight-line function, with no branches or calls, roughly
+   equivalent to:
+
+   int linear(int arg)
+   {
+      return arg * 3 - 1
+   }
+ */
+const char linear[] = {
+  // 0:
+  DUP,
+  // 1:
+  DUP,
+  // stack: [arg, arg, arg]
+  // 2:
+  BINARY_INT_ADD,
+  // 3:
+  BINARY_INT_ADD,
+  // stack: [arg * 3]
+  // 4:
+  PUSH_INT_CONST, 1,
+  // 6:
+  BINARY_INT_SUBTRACT,
+  // 7:
+  RETURN_INT
+};
+
+stackvm::module *
+make_linear_module()
+{
+  stackvm::module *mod = new stackvm::module();
+  mod->add_function(new stackvm::bytecode(linear, sizeof(linear)));
+  return mod;
+}
+
+/*
+   A loop, with no calls, roughly equivalent to:
+
+   int countdown(int arg)
+   {
+      while (0 < arg) {
+          arg = arg - 3
+      }
+      return arg
+   }
+
+   This takes a backward jump for every 3 of "arg".
+ */
+const char countdown[] = {
+  // 0:
+  DUP,
+  // 1:
+  PUSH_INT_CONST, 1,
+  // 3:
+  BINARY_INT_COMPARE_LT,
+  // 4:
+  JUMP_ABS_IF_TRUE, 13,
+  // 6:
+  PUSH_INT_CONST, 3,
+  // 8:
+  BINARY_INT_SUBTRACT,
+  // 9:
+  PUSH_INT_CONST, 1,
+  // 11:
+  JUMP_ABS_IF_TRUE, 0,
+  // 13:
+  RETURN_INT
+};
+
+stackvm::module *
+make_countdown_module()
+{
+  stackvm::module *mod = new stackvm::module();
+  mod->add_function(new stackvm::bytecode(countdown, sizeof(countdown)));
+  return mod;
+}
+
+/*
+   A function whose second RETURN_INT is reached only by a backward
+   jump from further on, past some dead code, roughly equivalent to:
+
+   int clamp(int arg)
+   {
+      if (arg < 0) {
+          return 2
+      }
+      return arg
+   }
+
+   The block at 7 follows a RETURN_INT, so nothing seen before it says
+   how deep the stack is there.
+ */
+const char late_target[] = {
+  // 0:
+  DUP,
+  // 1:
+  PUSH_INT_CONST, 0,
+  // 3:
+  BINARY_INT_COMPARE_LT,
+  // 4:
+  JUMP_ABS_IF_TRUE, 12,
+  // 6:
+  RETURN_INT,
+  // 7:
+  PUSH_INT_CONST, 2,
+  // 9:
+  RETURN_INT,
+  // 10 (unreachable):
+  PUSH_INT_CONST, 4,
+  // 12:
+  PUSH_INT_CONST, 1,
+  // 14:
+  JUMP_ABS_IF_TRUE, 7,
+  // 16:
+  RETURN_INT
+};
+
+stackvm::module *
+make_late_target_module()
+{
+  stackvm::module *mod = new stackvm::module();
+  mod->add_function(new stackvm::bytecode(late_target, sizeof(late_target)));
+  return mod;
+}
+
+/*
+   A function returning "arg + 1", followed by dead code which would
+   leave the stack too shallow if it were ever run.
+ */
+const char dead_code[] = {
+  // 0:
+  PUSH_INT_CONST, 1,
+  // 2:
+  BINARY_INT_ADD,
+  // 3:
+  RETURN_INT,
+  // 4 (unreachable):
+  PUSH_INT_CONST, 4,
+  // 6:
+  BINARY_INT_ADD,
+  // 7:
+  RETURN_INT
+};
+
+stackvm::module *
+make_dead_code_module()
+{
+  stackvm::module *mod = new stackvm::module();
+  mod->add_function(new stackvm::bytecode(dead_code, sizeof(dead_code)));
+  return mod;
+}
+
+/*
+   A module of 200 functions, in which function 0 returns "arg - 1" by
+   way of calls to functions too far away to name in a single byte:
+
+   int f0(int arg) { return f199(arg); }
+   int f199(int arg) { return f198(arg - 1); }
+
+   and the others return their argument.
+ */
+const char far_call_first[] = {
+  // 0:
+  WIDE, CALL_INT, (char)199, 0, 0, 0,
+  // 6:
+  RETURN_INT
+};
+
+const char far_call_identity[] = {
+  // 0:
+  RETURN_INT
+};
+
+const char far_call_last[] = {
+  // 0:
+  WIDE, SUBTRACT_CONST_CALL_INT, 1, 0, 0, 0, (char)198, 0, 0, 0,
+  // 10:
+  RETURN_INT
+};
+
+stackvm::module *
+make_far_call_module()
+{
+  stackvm::module *mod = new stackvm::module();
+  mod->add_function(new stackvm::bytecode(far_call_first,
+                                          sizeof(far_call_first)));
+  for (int i = 1; i < 199; i++) {
+    mod->add_function(new stackvm::bytecode(far_call_identity,
+                                            sizeof(far_call_identity)));
+  }
+  mod->add_function(new stackvm::bytecode(far_call_last,
+                                          sizeof(far_call_last)));
+  return mod;
+}
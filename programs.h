@@ -0,0 +1,61 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+/* Sample stackvm programs shared by the demo and the benchmarks.  The
+   modules hold the corresponding bytecode as function 0.  */
+
+stackvm::bytecode *
+make_fibonacci_bytecode();
+
+stackvm::module *
+make_fibonacci_module();
+
+stackvm::bytecode *
+make_sum_bytecode();
+
+stackvm::module *
+make_sum_module();
+
+/* A module of two functions: fibonacci, and (as function 1, the entry
+   point) a function summing the results of calling it.  */
+stackvm::module *
+make_sum_fib_module();
+
+/* A module holding a single function with no branches or calls.  */
+stackvm::module *
+make_linear_module();
+
+/* A module holding a single function which loops, without calls.  */
+stackvm::module *
+make_countdown_module();
+
+/* A module holding a single function with a jump target just after a
+   RETURN_INT, reached only by a later backward jump.  */
+stackvm::module *
+make_late_target_module();
+
+/* A module holding a single function with unreachable code after its
+   RETURN_INT.  */
+stackvm::module *
+make_dead_code_module();
+
+/* A module of 200 functions, whose function 0 calls function 199 (and
+   that one function 198) with a WIDE operand.  */
+stackvm::module *
+make_far_call_module();
@@ -0,0 +1,292 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+/* Register allocation for regvm code, by graph colouring.
+
+   We compute which virtual registers are live after each instruction,
+   build an interference graph from that, and then greedily colour it,
+   preferring to give the source and destination of a COPY_INT the same
+   colour, so that the copy can be deleted.
+
+   Everything is built in an arena, as the sets of live registers alone
+   take two allocations per instruction.  */
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "regvm.h"
+#include "arena.h"
+
+using namespace regvm;
+
+/* A set of virtual registers.  */
+class regset
+{
+public:
+  regset(int num_vregs, arena *scratch)
+    : m_bits(num_vregs, false, scratch)
+  {}
+
+  bool contains(int vreg) const { return m_bits[vreg]; }
+  void add(int vreg) { m_bits[vreg] = true; }
+  void remove(int vreg) { m_bits[vreg] = false; }
+  int size() const { return m_bits.size(); }
+
+  /* Add the contents of "other" to this set, returning true if this
+     changed it.  */
+  bool union_with(const regset &other)
+  {
+    bool changed = false;
+    for (int i = 0; i < size(); i++) {
+      if (other.m_bits[i] && !m_bits[i]) {
+        m_bits[i] = true;
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+private:
+  arena_vector<bool>::type m_bits;
+};
+
+typedef arena_vector<regset>::type regset_vector;
+
+static void
+add_use(const input &in, arena_vector<int>::type &uses)
+{
+  if (in.m_addrmode == REGISTER) {
+    uses.push_back(in.m_value);
+  }
+}
+
+/* Get the registers read by an instruction.  */
+static void
+get_uses(const instr &ins, arena_vector<int>::type &uses)
+{
+  uses.clear();
+  add_use(ins.m_inputA, uses);
+  if (ins.get_num_inputs() == 2 && ins.m_op != JUMP_ABS_IF_TRUE) {
+    add_use(ins.m_inputB, uses);
+  }
+}
+
+/* Get the indices of the instructions that can follow the one at "pc".  */
+static void
+get_successors(const std::vector<instr> &instrs, int pc,
+               arena_vector<int>::type &succs)
+{
+  succs.clear();
+  const instr &ins = instrs[pc];
+  if (ins.m_op == RETURN_INT) {
+    return;
+  }
+  if (pc + 1 < (int)instrs.size()) {
+    succs.push_back(pc + 1);
+  }
+  if (ins.m_op == JUMP_ABS_IF_TRUE) {
+    assert(ins.m_inputB.m_addrmode == CONSTANT);
+    succs.push_back(ins.m_inputB.m_value);
+  }
+}
+
+/* Compute the set of registers live after each instruction.  */
+static void
+compute_liveness(const std::vector<instr> &instrs, int num_vregs,
+                 regset_vector &live_out, arena *scratch)
+{
+  int n = instrs.size();
+  live_out.assign(n, regset(num_vregs, scratch));
+  regset_vector live_in(n, regset(num_vregs, scratch), scratch);
+  regset in(num_vregs, scratch);
+  arena_vector<int>::type uses(scratch);
+  arena_vector<int>::type succs(scratch);
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int pc = n - 1; pc >= 0; pc--) {
+      const instr &ins = instrs[pc];
+
+      get_successors(instrs, pc, succs);
+      for (unsigned i = 0; i < succs.size(); i++) {
+        live_out[pc].union_with(live_in[succs[i]]);
+      }
+
+      in = live_out[pc];
+      if (ins.has_output()) {
+        in.remove(ins.m_output_reg);
+      }
+      get_uses(ins, uses);
+      for (unsigned i = 0; i < uses.size(); i++) {
+        in.add(uses[i]);
+      }
+      if (live_in[pc].union_with(in)) {
+        changed = true;
+      }
+    }
+  }
+}
+
+static void
+rename_input(input &in, const arena_vector<int>::type &colour)
+{
+  if (in.m_addrmode == REGISTER) {
+    in.m_value = colour[in.m_value];
+  }
+}
+
+void
+regvm::allocate_registers(std::vector<instr> &instrs, int num_vregs,
+                          arena *scratch)
+{
+  arena own_scratch;
+  if (!scratch) {
+    scratch = &own_scratch;
+  }
+  int n = instrs.size();
+  regset_vector live_out(scratch);
+  compute_liveness(instrs, num_vregs, live_out, scratch);
+
+  // Build the interference graph, and note which registers are
+  // related by copies:
+  typedef arena_vector<arena_vector<int>::type>::type adjacency;
+  adjacency interferes(num_vregs, arena_vector<int>::type(scratch), scratch);
+  adjacency copy_partners(num_vregs, arena_vector<int>::type(scratch),
+                          scratch);
+  arena_vector<bool>::type is_used(num_vregs, false, scratch);
+  arena_vector<int>::type uses(scratch);
+  is_used[0] = true;
+  for (int pc = 0; pc < n; pc++) {
+    const instr &ins = instrs[pc];
+    get_uses(ins, uses);
+    for (unsigned i = 0; i < uses.size(); i++) {
+      is_used[uses[i]] = true;
+    }
+    if (!ins.has_output()) {
+      continue;
+    }
+    int def = ins.m_output_reg;
+    is_used[def] = true;
+    int copy_src = -1;
+    if (ins.m_op == COPY_INT && ins.m_inputA.m_addrmode == REGISTER) {
+      copy_src = ins.m_inputA.m_value;
+      copy_partners[def].push_back(copy_src);
+      copy_partners[copy_src].push_back(def);
+    }
+    for (int v = 0; v < num_vregs; v++) {
+      // The source of a copy doesn't interfere with its destination,
+      // as they hold the same value:
+      if (v != def && v != copy_src && live_out[pc].contains(v)) {
+        interferes[def].push_back(v);
+        interferes[v].push_back(def);
+      }
+    }
+  }
+
+  // Colour the graph greedily.  The argument arrives in register 0, so
+  // virtual register 0 must be given colour 0:
+  arena_vector<int>::type colour(num_vregs, -1, scratch);
+  arena_vector<bool>::type forbidden(scratch);
+  forbidden.reserve(num_vregs + 1);
+  int num_colours = 0;
+  for (int v = 0; v < num_vregs; v++) {
+    if (!is_used[v]) {
+      continue;
+    }
+    forbidden.assign(num_colours + 1, false);
+    for (unsigned i = 0; i < interferes[v].size(); i++) {
+      int c = colour[interferes[v][i]];
+      if (c >= 0) {
+        forbidden[c] = true;
+      }
+    }
+
+    int c = -1;
+    if (v == 0) {
+      c = 0;
+    } else {
+      for (unsigned i = 0; i < copy_partners[v].size(); i++) {
+        int partner = colour[copy_partners[v][i]];
+        if (partner >= 0 && !forbidden[partner]) {
+          c = partner;
+          break;
+        }
+      }
+      if (c < 0) {
+        for (c = 0; forbidden[c]; c++)
+          ;
+      }
+    }
+    colour[v] = c;
+    if (c >= num_colours) {
+      num_colours = c + 1;
+    }
+  }
+
+  // Rewrite the instructions, dropping copies that have become no-ops:
+  std::vector<bool> to_remove(n, false);
+  for (int pc = 0; pc < n; pc++) {
+    instr &ins = instrs[pc];
+    if (ins.has_output()) {
+      ins.m_output_reg = colour[ins.m_output_reg];
+    }
+    rename_input(ins.m_inputA, colour);
+    if (ins.get_num_inputs() == 2 && ins.m_op != JUMP_ABS_IF_TRUE) {
+      rename_input(ins.m_inputB, colour);
+    }
+    if (ins.m_op == COPY_INT
+        && ins.m_inputA == input(REGISTER, ins.m_output_reg)) {
+      to_remove[pc] = true;
+    }
+  }
+  remove_instrs(instrs, to_remove);
+}
+
+void
+regvm::remove_instrs(std::vector<instr> &instrs,
+                     const std::vector<bool> &to_remove)
+{
+  // Map from old index to new; removed instructions map to the next
+  // surviving one:
+  int n = instrs.size();
+  std::vector<int> index_map(n + 1);
+  int num_kept = 0;
+  for (int pc = 0; pc < n; pc++) {
+    index_map[pc] = num_kept;
+    if (!to_remove[pc]) {
+      num_kept++;
+    }
+  }
+  index_map[n] = num_kept;
+
+  std::vector<instr> result;
+  result.reserve(num_kept);
+  for (int pc = 0; pc < n; pc++) {
+    if (to_remove[pc]) {
+      continue;
+    }
+    instr ins = instrs[pc];
+    if (ins.m_op == JUMP_ABS_IF_TRUE) {
+      ins.m_inputB.m_value = index_map[ins.m_inputB.m_value];
+    }
+    result.push_back(ins);
+  }
+  instrs.swap(result);
+}
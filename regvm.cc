@@ -18,9 +18,14 @@
 */
 
 #include <assert.h>
+#include <dlfcn.h>
 #include <stdio.h>
+#include <string>
 
 #include "regvm.h"
+#include "arena.h"
+#include "diskcache.h"
+#include "profile.h"
 #include "libgccjit.h"
 
 using namespace regvm;
@@ -31,7 +36,7 @@ static const int num_inputs[NUM_OPCODES] = {
   2, // BINARY_INT_SUBTRACT,
   2, // BINARY_INT_COMPARE_LT,
   2, // JUMP_ABS_IF_TRUE,
-  1, // CALL_INT,
+  2, // CALL_INT,
   1, // RETURN_INT,
 };
 
@@ -56,6 +61,26 @@ instr::instr(enum opcode op, int output_reg, input lhs, input rhs, const locatio
   assert(num_inputs[op] == 2);
 }
 
+int instr::get_num_inputs() const
+{
+  return num_inputs[m_op];
+}
+
+bool instr::has_output() const
+{
+  switch (m_op) {
+  case COPY_INT:
+  case BINARY_INT_ADD:
+  case BINARY_INT_SUBTRACT:
+  case BINARY_INT_COMPARE_LT:
+  case CALL_INT:
+    return true;
+
+  default:
+    return false;
+  }
+}
+
 static void
 write_assign_to_lhs(FILE *out, int output_reg)
 {
@@ -135,7 +160,7 @@ void instr::disassemble(FILE *out) const
 
   case CALL_INT:
     write_assign_to_lhs(out, m_output_reg);
-    fprintf(out, "CALL(");
+    fprintf(out, "CALL fn%i(", m_inputB.m_value);
     write_rvalue(out, m_inputA);
     fprintf(out, ");");
     write_any_loc(out, *this);
@@ -155,6 +180,122 @@ void instr::disassemble(FILE *out) const
   }
 }
 
+static void
+note_register(const input &in, int &num_registers)
+{
+  if (in.m_addrmode == REGISTER && in.m_value >= num_registers) {
+    num_registers = in.m_value + 1;
+  }
+}
+
+int wordcode::compute_num_registers() const
+{
+  int num_registers = 1; // the argument
+  for (unsigned i = 0; i < m_instrs.size(); i++) {
+    const instr &ins = m_instrs[i];
+    if (ins.has_output() && ins.m_output_reg >= num_registers) {
+      num_registers = ins.m_output_reg + 1;
+    }
+    note_register(ins.m_inputA, num_registers);
+    if (ins.get_num_inputs() == 2 && ins.m_op != JUMP_ABS_IF_TRUE) {
+      note_register(ins.m_inputB, num_registers);
+    }
+  }
+  return num_registers;
+}
+
+void wordcode::intern_filenames()
+{
+  // Consecutive instructions almost always share a filename, so only
+  // look it up when it changes:
+  const char *last = NULL;
+  const char *interned = NULL;
+  for (unsigned i = 0; i < m_instrs.size(); i++) {
+    location &loc = m_instrs[i].m_loc;
+    if (loc.m_filename != last) {
+      last = loc.m_filename;
+      interned = m_filenames.intern(last);
+    }
+    loc.m_filename = interned;
+  }
+}
+
+/* Is "reg" a register that a packed_instr can refer to?  */
+static bool
+fits_packed_register(int reg)
+{
+  return reg >= 0 && reg <= PACKED_MAX_OPERAND;
+}
+
+/* Encode an operand for a packed_instr, putting constants too large to
+   be held inline into the pool, and referring to the register which
+   will hold them.  Returns false if the operand can't be packed.  */
+static bool
+pack_input(const input &in, int num_registers, std::vector<int> &pool,
+           bool *is_reg, int *value)
+{
+  *is_reg = true;
+  if (in.m_addrmode == REGISTER) {
+    *value = in.m_value;
+  } else if (in.m_value >= PACKED_MIN_OPERAND
+             && in.m_value <= PACKED_MAX_OPERAND) {
+    *is_reg = false;
+    *value = in.m_value;
+  } else {
+    unsigned i;
+    for (i = 0; i < pool.size(); i++) {
+      if (pool[i] == in.m_value) {
+        break;
+      }
+    }
+    if (i == pool.size()) {
+      pool.push_back(in.m_value);
+    }
+    *value = num_registers + i;
+  }
+  return !*is_reg || fits_packed_register(*value);
+}
+
+/* Build the packed form of the instructions, unless some register
+   (including those of the constant pool) is out of the range of a
+   packed_instr, in which case there is no packed form, and the
+   wordcode is run in LAYOUT_WIDE.  */
+void wordcode::pack()
+{
+  m_is_packed = true;
+  m_packed_instrs.resize(m_instrs.size());
+  for (unsigned i = 0; i < m_instrs.size(); i++) {
+    const instr &ins = m_instrs[i];
+    packed_instr &p = m_packed_instrs[i];
+    bool is_reg;
+    int value;
+    p.m_op = ins.m_op;
+    if (!fits_packed_register(ins.m_output_reg)) {
+      m_is_packed = false;
+      break;
+    }
+    p.m_output_reg = ins.m_output_reg;
+    if (!pack_input(ins.m_inputA, m_num_registers, m_constants,
+                    &is_reg, &value)) {
+      m_is_packed = false;
+      break;
+    }
+    p.m_a_is_reg = is_reg;
+    p.m_a = value;
+    if (!pack_input(ins.m_inputB, m_num_registers, m_constants,
+                    &is_reg, &value)) {
+      m_is_packed = false;
+      break;
+    }
+    p.m_b_is_reg = is_reg;
+    p.m_b = value;
+  }
+  if (!m_is_packed) {
+    m_packed_instrs.clear();
+    m_constants.clear();
+  }
+}
+
 void wordcode::disassemble(FILE *out) const
 {
   for (int pc = 0; pc < (int)m_instrs.size(); /* */) {
@@ -193,13 +334,17 @@ class frame_compiler
 public:
   frame_compiler(gcc_jit_context *ctxt,
                  gcc_jit_function *fn,
-                 gcc_jit_location *fn_loc) :
+                 gcc_jit_location *fn_loc,
+                 int num_registers,
+                 arena *scratch) :
+    m_locals(scratch),
     m_ctxt(ctxt),
     m_fn(fn),
     m_int_type(gcc_jit_context_get_type (m_ctxt, GCC_JIT_TYPE_INT))
   {
-    for (int i = 0; i < NUM_REGISTERS; i++) {
-      char buf[10];
+    m_locals.reserve(num_registers);
+    for (int i = 0; i < num_registers; i++) {
+      char buf[16];
       sprintf (buf, "R%i", i);
       gcc_jit_lvalue *local =
         gcc_jit_function_new_local (fn,
@@ -211,7 +356,7 @@ public:
   }
 
   // We will have one local per "register":
-  std::vector<gcc_jit_lvalue *> m_locals;
+  arena_vector<gcc_jit_lvalue *>::type m_locals;
 
   gcc_jit_rvalue *eval_int(const input& in) const;
   gcc_jit_lvalue *get_reg(int idx) const;
@@ -235,7 +380,7 @@ frame_compiler::eval_int(const input& in) const
                                            in.m_value);
   case REGISTER:
     assert(in.m_value >= 0);
-    assert(in.m_value < NUM_REGISTERS);
+    assert(in.m_value < (int)m_locals.size());
     return gcc_jit_lvalue_as_rvalue (m_locals[in.m_value]);
 
   default:
@@ -255,77 +400,486 @@ frame_compiler::get_output_reg(const instr &ins) const
   return get_reg (ins.m_output_reg);
 }
 
-void *wordcode::compile()
+jit_options jit_options::verbose()
 {
-  gcc_jit_context *ctxt = gcc_jit_context_acquire ();
+  jit_options opts;
+  opts.m_dump_wordcode = true;
+  opts.m_dump_initial_gimple = true;
+  opts.m_dump_generated_code = true;
+  opts.m_dump_everything = true;
+  opts.m_keep_intermediates = true;
+  return opts;
+}
 
-  gcc_jit_context_set_bool_option (ctxt,
-                                   GCC_JIT_BOOL_OPTION_DUMP_INITIAL_GIMPLE,
-                                   1);
-  gcc_jit_context_set_bool_option (ctxt,
-                                   GCC_JIT_BOOL_OPTION_DUMP_GENERATED_CODE,
-                                   1);
-  gcc_jit_context_set_int_option (ctxt,
-                                  GCC_JIT_INT_OPTION_OPTIMIZATION_LEVEL,
-                                  3);
-  gcc_jit_context_set_bool_option (ctxt,
-                                   GCC_JIT_BOOL_OPTION_KEEP_INTERMEDIATES,
-                                   1);
-  gcc_jit_context_set_bool_option (ctxt,
-                                   GCC_JIT_BOOL_OPTION_DUMP_EVERYTHING,
-                                   1);
+bool jit_options::operator==(const jit_options &other) const
+{
+  return (m_optimization_level == other.m_optimization_level
+          && m_debuginfo == other.m_debuginfo
+          && m_dump_wordcode == other.m_dump_wordcode
+          && m_dump_initial_gimple == other.m_dump_initial_gimple
+          && m_dump_generated_code == other.m_dump_generated_code
+          && m_dump_everything == other.m_dump_everything
+          && m_keep_intermediates == other.m_keep_intermediates
+          && m_memoize == other.m_memoize
+          && m_block_per_instr == other.m_block_per_instr
+          && m_branch_profile == other.m_branch_profile);
+}
+
+long branch_profile::get_num_taken(int fn, int pc) const
+{
+  if (fn >= (int)m_fns.size() || pc >= (int)m_fns[fn].size()) {
+    return 0;
+  }
+  return m_fns[fn][pc].m_taken;
+}
+
+long branch_profile::get_num_not_taken(int fn, int pc) const
+{
+  if (fn >= (int)m_fns.size() || pc >= (int)m_fns[fn].size()) {
+    return 0;
+  }
+  return m_fns[fn][pc].m_not_taken;
+}
+
+/* Jumps that have run fewer times than this get no hint.  */
+static const long MIN_BRANCH_SAMPLES = 16;
+
+enum branch_hint branch_profile::get_hint(int fn, int pc) const
+{
+  long taken = get_num_taken(fn, pc);
+  long total = taken + get_num_not_taken(fn, pc);
+  if (total < MIN_BRANCH_SAMPLES) {
+    return BRANCH_UNKNOWN;
+  }
+  if (taken * 10 >= total * 9) {
+    return BRANCH_USUALLY_TAKEN;
+  }
+  if (taken * 10 <= total) {
+    return BRANCH_USUALLY_NOT_TAKEN;
+  }
+  return BRANCH_UNKNOWN;
+}
+
+void branch_profile::write(FILE *out) const
+{
+  static const char *hint_names[] = {"", " (usually taken)",
+                                     " (usually not taken)"};
+  for (unsigned fn = 0; fn < m_fns.size(); fn++) {
+    for (unsigned pc = 0; pc < m_fns[fn].size(); pc++) {
+      const edge_counts &counts = m_fns[fn][pc];
+      if (counts.m_taken + counts.m_not_taken == 0) {
+        continue;
+      }
+      fprintf (out, "fn %i pc %i: taken %li, not taken %li%s\n",
+               fn, pc, counts.m_taken, counts.m_not_taken,
+               hint_names[get_hint(fn, pc)]);
+    }
+  }
+}
+
+module::~module()
+{
+  for (unsigned i = 0; i < m_jit_cache.size(); i++) {
+    if (m_jit_cache[i].m_dl_handle) {
+      dlclose (m_jit_cache[i].m_dl_handle);
+    } else {
+      gcc_jit_result_release (m_jit_cache[i].m_result);
+    }
+  }
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    delete m_functions[i];
+  }
+}
+
+int module::add_function(wordcode *code)
+{
+  m_is_packed = m_is_packed && code->is_packed();
+  m_functions.push_back(code);
+  return m_functions.size() - 1;
+}
+
+/* Can the instruction be part of a pure function, given which
+   functions are pure so far?  */
+static bool
+is_pure_instr(const instr &ins, const std::vector<bool> &is_pure)
+{
+  switch (ins.m_op) {
+    case COPY_INT:
+    case BINARY_INT_ADD:
+    case BINARY_INT_SUBTRACT:
+    case BINARY_INT_COMPARE_LT:
+    case JUMP_ABS_IF_TRUE:
+    case RETURN_INT:
+      return true;
+
+    case CALL_INT:
+      assert(ins.m_inputB.m_addrmode == CONSTANT);
+      return is_pure[ins.m_inputB.m_value];
+
+    default:
+      return false;
+  }
+}
+
+std::vector<bool> module::find_pure_functions() const
+{
+  // Assume every function is pure, and then rule out those which
+  // aren't until nothing changes, so that recursive functions (whose
+  // calls are to themselves) are found to be pure:
+  int num_fns = m_functions.size();
+  std::vector<bool> is_pure(num_fns, true);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int fn = 0; fn < num_fns; fn++) {
+      if (!is_pure[fn]) {
+        continue;
+      }
+      const wordcode *code = m_functions[fn];
+      const instr *instrs = code->get_instrs();
+      for (int pc = 0; pc < code->get_num_instrs(); pc++) {
+        if (!is_pure_instr(instrs[pc], is_pure)) {
+          is_pure[fn] = false;
+          changed = true;
+          break;
+        }
+      }
+    }
+  }
+  return is_pure;
+}
+
+module *module::optimize() const
+{
+  module *result = new module();
+  arena scratch;
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    const wordcode *code = m_functions[i];
+    std::vector<instr> instrs(code->get_instrs(),
+                              code->get_instrs() + code->get_num_instrs());
+    regvm::optimize(instrs);
+    int num_vregs = code->get_num_registers();
+    if (eliminate_self_calls(instrs, i)) {
+      num_vregs++; // for the accumulator
+      regvm::optimize(instrs);
+    }
+    allocate_registers(instrs, num_vregs, &scratch);
+    scratch.release();
+    result->add_function(new wordcode(&instrs));
+  }
+  return result;
+}
+
+void module::disassemble(FILE *out) const
+{
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    fprintf(out, "function %i:\n", i);
+    m_functions[i]->disassemble(out);
+  }
+}
+
+/* Counter for generating unique names for compiled functions.  */
+static int num_compiled_fns;
+
+/* Build a call to "callee" through its memo_cache, "table", within
+   "block": look up the argument, and only make the call if it isn't
+   there, adding its result afterwards.  The entries are read and
+   written whole, as a single 64-bit word.  */
+static void
+compile_memoized_call(gcc_jit_context *ctxt,
+                      gcc_jit_function *fn,
+                      gcc_jit_location *loc,
+                      int pc,
+                      gcc_jit_block *block,
+                      gcc_jit_block *next_block,
+                      gcc_jit_function *callee,
+                      gcc_jit_lvalue *table,
+                      gcc_jit_rvalue *arg_value,
+                      gcc_jit_lvalue *dst)
+{
+  gcc_jit_type *int_type =
+    gcc_jit_context_get_type (ctxt, GCC_JIT_TYPE_INT);
+  gcc_jit_type *unsigned_type =
+    gcc_jit_context_get_type (ctxt, GCC_JIT_TYPE_UNSIGNED_INT);
+  gcc_jit_type *entry_type =
+    gcc_jit_context_get_type (ctxt, GCC_JIT_TYPE_UNSIGNED_LONG_LONG);
+  char buf[32];
+
+  // The argument might be in the output register, so take a copy:
+  sprintf (buf, "arg%i", pc);
+  gcc_jit_lvalue *arg = gcc_jit_function_new_local (fn, loc, int_type, buf);
+  gcc_jit_block_add_assignment (block, loc, arg, arg_value);
+
+  // idx = ((unsigned)arg * 2654435761u) >> (32 - MEMO_CACHE_BITS);
+  // (as memo_cache::hash)
+  sprintf (buf, "idx%i", pc);
+  gcc_jit_lvalue *idx = gcc_jit_function_new_local (fn, loc, int_type, buf);
+  gcc_jit_rvalue *hash =
+    gcc_jit_context_new_binary_op (
+      ctxt, loc, GCC_JIT_BINARY_OP_RSHIFT, unsigned_type,
+      gcc_jit_context_new_binary_op (
+        ctxt, loc, GCC_JIT_BINARY_OP_MULT, unsigned_type,
+        gcc_jit_context_new_cast (ctxt, loc,
+                                  gcc_jit_lvalue_as_rvalue (arg),
+                                  unsigned_type),
+        gcc_jit_context_new_rvalue_from_int (ctxt, unsigned_type,
+                                             (int)2654435761u)),
+      gcc_jit_context_new_rvalue_from_int (ctxt, unsigned_type,
+                                           32 - MEMO_CACHE_BITS));
+  gcc_jit_block_add_assignment (block, loc, idx,
+                                gcc_jit_context_new_cast (ctxt, loc, hash,
+                                                          int_type));
+  gcc_jit_lvalue *slot =
+    gcc_jit_context_new_array_access (ctxt, loc,
+                                      gcc_jit_lvalue_as_rvalue (table),
+                                      gcc_jit_lvalue_as_rvalue (idx));
+
+  // entry = table[idx];
+  sprintf (buf, "entry%i", pc);
+  gcc_jit_lvalue *entry =
+    gcc_jit_function_new_local (fn, loc, entry_type, buf);
+  gcc_jit_block_add_assignment (block, loc, entry,
+                                gcc_jit_lvalue_as_rvalue (slot));
+
+  // if ((int)(entry >> 32) == arg) goto hit; else goto miss;
+  sprintf (buf, "instr%i_hit", pc);
+  gcc_jit_block *hit = gcc_jit_function_new_block (fn, buf);
+  sprintf (buf, "instr%i_miss", pc);
+  gcc_jit_block *miss = gcc_jit_function_new_block (fn, buf);
+  gcc_jit_rvalue *thirty_two =
+    gcc_jit_context_new_rvalue_from_int (ctxt, entry_type, 32);
+  gcc_jit_block_end_with_conditional (
+    block, loc,
+    gcc_jit_context_new_comparison (
+      ctxt, loc, GCC_JIT_COMPARISON_EQ,
+      gcc_jit_context_new_cast (
+        ctxt, loc,
+        gcc_jit_context_new_binary_op (ctxt, loc, GCC_JIT_BINARY_OP_RSHIFT,
+                                       entry_type,
+                                       gcc_jit_lvalue_as_rvalue (entry),
+                                       thirty_two),
+        int_type),
+      gcc_jit_lvalue_as_rvalue (arg)),
+    hit, miss);
+
+  // hit: dst = (int)entry;
+  gcc_jit_block_add_assignment (
+    hit, loc, dst,
+    gcc_jit_context_new_cast (ctxt, loc, gcc_jit_lvalue_as_rvalue (entry),
+                              int_type));
+  gcc_jit_block_end_with_jump (hit, loc, next_block);
+
+  // miss: dst = callee(arg);
+  //       table[idx] = ((entry)arg << 32) | (unsigned)dst;
+  gcc_jit_rvalue *call_arg = gcc_jit_lvalue_as_rvalue (arg);
+  gcc_jit_block_add_assignment (
+    miss, loc, dst,
+    gcc_jit_context_new_call (ctxt, loc, callee, 1, &call_arg));
+  gcc_jit_rvalue *key =
+    gcc_jit_context_new_binary_op (
+      ctxt, loc, GCC_JIT_BINARY_OP_LSHIFT, entry_type,
+      gcc_jit_context_new_cast (ctxt, loc, call_arg, entry_type),
+      thirty_two);
+  gcc_jit_rvalue *value =
+    gcc_jit_context_new_cast (
+      ctxt, loc,
+      gcc_jit_context_new_cast (ctxt, loc, gcc_jit_lvalue_as_rvalue (dst),
+                                unsigned_type),
+      entry_type);
+  gcc_jit_block_add_assignment (
+    miss, loc, slot,
+    gcc_jit_context_new_binary_op (ctxt, loc, GCC_JIT_BINARY_OP_BITWISE_OR,
+                                   entry_type, key, value));
+  gcc_jit_block_end_with_jump (miss, loc, next_block);
+}
 
+/* Find the instructions which start a basic block: the first, the
+   destinations of jumps, and those following jumps and returns.  */
+static arena_vector<bool>::type
+find_leaders(const instr *instrs, int num_instrs, arena *scratch)
+{
+  arena_vector<bool>::type leaders(num_instrs, false, scratch);
+  leaders[0] = true;
+  for (int pc = 0; pc < num_instrs; pc++) {
+    const instr &ins = instrs[pc];
+    if (ins.m_op == JUMP_ABS_IF_TRUE) {
+      assert(ins.m_inputB.m_addrmode == CONSTANT);
+      assert(ins.m_inputB.m_value >= 0 && ins.m_inputB.m_value < num_instrs);
+      leaders[ins.m_inputB.m_value] = true;
+    }
+    if ((ins.m_op == JUMP_ABS_IF_TRUE || ins.m_op == RETURN_INT)
+        && pc + 1 < num_instrs) {
+      leaders[pc + 1] = true;
+    }
+  }
+  return leaders;
+}
+
+/* Find the instructions which can be reached from the first.  GCC
+   rejects unreachable blocks, so none are built for the others.  If
+   "hints" isn't empty, edges that it says are unlikely aren't followed,
+   leaving just the hot path.  */
+static arena_vector<bool>::type
+find_reachable(const instr *instrs, int num_instrs,
+               const arena_vector<enum branch_hint>::type &hints,
+               arena *scratch)
+{
+  arena_vector<bool>::type reachable(num_instrs, false, scratch);
+  arena_vector<int>::type worklist(1, 0, scratch);
+  while (!worklist.empty()) {
+    int pc = worklist.back();
+    worklist.pop_back();
+    while (pc < num_instrs && !reachable[pc]) {
+      reachable[pc] = true;
+      const instr &ins = instrs[pc];
+      if (ins.m_op == RETURN_INT) {
+        break;
+      }
+      if (ins.m_op == JUMP_ABS_IF_TRUE) {
+        enum branch_hint hint = hints.empty() ? BRANCH_UNKNOWN : hints[pc];
+        if (hint != BRANCH_USUALLY_NOT_TAKEN) {
+          worklist.push_back(ins.m_inputB.m_value);
+        }
+        if (hint == BRANCH_USUALLY_TAKEN) {
+          break;
+        }
+      }
+      pc++;
+    }
+  }
+  return reachable;
+}
+
+/* Look up the hint for each conditional jump of fns[idx] that tests a
+   register; jumps on constants always go the same way anyway.  */
+static arena_vector<enum branch_hint>::type
+get_branch_hints(const branch_profile &profile, int idx,
+                 const instr *instrs, int num_instrs, arena *scratch)
+{
+  arena_vector<enum branch_hint>::type hints(num_instrs, BRANCH_UNKNOWN,
+                                             scratch);
+  for (int pc = 0; pc < num_instrs; pc++) {
+    if (instrs[pc].m_op == JUMP_ABS_IF_TRUE
+        && instrs[pc].m_inputA.m_addrmode == REGISTER) {
+      hints[pc] = profile.get_hint(idx, pc);
+    }
+  }
+  return hints;
+}
+
+/* Wrap "flag" in __builtin_expect, telling GCC that it is usually
+   "expected".  */
+static gcc_jit_rvalue *
+expect_flag(gcc_jit_context *ctxt, gcc_jit_location *loc,
+            gcc_jit_rvalue *flag, bool expected)
+{
+  gcc_jit_type *long_type =
+    gcc_jit_context_get_type (ctxt, GCC_JIT_TYPE_LONG);
+  gcc_jit_function *builtin_expect =
+    gcc_jit_context_get_builtin_function (ctxt, "__builtin_expect");
+  gcc_jit_rvalue *args[2];
+  args[0] = gcc_jit_context_new_cast (ctxt, loc, flag, long_type);
+  args[1] = gcc_jit_context_new_rvalue_from_int (ctxt, long_type, expected);
+  return gcc_jit_context_new_comparison (
+    ctxt, loc, GCC_JIT_COMPARISON_NE,
+    gcc_jit_context_new_call (ctxt, loc, builtin_expect, 2, args),
+    gcc_jit_context_zero (ctxt, long_type));
+}
+
+/* Fill in the body of fns[idx] from "code"; the other functions of the
+   module are needed for CALL_INT, along with their memo_cache tables
+   (NULL for those which aren't memoized).  Our temporaries go in
+   "scratch".  */
+static void
+compile_function(gcc_jit_context *ctxt,
+                 const std::vector<gcc_jit_function *> &fns,
+                 const std::vector<gcc_jit_lvalue *> &memo_tables,
+                 int idx,
+                 const wordcode &code,
+                 const jit_options &opts,
+                 arena *scratch)
+{
+  gcc_jit_function *fn = fns[idx];
+  const instr *instrs = code.get_instrs();
+  int num_instrs = code.get_num_instrs();
   int pc;
 
-  gcc_jit_location *fn_loc = make_jit_loc(ctxt, m_instrs[0].m_loc);
+  gcc_jit_location *fn_loc = make_jit_loc(ctxt, instrs[0].m_loc);
 
   gcc_jit_type *int_type =
     gcc_jit_context_get_type (ctxt, GCC_JIT_TYPE_INT);
   gcc_jit_type *bool_type =
     gcc_jit_context_get_type (ctxt, GCC_JIT_TYPE_BOOL);
-  gcc_jit_param *param =
-    gcc_jit_context_new_param (ctxt, fn_loc, int_type, "input");
-  gcc_jit_function *fn =
-    gcc_jit_context_new_function (ctxt,
-                                  make_jit_loc(ctxt, m_instrs[0].m_loc),
-                                  GCC_JIT_FUNCTION_EXPORTED,
-                                  int_type,
-                                  "fibonacci", /* FIXME */
-                                  1, &param, 0);
-  frame_compiler f(ctxt, fn, fn_loc);
+  gcc_jit_param *param = gcc_jit_function_get_param (fn, 0);
+  frame_compiler f(ctxt, fn, fn_loc, code.get_num_registers(), scratch);
 
   gcc_jit_block *initial = gcc_jit_function_new_block (fn, "initial");
 
-  // 1st pass: create blocks, one per opcode:
-  std::vector<gcc_jit_block *> blocks;
-  pc = 0;
-  for (std::vector<instr>::iterator it = m_instrs.begin();
-       it != m_instrs.end();
-       ++it, ++pc)
-    {
-      char buf[16];
-      sprintf (buf, "instr%i", pc);
-      gcc_jit_block *block = gcc_jit_function_new_block (fn, buf);
-      blocks.push_back(block);
-    }
+  // 1st pass: create blocks, one per basic block (or per instruction),
+  // indexed by the pc of their first instruction:
+  arena_vector<bool>::type leaders(scratch);
+  if (opts.m_block_per_instr) {
+    leaders.assign(num_instrs, true);
+  } else {
+    leaders = find_leaders(instrs, num_instrs, scratch);
+  }
+  arena_vector<enum branch_hint>::type hints(scratch);
+  if (opts.m_branch_profile) {
+    hints = get_branch_hints(*opts.m_branch_profile, idx, instrs, num_instrs,
+                             scratch);
+  }
+  arena_vector<bool>::type reachable =
+    find_reachable(instrs, num_instrs,
+                   arena_vector<enum branch_hint>::type(scratch), scratch);
+  // GCC starts from the order in which the blocks were created, so
+  // those on the hot path go first, and the cold ones after them all:
+  arena_vector<bool>::type hot =
+    (hints.empty()
+     ? reachable
+     : find_reachable(instrs, num_instrs, hints, scratch));
+  arena_vector<gcc_jit_block *>::type blocks(num_instrs, NULL, scratch);
+  for (int cold = 0; cold < 2; cold++)
+    for (pc = 0; pc < num_instrs; pc++)
+      {
+        if (!leaders[pc] || !reachable[pc] || hot[pc] == (bool)cold) {
+          continue;
+        }
+        char buf[16];
+        sprintf (buf, "instr%i", pc);
+        blocks[pc] = gcc_jit_function_new_block (fn, buf);
+      }
 
   // Assign param to R0:
   gcc_jit_block_add_assignment (initial,
-                                make_jit_loc(ctxt, m_instrs[0].m_loc),
+                                fn_loc,
                                 f.get_reg (0),
                                 gcc_jit_param_as_rvalue (param));
   // ...and jump to insn 0
   gcc_jit_block_end_with_jump (initial, NULL, blocks[0]);
 
-  // 2nd pass: fill in instructions:
-  for (pc = 0; pc < (int)m_instrs.size(); pc++)
+  // 2nd pass: fill in instructions, adding each to the current block,
+  // and ending it with a jump if the next instruction starts another:
+  gcc_jit_block *block = NULL;
+  for (pc = 0; pc < num_instrs; pc++)
     {
-      gcc_jit_location *loc = make_jit_loc(ctxt, m_instrs[pc].m_loc);
-      gcc_jit_block *block = blocks[pc];
-      gcc_jit_block *next_block = (pc < (int)m_instrs.size()) ? blocks[pc + 1] : NULL;
+      if (!reachable[pc]) {
+        continue;
+      }
+      gcc_jit_location *loc = make_jit_loc(ctxt, instrs[pc].m_loc);
+      if (blocks[pc]) {
+        block = blocks[pc];
+      }
+      gcc_jit_block *next_block =
+        (pc + 1 < num_instrs) ? blocks[pc + 1] : NULL;
 
-      const instr &ins = m_instrs[pc];
-      ins.disassemble(stdout);
+      const instr &ins = instrs[pc];
+      if (opts.m_dump_wordcode) {
+        ins.disassemble(stdout);
+      }
+      // Only returns and jumps can end a function:
+      assert(pc + 1 < num_instrs
+             || ins.m_op == RETURN_INT
+             || ins.m_op == JUMP_ABS_IF_TRUE); // FIXME
 
       switch (ins.m_op) {
         case COPY_INT:
@@ -333,7 +887,6 @@ void *wordcode::compile()
           gcc_jit_rvalue *src = f.eval_int(ins.m_inputA);
           gcc_jit_lvalue *dst = f.get_output_reg(ins);
           gcc_jit_block_add_assignment (block, loc, dst, src);
-          gcc_jit_block_end_with_jump (block, loc, next_block);
         }
         break;
 
@@ -351,7 +904,6 @@ void *wordcode::compile()
             gcc_jit_context_new_binary_op (ctxt, loc, op,
                                            int_type,
                                            lhs, rhs));
-          gcc_jit_block_end_with_jump (block, loc, next_block);
         }
         break;
 
@@ -367,7 +919,6 @@ void *wordcode::compile()
               gcc_jit_context_new_comparison (ctxt, loc, GCC_JIT_COMPARISON_LT,
                                               lhs, rhs),
               int_type));
-          gcc_jit_block_end_with_jump (block, loc, next_block);
         }
         break;
 
@@ -376,29 +927,56 @@ void *wordcode::compile()
           gcc_jit_rvalue *int_flag = f.eval_int(ins.m_inputA);
           gcc_jit_rvalue *bool_flag =
             gcc_jit_context_new_cast (ctxt, loc, int_flag, bool_type);
+          if (!hints.empty() && hints[pc] != BRANCH_UNKNOWN) {
+            bool_flag = expect_flag(ctxt, loc, bool_flag,
+                                    hints[pc] == BRANCH_USUALLY_TAKEN);
+          }
 
           assert(ins.m_inputB.m_addrmode == CONSTANT);
           int dest = ins.m_inputB.m_value;
 
           gcc_jit_block *on_true = blocks[dest];
-          gcc_jit_block *on_false = blocks[pc + 1];
-
+          gcc_jit_block *on_false = next_block;
+
+          if (!on_false) {
+            // A jump at the end of the function must be taken:
+            assert(ins.m_inputA.m_addrmode == CONSTANT
+                   && ins.m_inputA.m_value); // FIXME
+            gcc_jit_block_end_with_jump (block, loc, on_true);
+            continue;
+          }
           gcc_jit_block_end_with_conditional (block, loc,
                                               bool_flag,
                                               on_true,
                                               on_false);
         }
-        break;
+        continue;
 
       case CALL_INT:
         {
           gcc_jit_rvalue *arg = f.eval_int(ins.m_inputA);
           gcc_jit_lvalue *dst = f.get_output_reg(ins);
+          assert(ins.m_inputB.m_addrmode == CONSTANT);
+          int callee = ins.m_inputB.m_value;
+          assert(callee >= 0 && callee < (int)fns.size());
+          if (memo_tables[callee]) {
+            // The probe ends the block, so carry on in a new one if
+            // the next instruction doesn't start one anyway:
+            if (!next_block) {
+              char buf[32];
+              sprintf (buf, "instr%i_done", pc);
+              next_block = gcc_jit_function_new_block (fn, buf);
+            }
+            compile_memoized_call(ctxt, fn, loc, pc, block, next_block,
+                                  fns[callee], memo_tables[callee],
+                                  arg, dst);
+            block = next_block;
+            continue;
+          }
           gcc_jit_block_add_assignment (
             block, loc, dst,
-            gcc_jit_context_new_call (ctxt, loc, fn,
+            gcc_jit_context_new_call (ctxt, loc, fns[callee],
                                       1, &arg));
-          gcc_jit_block_end_with_jump (block, loc, next_block);
         }
         break;
 
@@ -407,43 +985,459 @@ void *wordcode::compile()
           gcc_jit_rvalue *result = f.eval_int(ins.m_inputA);
           gcc_jit_block_end_with_return (block, loc, result);
         }
-        break;
+        continue;
 
       default:
         assert(0); // FIXME
       }
+
+      if (next_block) {
+        gcc_jit_block_end_with_jump (block, loc, next_block);
+      }
     }
+}
+
+/* Build a loop calling "fn" on each element of an array, setting
+   out[i] = fn(in[i]) for i in 0..n-1.  */
+static gcc_jit_function *
+make_batch_function(gcc_jit_context *ctxt,
+                    gcc_jit_function *fn,
+                    const char *name)
+{
+  gcc_jit_type *void_type =
+    gcc_jit_context_get_type (ctxt, GCC_JIT_TYPE_VOID);
+  gcc_jit_type *int_type =
+    gcc_jit_context_get_type (ctxt, GCC_JIT_TYPE_INT);
+  gcc_jit_type *size_type =
+    gcc_jit_context_get_type (ctxt, GCC_JIT_TYPE_SIZE_T);
+  gcc_jit_type *int_ptr_type = gcc_jit_type_get_pointer (int_type);
+  gcc_jit_type *const_int_ptr_type =
+    gcc_jit_type_get_pointer (gcc_jit_type_get_const (int_type));
+
+  gcc_jit_param *params[3];
+  params[0] = gcc_jit_context_new_param (ctxt, NULL, const_int_ptr_type, "in");
+  params[1] = gcc_jit_context_new_param (ctxt, NULL, int_ptr_type, "out");
+  params[2] = gcc_jit_context_new_param (ctxt, NULL, size_type, "n");
+  gcc_jit_function *batch =
+    gcc_jit_context_new_function (ctxt, NULL,
+                                  GCC_JIT_FUNCTION_EXPORTED,
+                                  void_type,
+                                  name,
+                                  3, params, 0);
+  gcc_jit_lvalue *i =
+    gcc_jit_function_new_local (batch, NULL, size_type, "i");
+
+  gcc_jit_block *initial = gcc_jit_function_new_block (batch, "initial");
+  gcc_jit_block *loop_test = gcc_jit_function_new_block (batch, "loop_test");
+  gcc_jit_block *loop_body = gcc_jit_function_new_block (batch, "loop_body");
+  gcc_jit_block *done = gcc_jit_function_new_block (batch, "done");
+
+  // i = 0;
+  gcc_jit_block_add_assignment (initial, NULL, i,
+                                gcc_jit_context_zero (ctxt, size_type));
+  gcc_jit_block_end_with_jump (initial, NULL, loop_test);
+
+  // if (i < n) goto loop_body; else goto done;
+  gcc_jit_block_end_with_conditional (
+    loop_test, NULL,
+    gcc_jit_context_new_comparison (ctxt, NULL, GCC_JIT_COMPARISON_LT,
+                                    gcc_jit_lvalue_as_rvalue (i),
+                                    gcc_jit_param_as_rvalue (params[2])),
+    loop_body, done);
+
+  // out[i] = fn(in[i]); i++;
+  gcc_jit_rvalue *arg =
+    gcc_jit_lvalue_as_rvalue (
+      gcc_jit_context_new_array_access (ctxt, NULL,
+                                        gcc_jit_param_as_rvalue (params[0]),
+                                        gcc_jit_lvalue_as_rvalue (i)));
+  gcc_jit_block_add_assignment (
+    loop_body, NULL,
+    gcc_jit_context_new_array_access (ctxt, NULL,
+                                      gcc_jit_param_as_rvalue (params[1]),
+                                      gcc_jit_lvalue_as_rvalue (i)),
+    gcc_jit_context_new_call (ctxt, NULL, fn, 1, &arg));
+  gcc_jit_block_add_assignment_op (loop_body, NULL, i,
+                                   GCC_JIT_BINARY_OP_PLUS,
+                                   gcc_jit_context_one (ctxt, size_type));
+  gcc_jit_block_end_with_jump (loop_body, NULL, loop_test);
+
+  gcc_jit_block_end_with_void_return (done, NULL);
+
+  return batch;
+}
 
-  gcc_jit_result *result = gcc_jit_context_compile (ctxt);
-  gcc_jit_context_release (ctxt);
+void *module::compile(int fn, const jit_options &opts)
+{
+  const jit_cache_entry *entry = get_jit_code(opts);
+  return entry ? entry->m_code[fn] : NULL;
+}
 
-  return gcc_jit_result_get_code (result,
-                                  "fibonacci" /* FIXME */);
-  /* FIXME: this leaks "result" */
+void *module::compile_batch(int fn, const jit_options &opts)
+{
+  const jit_cache_entry *entry = get_jit_code(opts);
+  return entry ? entry->m_batch_code[fn] : NULL;
+}
+
+/* The version of the code generated for a given module, which is part
+   of every disk_cache key: bump it whenever that code changes.  */
+static const int DISK_CACHE_FORMAT = 1;
+
+/* Hash everything which affects the code compiled from the module with
+   the given options.  */
+unsigned long long
+module::get_disk_cache_key(const jit_options &opts) const
+{
+  disk_cache_key key;
+  key.add_int(DISK_CACHE_FORMAT);
+  key.add_int(opts.m_optimization_level);
+  key.add_int(opts.m_debuginfo);
+  key.add_int(opts.m_memoize);
+  key.add_int(opts.m_block_per_instr);
+  key.add_int(opts.m_branch_profile != NULL);
+  key.add_int(m_functions.size());
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    const wordcode *code = m_functions[i];
+    key.add_int(code->get_num_instrs());
+    for (int pc = 0; pc < code->get_num_instrs(); pc++) {
+      const instr &ins = code->get_instrs()[pc];
+      key.add_int(ins.m_op);
+      key.add_int(ins.m_output_reg);
+      key.add_int(ins.m_inputA.m_addrmode);
+      key.add_int(ins.m_inputA.m_value);
+      key.add_int(ins.m_inputB.m_addrmode);
+      key.add_int(ins.m_inputB.m_value);
+      if (opts.m_branch_profile
+          && ins.m_op == JUMP_ABS_IF_TRUE
+          && ins.m_inputA.m_addrmode == REGISTER) {
+        key.add_int(opts.m_branch_profile->get_hint(i, pc));
+      }
+      if (opts.m_debuginfo) {
+        key.add_string(ins.m_loc.m_filename);
+        key.add_int(ins.m_loc.m_linenum);
+        key.add_int(ins.m_loc.m_colnum);
+      }
+    }
+  }
+  return key.get();
+}
+
+/* Look up a function or global in compiled code: either the JIT's own
+   result, or a shared object loaded from a disk_cache.  */
+static void *
+get_symbol(gcc_jit_result *result, void *dl_handle, const std::string &name,
+           bool is_global)
+{
+  if (dl_handle) {
+    return dlsym(dl_handle, name.c_str());
+  }
+  if (is_global) {
+    return gcc_jit_result_get_global (result, name.c_str());
+  }
+  return gcc_jit_result_get_code (result, name.c_str());
+}
+
+/* Get the code for the whole module compiled with the given options,
+   compiling it if it isn't in the cache, or NULL on failure.  */
+const module::jit_cache_entry *
+module::get_jit_code(const jit_options &opts)
+{
+  for (unsigned i = 0; i < m_jit_cache.size(); i++) {
+    if (m_jit_cache[i].m_options == opts) {
+      return &m_jit_cache[i];
+    }
+  }
+
+  bool use_disk_cache = (m_disk_cache
+                         && !opts.m_dump_wordcode
+                         && !opts.m_dump_initial_gimple
+                         && !opts.m_dump_generated_code
+                         && !opts.m_dump_everything
+                         && !opts.m_keep_intermediates);
+
+  // Each function gets its own symbol, so that they can't clash with
+  // those of other modules.  The objects in the disk_cache are loaded
+  // privately, so theirs needn't be unique, but must be the same from
+  // one run to the next:
+  std::vector<std::string> names;
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    char fn_name[32];
+    sprintf (fn_name, "jit_fn_%i",
+             (use_disk_cache
+              ? (int)i
+              : __sync_fetch_and_add (&num_compiled_fns, 1)));
+    names.push_back(fn_name);
+  }
+
+  // A memo_cache table for each pure function, if memoizing:
+  std::vector<std::string> memo_names(m_functions.size());
+  if (opts.m_memoize) {
+    std::vector<bool> is_pure = find_pure_functions();
+    for (unsigned i = 0; i < m_functions.size(); i++) {
+      if (is_pure[i]) {
+        memo_names[i] = names[i] + "_memo";
+      }
+    }
+  }
+
+  // ...and a loop around each function, for compile_batch:
+  std::vector<std::string> batch_names;
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    batch_names.push_back(names[i] + "_batch");
+  }
+
+  jit_cache_entry entry;
+  entry.m_options = opts;
+  entry.m_result = NULL;
+  entry.m_dl_handle = NULL;
+  unsigned long long key = 0;
+  if (use_disk_cache) {
+    key = get_disk_cache_key(opts);
+    entry.m_dl_handle = m_disk_cache->lookup(key);
+  }
+  if (!entry.m_dl_handle) {
+    gcc_jit_context *ctxt =
+      make_jit_context(opts, names, memo_names, batch_names);
+    if (use_disk_cache) {
+      entry.m_dl_handle = m_disk_cache->insert(key, ctxt);
+    }
+    // If the cache can't be written to, we can still compile in memory:
+    if (!entry.m_dl_handle) {
+      entry.m_result = gcc_jit_context_compile (ctxt);
+    }
+    gcc_jit_context_release (ctxt);
+    if (!entry.m_dl_handle && !entry.m_result) {
+      return NULL;
+    }
+  }
+
+  // The tables start out zeroed, which isn't empty (see memo_cache), so
+  // clear them before the code can be called:
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    if (!memo_names[i].empty()) {
+      memo_cache::clear(
+        (memo_cache::entry *)get_symbol(entry.m_result, entry.m_dl_handle,
+                                        memo_names[i], true));
+    }
+  }
+
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    entry.m_code.push_back(get_symbol(entry.m_result, entry.m_dl_handle,
+                                      names[i], false));
+    entry.m_batch_code.push_back(get_symbol(entry.m_result, entry.m_dl_handle,
+                                            batch_names[i], false));
+  }
+  m_jit_cache.push_back(entry);
+  return &m_jit_cache.back();
+}
+
+/* Build a JIT context holding the whole module, with the functions
+   named as given, a memo_cache table for each function with a name in
+   "memo_names", and a loop around each function named as in
+   "batch_names".  */
+gcc_jit_context *
+module::make_jit_context(const jit_options &opts,
+                         const std::vector<std::string> &names,
+                         const std::vector<std::string> &memo_names,
+                         const std::vector<std::string> &batch_names) const
+{
+  gcc_jit_context *ctxt = gcc_jit_context_acquire ();
+
+  gcc_jit_context_set_int_option (ctxt,
+                                  GCC_JIT_INT_OPTION_OPTIMIZATION_LEVEL,
+                                  opts.m_optimization_level);
+  gcc_jit_context_set_bool_option (ctxt,
+                                   GCC_JIT_BOOL_OPTION_DEBUGINFO,
+                                   opts.m_debuginfo);
+  gcc_jit_context_set_bool_option (ctxt,
+                                   GCC_JIT_BOOL_OPTION_DUMP_INITIAL_GIMPLE,
+                                   opts.m_dump_initial_gimple);
+  gcc_jit_context_set_bool_option (ctxt,
+                                   GCC_JIT_BOOL_OPTION_DUMP_GENERATED_CODE,
+                                   opts.m_dump_generated_code);
+  gcc_jit_context_set_bool_option (ctxt,
+                                   GCC_JIT_BOOL_OPTION_DUMP_EVERYTHING,
+                                   opts.m_dump_everything);
+  gcc_jit_context_set_bool_option (ctxt,
+                                   GCC_JIT_BOOL_OPTION_KEEP_INTERMEDIATES,
+                                   opts.m_keep_intermediates);
+
+  gcc_jit_type *int_type =
+    gcc_jit_context_get_type (ctxt, GCC_JIT_TYPE_INT);
+
+  // Declare all of the functions before building any of them, so that
+  // each can call any other:
+  std::vector<gcc_jit_function *> fns;
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    gcc_jit_location *fn_loc =
+      make_jit_loc(ctxt, m_functions[i]->get_location(0));
+    gcc_jit_param *param =
+      gcc_jit_context_new_param (ctxt, fn_loc, int_type, "input");
+    fns.push_back(
+      gcc_jit_context_new_function (ctxt,
+                                    fn_loc,
+                                    GCC_JIT_FUNCTION_EXPORTED,
+                                    int_type,
+                                    names[i].c_str(),
+                                    1, &param, 0));
+  }
+
+  std::vector<gcc_jit_lvalue *> memo_tables(m_functions.size());
+  gcc_jit_type *table_type =
+    gcc_jit_context_new_array_type (
+      ctxt, NULL,
+      gcc_jit_context_get_type (ctxt, GCC_JIT_TYPE_UNSIGNED_LONG_LONG),
+      MEMO_CACHE_SIZE);
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    if (!memo_names[i].empty()) {
+      memo_tables[i] =
+        gcc_jit_context_new_global (ctxt, NULL,
+                                    GCC_JIT_GLOBAL_EXPORTED,
+                                    table_type,
+                                    memo_names[i].c_str());
+    }
+  }
+
+  arena scratch;
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    compile_function(ctxt, fns, memo_tables, i, *m_functions[i], opts,
+                     &scratch);
+    scratch.release();
+  }
+
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    make_batch_function(ctxt, fns[i], batch_names[i].c_str());
+  }
+
+  return ctxt;
 }
 #endif
 
+/* Reading the operands of an instruction, in either layout, from
+   either a frame (with bounds-checking) or a raw array of registers.  */
+
+static inline int
+eval_a(const frame &f, const instr &ins)
+{
+  return f.eval_int(ins.m_inputA);
+}
+
+static inline int
+eval_b(const frame &f, const instr &ins)
+{
+  return f.eval_int(ins.m_inputB);
+}
+
+static inline int
+eval_a(const frame &f, const packed_instr &ins)
+{
+  return ins.m_a_is_reg ? f.get_int_reg(ins.m_a) : ins.m_a;
+}
+
+static inline int
+eval_b(const frame &f, const packed_instr &ins)
+{
+  return ins.m_b_is_reg ? f.get_int_reg(ins.m_b) : ins.m_b;
+}
+
+static inline int
+eval_a(const int *regs, const instr &ins)
+{
+  const input &in = ins.m_inputA;
+  return in.m_addrmode == CONSTANT ? in.m_value : regs[in.m_value];
+}
+
+static inline int
+eval_b(const int *regs, const instr &ins)
+{
+  const input &in = ins.m_inputB;
+  return in.m_addrmode == CONSTANT ? in.m_value : regs[in.m_value];
+}
+
+static inline int
+eval_a(const int *regs, const packed_instr &ins)
+{
+  return ins.m_a_is_reg ? regs[ins.m_a] : ins.m_a;
+}
+
+static inline int
+eval_b(const int *regs, const packed_instr &ins)
+{
+  return ins.m_b_is_reg ? regs[ins.m_b] : ins.m_b;
+}
+
+/* Copy the constant pool into the registers above those used by the
+   code, at the start of a frame.  */
+static inline void
+load_constants(const wordcode *code, int *regs)
+{
+  int num_constants = code->get_num_constants();
+  if (num_constants) {
+    const int *pool = code->get_constants();
+    regs += code->get_num_registers();
+    for (int i = 0; i < num_constants; i++) {
+      regs[i] = pool[i];
+    }
+  }
+}
+
+/* The instructions of the given layout.  */
+
+static inline const instr *
+get_code(const wordcode *code, const instr *)
+{
+  return code->get_instrs();
+}
+
+static inline const packed_instr *
+get_code(const wordcode *code, const packed_instr *)
+{
+  return code->get_packed_instrs();
+}
+
+template <class TRACE>
 int vm::interpret(int input)
 {
-  frame f;
+  if (runs_wide()) {
+    return interpret_switch<TRACE, instr>(m_entry, input);
+  }
+  return interpret_switch<TRACE, packed_instr>(m_entry, input);
+}
+
+template int vm::interpret<no_trace>(int input);
+template int vm::interpret<stdout_trace>(int input);
+template int vm::interpret<count_trace>(int input);
+template int vm::interpret<hotness_trace>(int input);
+template int vm::interpret<profile_trace>(int input);
+template int vm::interpret<branch_trace>(int input);
+
+template <class TRACE, class INSTR>
+int vm::interpret_switch(int fn, int input)
+{
+  const wordcode *wcode = m_module->get_function(fn);
+  const INSTR *code = get_code(wcode, (const INSTR *)NULL);
+  int base = alloc_frame(wcode);
+  frame f(&m_register_stack[base], wcode->get_frame_size());
+  load_constants(wcode, &m_register_stack[base]);
   int pc = 0;
-  debug_begin_frame(input);
+  m_current_fn = fn;
+  TRACE::begin_frame(*this, input);
   f.set_int_reg(0, input);
   while (1) {
-    debug_begin_opcode(f, pc);
-    const instr &ins = m_wordcode->fetch_instr(pc);
-    switch (ins.m_op) {
+    TRACE::begin_opcode(*this, f, pc);
+    const INSTR &ins = code[pc++];
+    switch ((enum opcode)ins.m_op) {
       case COPY_INT:
         {
-          int result = f.eval_int(ins.m_inputA);
+          int result = eval_a(f, ins);
           f.set_int_reg(ins.m_output_reg, result);
         }
         break;
 
       case BINARY_INT_ADD:
         {
-          int lhs = f.eval_int(ins.m_inputA);
-          int rhs = f.eval_int(ins.m_inputB);
+          int lhs = eval_a(f, ins);
+          int rhs = eval_b(f, ins);
           int result = lhs + rhs;
           f.set_int_reg(ins.m_output_reg, result);
         }
@@ -451,8 +1445,8 @@ int vm::interpret(int input)
 
       case BINARY_INT_SUBTRACT:
         {
-          int lhs = f.eval_int(ins.m_inputA);
-          int rhs = f.eval_int(ins.m_inputB);
+          int lhs = eval_a(f, ins);
+          int rhs = eval_b(f, ins);
           int result = lhs - rhs;
           f.set_int_reg(ins.m_output_reg, result);
         }
@@ -460,8 +1454,8 @@ int vm::interpret(int input)
 
       case BINARY_INT_COMPARE_LT:
         {
-          int lhs = f.eval_int(ins.m_inputA);
-          int rhs = f.eval_int(ins.m_inputB);
+          int lhs = eval_a(f, ins);
+          int rhs = eval_b(f, ins);
           bool result = lhs < rhs;
           f.set_bool_reg(ins.m_output_reg, result);
         }
@@ -469,9 +1463,11 @@ int vm::interpret(int input)
 
       case JUMP_ABS_IF_TRUE:
         {
-          bool flag = f.eval_int(ins.m_inputA);
-          int dest = f.eval_int(ins.m_inputB);
+          bool flag = eval_a(f, ins);
+          int dest = eval_b(f, ins);
+          TRACE::branch(*this, pc - 1, flag);
           if (flag) {
+            TRACE::jump(*this, pc, dest);
             pc = dest;
           }
         }
@@ -479,16 +1475,27 @@ int vm::interpret(int input)
 
       case CALL_INT:
         {
-          int arg = f.eval_int(ins.m_inputA);
-          int result = interpret(arg); //recurse
+          int arg = eval_a(f, ins);
+          int callee = eval_b(f, ins);
+          memo_cache *memo = get_memo_cache(callee);
+          int result;
+          if (!memo || !memo->lookup(arg, &result)) {
+            result = interpret_switch<TRACE, INSTR>(callee, arg); //recurse
+            m_current_fn = fn;
+            f.relocate(&m_register_stack[base]);
+            if (memo) {
+              memo->insert(arg, result);
+            }
+          }
           f.set_int_reg(ins.m_output_reg, result);
         }
         break;
 
       case RETURN_INT:
         {
-          int result = f.eval_int(ins.m_inputA);
-          debug_end_frame(pc, result);
+          int result = eval_a(f, ins);
+          release_frame(base);
+          TRACE::end_frame(*this, pc, result);
           return result;
         }
         break;
@@ -496,15 +1503,187 @@ int vm::interpret(int input)
       default:
         assert(0); // FIXME
       }
-    debug_end_opcode(pc);
+    TRACE::end_opcode(*this, pc);
+  }
+}
+
+int vm::interpret_frame_stack(int input)
+{
+  if (runs_wide()) {
+    return interpret_frame_stack<instr>(input);
+  }
+  return interpret_frame_stack<packed_instr>(input);
+}
+
+size_t vm::interpret_batch(const int *in, int *out, size_t n)
+{
+  if (runs_wide()) {
+    return interpret_batch<instr>(in, out, n);
+  }
+  return interpret_batch<packed_instr>(in, out, n);
+}
+
+template <class INSTR>
+size_t vm::interpret_batch(const int *in, int *out, size_t n)
+{
+  size_t i;
+  if (m_engine == ENGINE_FRAME_STACK) {
+    for (i = 0; i < n; i++) {
+      out[i] = interpret_frame_stack<INSTR>(in[i]);
+      if (m_error) {
+        return i;
+      }
+    }
+  } else {
+    for (i = 0; i < n; i++) {
+      out[i] = interpret_switch<no_trace, INSTR>(m_entry, in[i]);
+    }
+  }
+  return n;
+}
+
+template <class INSTR>
+int vm::interpret_frame_stack(int input)
+{
+  int fn = m_entry;
+  const wordcode *wcode = m_module->get_function(fn);
+  const INSTR *code = get_code(wcode, (const INSTR *)NULL);
+  int num_regs = wcode->get_frame_size();
+  m_error = NULL;
+  if (m_register_stack.size() < (size_t)num_regs) {
+    m_register_stack.resize(num_regs);
+  }
+  if (m_call_stack.empty()) {
+    m_call_stack.resize(16);
+  }
+
+  /* The registers of all frames are held in m_register_stack, with the
+     current frame's registers starting at "regs".  */
+  int *regs = &m_register_stack[0];
+  int pc = 0;
+
+  /* Saved callers are held in m_call_stack[0..depth).  */
+  call_record *calls = &m_call_stack[0];
+  int depth = 0;
+
+#define EVAL_A(INS) eval_a(regs, (INS))
+#define EVAL_B(INS) eval_b(regs, (INS))
+
+  load_constants(wcode, regs);
+  regs[0] = input;
+  while (1) {
+    const INSTR &ins = code[pc++];
+    switch ((enum opcode)ins.m_op) {
+      case COPY_INT:
+        regs[ins.m_output_reg] = EVAL_A(ins);
+        break;
+
+      case BINARY_INT_ADD:
+        regs[ins.m_output_reg] = EVAL_A(ins) + EVAL_B(ins);
+        break;
+
+      case BINARY_INT_SUBTRACT:
+        regs[ins.m_output_reg] = EVAL_A(ins) - EVAL_B(ins);
+        break;
+
+      case BINARY_INT_COMPARE_LT:
+        regs[ins.m_output_reg] = EVAL_A(ins) < EVAL_B(ins);
+        break;
+
+      case JUMP_ABS_IF_TRUE:
+        if (EVAL_A(ins)) {
+          pc = EVAL_B(ins);
+        }
+        break;
+
+      case CALL_INT:
+        {
+          int arg = EVAL_A(ins);
+          int callee = EVAL_B(ins);
+          memo_cache *memo = get_memo_cache(callee);
+          if (memo && memo->lookup(arg, &regs[ins.m_output_reg])) {
+            break;
+          }
+          if (depth >= m_max_call_depth) {
+            m_error = "maximum call depth exceeded";
+            return 0;
+          }
+          if (depth == (int)m_call_stack.size()) {
+            m_call_stack.resize(2 * depth);
+            calls = &m_call_stack[0];
+          }
+          calls[depth].m_fn = fn;
+          calls[depth].m_return_pc = pc;
+          calls[depth].m_output_reg = ins.m_output_reg;
+          calls[depth].m_arg = arg;
+          depth++;
+          size_t offset = (regs - &m_register_stack[0]) + num_regs;
+          fn = callee;
+          wcode = m_module->get_function(fn);
+          code = get_code(wcode, (const INSTR *)NULL);
+          num_regs = wcode->get_frame_size();
+          if (m_register_stack.size() < offset + num_regs) {
+            m_register_stack.resize(2 * (offset + num_regs));
+          }
+          regs = &m_register_stack[offset];
+          load_constants(wcode, regs);
+          regs[0] = arg;
+          pc = 0;
+        }
+        break;
+
+      case RETURN_INT:
+        {
+          int result = EVAL_A(ins);
+          if (depth == 0) {
+            return result;
+          }
+          depth--;
+          memo_cache *memo = get_memo_cache(fn);
+          if (memo) {
+            memo->insert(calls[depth].m_arg, result);
+          }
+          fn = calls[depth].m_fn;
+          wcode = m_module->get_function(fn);
+          code = get_code(wcode, (const INSTR *)NULL);
+          num_regs = wcode->get_frame_size();
+          regs -= num_regs;
+          regs[calls[depth].m_output_reg] = result;
+          pc = calls[depth].m_return_pc;
+        }
+        break;
+
+      default:
+        assert(0); // FIXME
+      }
+  }
+
+#undef EVAL_A
+#undef EVAL_B
+}
+
+void vm::set_memoize(bool memoize)
+{
+  for (unsigned i = 0; i < m_memo_caches.size(); i++) {
+    delete m_memo_caches[i];
+  }
+  m_memo_caches.clear();
+  if (memoize) {
+    std::vector<bool> is_pure = m_module->find_pure_functions();
+    for (unsigned i = 0; i < is_pure.size(); i++) {
+      m_memo_caches.push_back(is_pure[i] ? new memo_cache() : NULL);
+    }
   }
 }
 
-frame::frame()
+int vm::alloc_frame(const wordcode *code)
 {
-  for (int i = 0; i < NUM_REGISTERS; i++) {
-    m_registers[i] = 0xDEADBEEF;
+  int base = m_stack_top;
+  m_stack_top += code->get_frame_size();
+  if (m_register_stack.size() < (size_t)m_stack_top) {
+    m_register_stack.resize(2 * m_stack_top);
   }
+  return base;
 }
 
 int frame::eval_int(const input& in) const
@@ -514,36 +1693,50 @@ int frame::eval_int(const input& in) const
     return in.m_value;
   case REGISTER:
     assert(in.m_value >= 0);
-    assert(in.m_value < NUM_REGISTERS);
+    assert(in.m_value < m_num_registers);
     return m_registers[in.m_value];
   default:
     assert(0);
   }
 }
 
-int frame::get_int_reg(int idx)
+int frame::get_int_reg(int idx) const
 {
   assert(idx >= 0);
-  assert(idx < NUM_REGISTERS);
-  printf("setting reg%i as %i\n", idx, m_registers[idx]);
+  assert(idx < m_num_registers);
   return m_registers[idx];
 }
 
 void frame::set_int_reg(int idx, int val)
 {
   assert(idx >= 0);
-  assert(idx < NUM_REGISTERS);
-  printf("setting reg%i to %i\n", idx, val);
+  assert(idx < m_num_registers);
   m_registers[idx] = val;
 }
 
 void frame::debug_registers(FILE *out) const
 {
-  for (int i = 0; i < NUM_REGISTERS; i++) {
+  for (int i = 0; i < m_num_registers; i++) {
     fprintf(out, "    register %i: %i\n", i, m_registers[i]);
   }
 }
 
+static const char *const opcode_names[NUM_OPCODES] = {
+  "COPY_INT",
+  "BINARY_INT_ADD",
+  "BINARY_INT_SUBTRACT",
+  "BINARY_INT_COMPARE_LT",
+  "JUMP_ABS_IF_TRUE",
+  "CALL_INT",
+  "RETURN_INT",
+};
+
+const char *vm::get_opcode_name(int pc) const
+{
+  const wordcode *code = m_module->get_function(m_current_fn);
+  return opcode_names[code->get_instrs()[pc].m_op];
+}
+
 void vm::debug_begin_frame(int arg)
 {
   printf("BEGIN FRAME: arg=%i\n", arg);
@@ -557,7 +1750,7 @@ void vm::debug_end_frame(int pc, int result)
 void vm::debug_begin_opcode(const frame &f, int pc)
 {
   printf("begin opcode: ");
-  m_wordcode->disassemble_at(stdout, pc);
+  m_module->get_function(m_current_fn)->disassemble_at(stdout, pc);
   printf("  registers: \n");
   f.debug_registers(stdout);
 }
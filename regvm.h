@@ -17,16 +17,20 @@
    <http://www.gnu.org/licenses/>.
 */
 
+#include <string>
 #include <vector>
 
 #include "location.h"
+#include "trace.h"
 
 struct gcc_jit_context;
+struct gcc_jit_result;
+class arena;
+class disk_cache;
+class exec_profile;
 
 namespace regvm {
 
-const int NUM_REGISTERS = 4;
-
 // A simple register-based virtual machine
 enum addrmode {
   CONSTANT,
@@ -39,7 +43,11 @@ enum opcode {
   BINARY_INT_SUBTRACT,
   BINARY_INT_COMPARE_LT,
   JUMP_ABS_IF_TRUE,
+
+  /* Call the function within the module whose index is given by inputB
+     (always a CONSTANT), passing inputA.  */
   CALL_INT,
+
   RETURN_INT,
 
   NUM_OPCODES,
@@ -52,6 +60,12 @@ struct input
       m_value(value)
   {}
 
+  bool operator==(const input &other) const
+  {
+    return m_addrmode == other.m_addrmode && m_value == other.m_value;
+  }
+  bool operator!=(const input &other) const { return !(*this == other); }
+
   enum addrmode m_addrmode;
   int m_value;
 };
@@ -64,6 +78,11 @@ struct instr
 
   void disassemble(FILE *out) const;
 
+  int get_num_inputs() const;
+
+  /* Does this instruction write to m_output_reg?  */
+  bool has_output() const;
+
   enum opcode m_op;
   int m_output_reg;
   input m_inputA;
@@ -72,12 +91,167 @@ struct instr
   location m_loc;
 };
 
+/* The range of operands that can be held in a packed_instr.  */
+const int PACKED_MIN_OPERAND = -32768;
+const int PACKED_MAX_OPERAND = 32767;
+
+/* The compact form of an instr, run by the interpreters: 8 bytes rather
+   than the 40 or so of an instr, as there's no location (that stays in
+   the wordcode's instrs, which serve as a table of locations indexed by
+   pc), and each operand is a 16-bit value plus a bit saying whether it
+   is a register.  Constants that don't fit in 16 bits go into the
+   wordcode's constant pool, which is loaded into extra registers at the
+   start of each frame, so they too are read as registers.  A wordcode
+   using registers beyond PACKED_MAX_OPERAND has no packed form, and
+   is only run in LAYOUT_WIDE (see wordcode::is_packed).  */
+struct packed_instr
+{
+  unsigned char m_op;
+  unsigned char m_a_is_reg : 1;
+  unsigned char m_b_is_reg : 1;
+  unsigned short m_output_reg;
+  short m_a;
+  short m_b;
+};
+
+/* Which way a conditional jump usually goes, if either.  */
+enum branch_hint {
+  BRANCH_UNKNOWN,
+  BRANCH_USUALLY_TAKEN,
+  BRANCH_USUALLY_NOT_TAKEN,
+};
+
+/* How many times each conditional jump of a module was taken, and not
+   taken, as recorded by running a vm with branch_trace, for laying out
+   the code compiled from the module (see jit_options::m_branch_profile).
+   This is cheap enough to gather while interpreting: a pair of counters
+   per jump, bumped on each execution of it.  */
+class branch_profile
+{
+public:
+  void clear() { m_fns.clear(); }
+
+  void record(int fn, int pc, bool taken)
+  {
+    if (fn >= (int)m_fns.size()) {
+      m_fns.resize(fn + 1);
+    }
+    std::vector<edge_counts> &pcs = m_fns[fn];
+    if (pc >= (int)pcs.size()) {
+      pcs.resize(pc + 1);
+    }
+    if (taken) {
+      pcs[pc].m_taken++;
+    } else {
+      pcs[pc].m_not_taken++;
+    }
+  }
+
+  long get_num_taken(int fn, int pc) const;
+  long get_num_not_taken(int fn, int pc) const;
+
+  /* Which way the jump at "pc" of "fn" usually went: one way in at
+     least nine runs out of ten, over enough runs to go by.  */
+  enum branch_hint get_hint(int fn, int pc) const;
+
+  /* Write the counts of each jump that has run.  */
+  void write(FILE *out) const;
+
+private:
+  struct edge_counts
+  {
+    edge_counts() : m_taken(0), m_not_taken(0) {}
+
+    long m_taken;
+    long m_not_taken;
+  };
+
+  /* Indexed by function, then pc.  */
+  std::vector<std::vector<edge_counts> > m_fns;
+};
+
+/* Record the direction of each conditional jump into the vm's
+   branch_profile (see vm::set_branch_profile).  */
+struct branch_trace : public no_trace
+{
+  template <class VM>
+  static void branch(VM &vm, int pc, bool taken) {
+    vm.get_branch_profile()->record(vm.get_current_fn(), pc, taken);
+  }
+};
+
+/* Settings for module::compile.  The defaults give optimized code
+   without writing any dumps or temporary files, which is what's wanted
+   outside of debugging the JIT itself.  */
+struct jit_options
+{
+  jit_options()
+    : m_optimization_level(3),
+      m_debuginfo(false),
+      m_dump_wordcode(false),
+      m_dump_initial_gimple(false),
+      m_dump_generated_code(false),
+      m_dump_everything(false),
+      m_keep_intermediates(false),
+      m_memoize(false),
+      m_block_per_instr(false),
+      m_branch_profile(NULL)
+  {}
+
+  /* Everything switched on, for seeing what the JIT does.  */
+  static jit_options verbose();
+
+  bool operator==(const jit_options &other) const;
+
+  int m_optimization_level;
+  bool m_debuginfo;
+  /* Disassemble each instruction to stdout as it is compiled.  */
+  bool m_dump_wordcode;
+  bool m_dump_initial_gimple;
+  bool m_dump_generated_code;
+  bool m_dump_everything;
+  bool m_keep_intermediates;
+  /* Cache the results of calls to pure functions (see
+     module::find_pure_functions), probing a memo_cache inline before
+     each such call.  */
+  bool m_memoize;
+  /* Give every instruction a gcc_jit_block of its own, rather than one
+     per basic block.  This only makes more work for GCC; it's here so
+     that the compile times can be compared.  */
+  bool m_block_per_instr;
+  /* If non-NULL, how the module's jumps went in the interpreter: those
+     which usually go one way get __builtin_expect, and blocks only
+     reached by unlikely edges are placed after the others.  The
+     profile is owned by the caller, and should be complete before
+     compiling, as the code is cached against the pointer, not the
+     counts.  */
+  const branch_profile *m_branch_profile;
+};
+
+/* A function's instructions.  The filenames of their locations are
+   interned into the wordcode's own filename_pool, so the wordcode
+   doesn't depend on whatever it was built from (such as a
+   stackvm::bytecode) outliving it.  */
 class wordcode
 {
 public:
-  wordcode(std::vector<instr> instrs)
+  wordcode(const std::vector<instr> &instrs)
     : m_instrs(instrs)
-  {}
+  {
+    intern_filenames();
+    m_num_registers = compute_num_registers();
+    pack();
+  }
+
+  /* As above, but taking the buffer of instructions from "*instrs",
+     which is left empty, rather than copying it.  */
+  explicit wordcode(std::vector<instr> *instrs)
+  {
+    m_instrs.swap(*instrs);
+    intern_filenames();
+    m_num_registers = compute_num_registers();
+    pack();
+  }
 
   void disassemble(FILE *out) const;
 
@@ -89,50 +263,462 @@ public:
   int
   fetch_arg_int(int &pc) const;
 
-  void *compile();
+  int get_num_instrs() const { return m_instrs.size(); }
+
+  const instr *get_instrs() const { return &m_instrs[0]; }
+  const packed_instr *get_packed_instrs() const { return &m_packed_instrs[0]; }
+  /* Whether every instruction fits in a packed_instr; if not, there are
+     no packed instructions, nor a constant pool.  */
+  bool is_packed() const { return m_is_packed; }
+  const int *get_constants() const
+  {
+    return m_constants.empty() ? NULL : &m_constants[0];
+  }
+  int get_num_constants() const { return m_constants.size(); }
+
+  const location &get_location(int pc) const { return m_instrs[pc].m_loc; }
+
+  /* The number of registers used by a frame: one more than the highest
+     register referenced (and at least 1, for the argument).  */
+  int get_num_registers() const { return m_num_registers; }
+
+  /* The number of registers in a frame, including those holding the
+     constant pool.  */
+  int get_frame_size() const { return m_num_registers + m_constants.size(); }
+
+private:
+  void intern_filenames();
+  int compute_num_registers() const;
+  void pack();
+
+  // Not copyable, as we own the interned filenames:
+  wordcode(const wordcode &);
+  wordcode &operator=(const wordcode &);
 
 private:
   std::vector<instr> m_instrs;
+  int m_num_registers;
+  bool m_is_packed;
+  filename_pool m_filenames;
+
+  /* The same instructions, packed, and the constant pool.  */
+  std::vector<packed_instr> m_packed_instrs;
+  std::vector<int> m_constants;
 };
 
+/* log2 of the number of entries in a memo_cache.  */
+const int MEMO_CACHE_BITS = 12;
+const int MEMO_CACHE_SIZE = 1 << MEMO_CACHE_BITS;
+
+/* A bounded cache of the results of a pure function, keyed by its
+   argument.  It is direct-mapped: each argument has a single slot,
+   chosen by hashing it, and a new result evicts whatever was in its
+   slot.
+
+   Each entry is one 64-bit word, holding the argument in the upper
+   half and the result in the lower, so that a lookup makes a single
+   read.  JIT-compiled code uses the same layout for its caches, and
+   since it can be called from many threads at once, an entry must
+   never be seen half-written.  An empty slot holds an argument which
+   doesn't hash to that slot, so it never matches.  */
+class memo_cache
+{
+public:
+  typedef unsigned long long entry;
+
+  memo_cache() { clear(m_entries); }
+
+  static int hash(int arg)
+  {
+    return ((unsigned)arg * 2654435761u) >> (32 - MEMO_CACHE_BITS);
+  }
+
+  static entry pack(int arg, int result)
+  {
+    return ((entry)(unsigned)arg << 32) | (unsigned)result;
+  }
+
+  /* Fill a table of MEMO_CACHE_SIZE entries with empty slots.  0 hashes
+     to slot 0, and 1 to some other slot.  */
+  static void clear(entry *entries)
+  {
+    for (int i = 0; i < MEMO_CACHE_SIZE; i++) {
+      entries[i] = pack(i == 0 ? 1 : 0, 0);
+    }
+  }
+
+  bool lookup(int arg, int *result) const
+  {
+    entry e = m_entries[hash(arg)];
+    if ((int)(e >> 32) != arg) {
+      return false;
+    }
+    *result = (int)e;
+    return true;
+  }
+
+  void insert(int arg, int result) { m_entries[hash(arg)] = pack(arg, result); }
+
+private:
+  entry m_entries[MEMO_CACHE_SIZE];
+};
+
+/* A set of functions, which CALL_INT refers to by their index within
+   the module.  */
+class module
+{
+public:
+  module()
+    : m_disk_cache(NULL),
+      m_is_packed(true)
+  {}
+  ~module();
+
+  /* Add a function, which the module takes ownership of, returning its
+     index.  */
+  int add_function(wordcode *code);
+
+  int get_num_functions() const { return m_functions.size(); }
+  wordcode *get_function(int fn) const { return m_functions[fn]; }
+
+  /* Whether every function has a packed form; vms run a module which
+     doesn't in LAYOUT_WIDE, whatever their layout is set to, as a
+     caller and callee must share a layout.  */
+  bool is_packed() const { return m_is_packed; }
+
+  void disassemble(FILE *out) const;
+
+  /* Find which functions are pure: their result depends only on their
+     argument, and they have no side effects, so that calls to them can
+     be memoized.  A function is pure if it uses only arithmetic,
+     branches, returns, and calls to pure functions (including
+     itself).  */
+  std::vector<bool> find_pure_functions() const;
+
+  /* Build a copy of the module, with each function simplified by
+     regvm::optimize and regvm::eliminate_self_calls, and its registers
+     then renumbered by
+     regvm::allocate_registers so that frames are no bigger than
+     needed.  */
+  module *optimize() const;
+
+  /* Compile the whole module to machine code, in a single JIT context,
+     so that calls between its functions are direct (and can be
+     inlined), returning a pointer to function "fn" (taking and
+     returning an int), or NULL on failure.  The code is cached for
+     each set of options: only the first call with given options does
+     any work, and the code remains valid for the lifetime of the
+     module.  This updates the cache, so it must not be called by more
+     than one thread at once, but the code it returns can be called
+     from any number of threads.  */
+  void *compile(int fn, const jit_options &opts = jit_options());
+
+  /* Have compile look for the code in the given disk_cache (which must
+     outlive the module) before compiling it, and add it there if not
+     found.  The cache isn't used when any of the dump options are set,
+     as they are only meaningful when the compiler actually runs.
+     Modules with identical code loaded by one process share a single
+     object, and hence their memo_cache tables, which is harmless, as
+     their functions compute the same results.  */
+  void set_disk_cache(disk_cache *cache) { m_disk_cache = cache; }
+
+  /* As compile, but returning a pointer to a loop around function "fn",
+     of type:
+
+       void (*) (const int *in, int *out, size_t n)
+
+     which sets out[i] to fn(in[i]) for each i below n.  The loop is
+     built in the same JIT context as the function, so GCC can inline
+     the function into it and, if the function is straight-line code,
+     vectorize the loop.  */
+  void *compile_batch(int fn, const jit_options &opts = jit_options());
+
+private:
+  // Not copyable, as we own the functions and the JIT results:
+  module(const module &);
+  module &operator=(const module &);
+
+  struct jit_cache_entry
+  {
+    jit_options m_options;
+    /* Either the JIT's own result, or the handle of the shared object
+       loaded from the disk_cache.  */
+    gcc_jit_result *m_result;
+    void *m_dl_handle;
+    /* The code for each function, and for the loop around it.  */
+    std::vector<void *> m_code;
+    std::vector<void *> m_batch_code;
+  };
+
+  const jit_cache_entry *get_jit_code(const jit_options &opts);
+  unsigned long long get_disk_cache_key(const jit_options &opts) const;
+  gcc_jit_context *
+  make_jit_context(const jit_options &opts,
+                   const std::vector<std::string> &names,
+                   const std::vector<std::string> &memo_names,
+                   const std::vector<std::string> &batch_names) const;
+
+private:
+  std::vector<wordcode *> m_functions;
+  disk_cache *m_disk_cache;
+  bool m_is_packed;
+
+  /* The cached results of compile, released by the destructor.  */
+  std::vector<jit_cache_entry> m_jit_cache;
+};
+
+/* Register allocation (regalloc.cc).
+
+   Given instructions using "virtual" registers 0..num_vregs-1, with the
+   function's argument arriving in virtual register 0, rewrite them in
+   place to use as few registers as possible, eliminating copies where
+   source and destination share a register.  Temporaries are allocated
+   from "scratch" if given, and from an arena of our own otherwise.  */
+void
+allocate_registers(std::vector<instr> &instrs, int num_vregs,
+                   arena *scratch = NULL);
+
+/* Simplify the instructions in place (optimize.cc), with constant and
+   copy propagation, dead-store elimination, and removal of unreachable
+   code, keeping the locations of those that remain.  */
+void
+optimize(std::vector<instr> &instrs);
+
+/* Turn the calls that function "fn" makes to itself into loops, where
+   the result is returned directly (a tail call), or after adding
+   something to it or subtracting something from it, as in the second
+   call of "return fib(n - 1) + fib(n - 2)", which then goes into an
+   accumulator that is added to whatever the function finally returns
+   (optimize.cc).  Either way the argument is moved into R0 and the
+   call becomes a jump back to the start, so frames aren't pushed for
+   such calls.  Returns false if there were none.  The accumulator is a
+   register above those already used, so the caller must allow for one
+   more.  */
+bool
+eliminate_self_calls(std::vector<instr> &instrs, int fn);
+
+/* Delete the flagged instructions, updating jump destinations
+   accordingly: a jump to a deleted instruction goes to the next
+   surviving one.  */
+void
+remove_instrs(std::vector<instr> &instrs, const std::vector<bool> &to_remove);
+
+/* The registers of one frame: a view of "num_regs" slots within a
+   vm's register stack.  */
 class frame
 {
 public:
-  frame();
+  frame(int *regs, int num_regs)
+    : m_registers(regs),
+      m_num_registers(num_regs)
+  {}
+
+  /* The vm's register stack can be reallocated while this frame is
+     suspended in a call; point the frame at the new location.  */
+  void relocate(int *regs) { m_registers = regs; }
 
   int eval_int(const input& in) const;
   bool eval_bool(const input& in) const { return eval_int(in) != 0; }
 
-  int get_int_reg(int idx);
+  int get_int_reg(int idx) const;
   void set_int_reg(int idx, int val);
 
-  bool get_bool_reg(int idx) { return get_int_reg(idx) != 0; }
+  bool get_bool_reg(int idx) const { return get_int_reg(idx) != 0; }
   void set_bool_reg(int idx ,bool flag) { set_int_reg(idx, flag ? 1 : 0); }
 
   void debug_registers(FILE *out) const;
 
 private:
-  int m_registers[NUM_REGISTERS];
+  int *m_registers;
+  int m_num_registers;
+};
+
+/* The default limit on the depth of calls for ENGINE_FRAME_STACK.  */
+const int DEFAULT_MAX_CALL_DEPTH = 100000;
+
+/* The ways in which a vm can execute wordcode.  */
+enum engine {
+  /* A "switch" statement over each instruction, with CALL_INT
+     recursing on the C++ stack.  */
+  ENGINE_SWITCH,
+
+  /* As ENGINE_SWITCH, but CALL_INT pushes a record onto an explicit,
+     growable stack of frames.  The depth of calls is limited by
+     set_max_call_depth; if the limit is exceeded, interpretation stops
+     and get_error describes the problem.  This engine does not support
+     tracing.  */
+  ENGINE_FRAME_STACK,
+};
+
+/* Which form of the wordcode's instructions a vm runs.  The packed form
+   is smaller and therefore faster; the wide form is kept for
+   comparison, and for modules too big to pack (see
+   module::is_packed).  */
+enum layout {
+  LAYOUT_PACKED,
+  LAYOUT_WIDE,
+};
+
+/* The state of a caller, saved by CALL_INT within ENGINE_FRAME_STACK.  */
+struct call_record
+{
+  int m_fn;
+  int m_return_pc;
+  int m_output_reg;
+  /* The callee's argument, for memoizing its result.  */
+  int m_arg;
 };
 
+/* Runs the functions of a module, starting from its "entry" function.
+
+   A vm holds the stacks of the frames it is running, so it must only be
+   used by one thread at a time, but interpretation doesn't modify the
+   module, so any number of vms (e.g. one per thread) can run the same
+   module at once.  Tracing is only done by the interpret<TRACE>
+   variants; the untraced entry points never touch stdout.  */
 class vm
 {
 public:
-  vm(wordcode *code)
-    : m_wordcode(code)
+  vm(module *mod, int entry = 0)
+    : m_module(mod),
+      m_entry(entry),
+      m_current_fn(entry),
+      m_engine(ENGINE_SWITCH),
+      m_layout(LAYOUT_PACKED),
+      m_stack_top(0),
+      m_max_call_depth(DEFAULT_MAX_CALL_DEPTH),
+      m_error(NULL),
+      m_profile(NULL),
+      m_branch_profile(NULL)
   {}
-  ~vm() {}
+  ~vm() { set_memoize(false); }
+
+  void set_engine(enum engine engine) { m_engine = engine; }
+  enum engine get_engine() const { return m_engine; }
+
+  void set_layout(enum layout layout) { m_layout = layout; }
+  enum layout get_layout() const { return m_layout; }
 
+  /* Run the entry function using the switch engine, calling the hooks
+     of the given tracing policy (see trace.h) as it goes.  */
+  template <class TRACE>
   int interpret(int arg);
 
-private:
+  /* Run the entry function untraced, using the selected engine.  */
+  int interpret(int arg)
+  {
+    if (m_engine == ENGINE_FRAME_STACK) {
+      return interpret_frame_stack(arg);
+    }
+    return interpret<no_trace>(arg);
+  }
+
+  int interpret_frame_stack(int arg);
+
+  /* Run the entry function untraced over each of the "n" values in
+     "in", writing the results to "out", using the selected engine and
+     layout, which are chosen once for the whole batch.  Returns the
+     number of results written, which is less than "n" if a call failed
+     (see get_error).  */
+  size_t interpret_batch(const int *in, int *out, size_t n);
+
+  void set_max_call_depth(int depth) { m_max_call_depth = depth; }
+
+  /* Enable or disable memoization: when enabled, CALL_INT of a pure
+     function (see module::find_pure_functions) looks in a memo_cache
+     for that function before making the call, and adds the result to
+     it afterwards.  The caches are kept for the lifetime of the vm.  */
+  void set_memoize(bool memoize);
+
+  /* A description of why the most recent call to interpret failed,
+     or NULL if it succeeded.  */
+  const char *get_error() const { return m_error; }
+
+  exec_counts &get_counts() { return m_counts; }
+
+  /* Where interpret<profile_trace> records its profile (see
+     profile.h), which is owned by the caller.  */
+  void set_profile(exec_profile *profile) { m_profile = profile; }
+  exec_profile *get_profile() const { return m_profile; }
+
+  /* Where interpret<branch_trace> records its branch_profile, which is
+     owned by the caller.  */
+  void set_branch_profile(branch_profile *profile)
+  {
+    m_branch_profile = profile;
+  }
+  branch_profile *get_branch_profile() const { return m_branch_profile; }
+
+  /* The function being run by the switch engine, and the name of the
+     opcode at "pc" within it, for the tracing hooks.  */
+  int get_current_fn() const { return m_current_fn; }
+  const char *get_opcode_name(int pc) const;
+
   void debug_begin_frame(int arg);
   void debug_end_frame(int pc, int result);
   void debug_begin_opcode(const frame &f, int pc);
   void debug_end_opcode(int pc);
 
 private:
-  wordcode *m_wordcode;
+  template <class TRACE, class INSTR>
+  int interpret_switch(int fn, int arg);
+
+  template <class INSTR>
+  int interpret_frame_stack(int arg);
+
+  template <class INSTR>
+  size_t interpret_batch(const int *in, int *out, size_t n);
+
+  int alloc_frame(const wordcode *code);
+
+  /* Whether to run the wide instructions: either asked for, or because
+     the module has no packed form.  */
+  bool runs_wide() const
+  {
+    return m_layout == LAYOUT_WIDE || !m_module->is_packed();
+  }
+
+  // Not copyable, as we own the memo caches:
+  vm(const vm &);
+  vm &operator=(const vm &);
+
+  /* The memo_cache of the given function, or NULL if it isn't being
+     memoized.  */
+  memo_cache *get_memo_cache(int fn) const
+  {
+    return m_memo_caches.empty() ? NULL : m_memo_caches[fn];
+  }
+  void release_frame(int base) { m_stack_top = base; }
+
+private:
+  module *m_module;
+  int m_entry;
+
+  /* The function being run by the switch engine, for the debug
+     hooks.  */
+  int m_current_fn;
+
+  enum engine m_engine;
+  enum layout m_layout;
+  exec_counts m_counts;
+
+  /* The registers of all frames, held contiguously.  Each frame takes
+     its function's number of registers, starting at m_stack_top when
+     it is entered.  This is kept between calls to avoid reallocating
+     it.  */
+  std::vector<int> m_register_stack;
+  int m_stack_top;
+
+  /* State for ENGINE_FRAME_STACK.  */
+  std::vector<call_record> m_call_stack;
+  int m_max_call_depth;
+  const char *m_error;
+  exec_profile *m_profile;
+  branch_profile *m_branch_profile;
+
+  /* A memo_cache per function while memoization is enabled (NULL for
+     impure functions), or empty otherwise.  */
+  std::vector<memo_cache *> m_memo_caches;
 };
 
 }; // namespace regvm
@@ -0,0 +1,161 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "stackvm.h"
+#include "regvm.h"
+#include "jitqueue.h"
+#include "runtime.h"
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+runtime::runtime()
+  : m_threshold(DEFAULT_TIER_UP_THRESHOLD),
+    m_jit_queue(NULL),
+    m_disk_cache(NULL),
+    m_tier_up_callback(NULL),
+    m_tier_up_user_data(NULL)
+{
+}
+
+runtime::~runtime()
+{
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    function &f = m_functions[i];
+    if (f.m_job) {
+      // The worker thread may still be using the module:
+      m_jit_queue->cancel(f.m_job);
+      delete f.m_job;
+    }
+    delete f.m_vm;
+    delete f.m_regvm;
+    delete f.m_regvm_module;
+  }
+}
+
+int runtime::add_function(stackvm::bytecode *code)
+{
+  function f;
+  int fn = m_module.add_function(code);
+  f.m_vm = new stackvm::vm(&m_module, fn);
+  f.m_regvm_module = NULL;
+  f.m_regvm = NULL;
+  f.m_job = NULL;
+  f.m_code = NULL;
+  m_functions.push_back(f);
+  return fn;
+}
+
+int runtime::call(int fn, int arg)
+{
+  assert(fn >= 0);
+  assert(fn < (int)m_functions.size());
+  function &f = m_functions[fn];
+
+  if (f.m_job) {
+    poll_job(fn);
+  }
+  if (f.m_code) {
+    f.m_stats.m_compiled_calls++;
+    return f.m_code(arg);
+  }
+  if (f.m_regvm) {
+    f.m_stats.m_regvm_calls++;
+    return f.m_regvm->interpret(arg);
+  }
+
+  int result = f.m_vm->interpret<hotness_trace>(arg);
+  const exec_counts &counts = f.m_vm->get_counts();
+  f.m_stats.m_frames = counts.m_frames;
+  f.m_stats.m_backward_jumps = counts.m_backward_jumps;
+
+  if (f.m_stats.m_tier == TIER_INTERPRETED
+      && counts.m_frames + counts.m_backward_jumps >= m_threshold) {
+    tier_up(fn);
+  }
+  return result;
+}
+
+const function_stats &runtime::get_stats(int fn) const
+{
+  assert(fn >= 0);
+  assert(fn < (int)m_functions.size());
+  return m_functions[fn].m_stats;
+}
+
+/* Lower the module to regvm, optimize it, and compile it, either now
+   or in the background.  */
+void runtime::tier_up(int fn)
+{
+  function &f = m_functions[fn];
+
+  regvm::module *lowered = m_module.compile_to_regvm();
+  f.m_regvm_module = lowered->optimize();
+  f.m_regvm_module->set_disk_cache(m_disk_cache);
+  delete lowered;
+  if (m_jit_queue) {
+    f.m_regvm = new regvm::vm(f.m_regvm_module, fn);
+    f.m_job = m_jit_queue->submit(f.m_regvm_module, fn, m_jit_options);
+    f.m_stats.m_tier = TIER_COMPILING;
+    return;
+  }
+
+  double start = now();
+  void *code = f.m_regvm_module->compile(fn, m_jit_options);
+  finish_tier_up(fn, (compiled_code)code, now() - start);
+}
+
+/* Check whether a background compile has finished, without blocking.  */
+void runtime::poll_job(int fn)
+{
+  function &f = m_functions[fn];
+  enum jit_job_state state = f.m_job->get_state();
+  if (state == JOB_PENDING || state == JOB_RUNNING) {
+    return;
+  }
+
+  compiled_code code = (compiled_code)f.m_job->get_code();
+  double compile_time = f.m_job->get_compile_time();
+  delete f.m_job;
+  f.m_job = NULL;
+  finish_tier_up(fn, code, compile_time);
+}
+
+/* Switch later calls over to the machine code (if any).  */
+void runtime::finish_tier_up(int fn, compiled_code code, double compile_time)
+{
+  function &f = m_functions[fn];
+
+  f.m_code = code;
+  f.m_stats.m_compile_time = compile_time;
+  f.m_stats.m_tier = code ? TIER_COMPILED : TIER_FAILED;
+
+  if (m_tier_up_callback) {
+    m_tier_up_callback(m_tier_up_user_data, fn, f.m_stats);
+  }
+}
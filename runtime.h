@@ -0,0 +1,155 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+/* Tiered execution of stackvm functions.
+
+   The functions added to a runtime form a stackvm::module, so that
+   CALL_INT refers to them by the index add_function returned.  Each
+   starts out interpreted by a stackvm::vm, which counts the frames it
+   enters (including those of the functions it calls) and how many
+   backward jumps it takes.  Once the sum of these reaches the runtime's
+   threshold, the whole module is lowered to regvm code and compiled,
+   so that the function's calls are direct, and later calls of the
+   function go straight to the machine code.  Tiering up happens
+   between calls: a call that is already running in the interpreter
+   finishes there.
+
+   If the runtime is given a jit_queue, compilation happens on the
+   queue's worker thread instead, and until the code is ready, calls
+   run the regvm code in its interpreter.  A runtime should only be
+   used by one thread at a time, but several runtimes (e.g. one per
+   interpreter thread) can share a jit_queue.  */
+
+class jit_queue;
+class jit_job;
+
+enum tier {
+  TIER_INTERPRETED,
+
+  /* Being compiled on a jit_queue; calls run in regvm::vm meanwhile.  */
+  TIER_COMPILING,
+
+  TIER_COMPILED,
+
+  /* Compilation failed, so the function stays in the interpreter.  */
+  TIER_FAILED,
+};
+
+/* What a runtime has observed about one function.  */
+struct function_stats
+{
+  function_stats()
+    : m_tier(TIER_INTERPRETED),
+      m_frames(0),
+      m_backward_jumps(0),
+      m_regvm_calls(0),
+      m_compiled_calls(0),
+      m_compile_time(0)
+  {}
+
+  enum tier m_tier;
+
+  /* Counts from the interpreter.  */
+  long m_frames;
+  long m_backward_jumps;
+
+  /* The number of calls made to regvm::vm whilst TIER_COMPILING, and to
+     the compiled code.  */
+  long m_regvm_calls;
+  long m_compiled_calls;
+
+  /* The time taken to lower and compile the function, in seconds.  */
+  double m_compile_time;
+};
+
+/* Called when a function reaches TIER_COMPILED or TIER_FAILED.  */
+typedef void (*tier_up_callback) (void *user_data, int fn,
+                                  const function_stats &stats);
+
+const int DEFAULT_TIER_UP_THRESHOLD = 1000;
+
+class runtime
+{
+public:
+  runtime();
+  ~runtime();
+
+  /* Add a function to the runtime's module, which takes ownership of
+     it, returning its index.  */
+  int add_function(stackvm::bytecode *code);
+
+  int get_num_functions() const { return m_functions.size(); }
+
+  /* Call the given function, in whichever tier it has reached.  */
+  int call(int fn, int arg);
+
+  void set_threshold(long threshold) { m_threshold = threshold; }
+
+  void set_jit_options(const regvm::jit_options &opts) { m_jit_options = opts; }
+
+  /* Compile in the background on the given queue (or synchronously, if
+     NULL).  The queue must outlive the runtime.  */
+  void set_jit_queue(jit_queue *queue) { m_jit_queue = queue; }
+
+  /* Look for compiled code in the given cache (see
+     regvm::module::set_disk_cache), which must outlive the runtime.  */
+  void set_disk_cache(disk_cache *cache) { m_disk_cache = cache; }
+
+  void set_tier_up_callback(tier_up_callback cb, void *user_data)
+  {
+    m_tier_up_callback = cb;
+    m_tier_up_user_data = user_data;
+  }
+
+  const function_stats &get_stats(int fn) const;
+
+private:
+  typedef int (*compiled_code) (int);
+
+  /* The state of one function.  Its regvm module (and the code within
+     it) is its own, as the runtime's module may have grown by the time
+     another function tiers up.  */
+  struct function
+  {
+    stackvm::vm *m_vm;
+    regvm::module *m_regvm_module;
+    regvm::vm *m_regvm;
+    jit_job *m_job;
+    compiled_code m_code;
+    function_stats m_stats;
+  };
+
+  void tier_up(int fn);
+  void poll_job(int fn);
+  void finish_tier_up(int fn, compiled_code code, double compile_time);
+
+  // Not copyable, as we own the vms and compiled code:
+  runtime(const runtime &);
+  runtime &operator=(const runtime &);
+
+private:
+  stackvm::module m_module;
+  std::vector<function> m_functions;
+  long m_threshold;
+  regvm::jit_options m_jit_options;
+  jit_queue *m_jit_queue;
+  disk_cache *m_disk_cache;
+  tier_up_callback m_tier_up_callback;
+  void *m_tier_up_user_data;
+};
@@ -20,18 +20,106 @@
 #include <assert.h>
 #include <stdio.h>
 #include <vector>
-#include <map>
 
 #include "stackvm.h"
 #include "regvm.h"
+#include "profile.h"
+#include "arena.h"
 
 using namespace stackvm;
 
-void bytecode::set_location(int pc, const char *filename, int linenum, int colnum)
+/* The number of operands following each opcode: each is a single
+   byte, or four bytes after a WIDE prefix.  */
+static const int num_args[NUM_OPCODES] = {
+  0, // DUP,
+  0, // ROT,
+  1, // PUSH_INT_CONST,
+  0, // BINARY_INT_ADD,
+  0, // BINARY_INT_SUBTRACT,
+  0, // BINARY_INT_COMPARE_LT,
+  1, // JUMP_ABS_IF_TRUE,
+  1, // CALL_INT,
+  0, // RETURN_INT,
+  2, // COMPARE_LT_CONST_JUMP_ABS_IF_TRUE,
+  2, // SUBTRACT_CONST_CALL_INT,
+  0, // WIDE,
+};
+
+/* The change in the depth of the stack caused by each opcode.  */
+static const int stack_effect[NUM_OPCODES] = {
+  1, // DUP,
+  0, // ROT,
+  1, // PUSH_INT_CONST,
+  -1, // BINARY_INT_ADD,
+  -1, // BINARY_INT_SUBTRACT,
+  -1, // BINARY_INT_COMPARE_LT,
+  -1, // JUMP_ABS_IF_TRUE,
+  0, // CALL_INT,
+  -1, // RETURN_INT,
+  0, // COMPARE_LT_CONST_JUMP_ABS_IF_TRUE,
+  0, // SUBTRACT_CONST_CALL_INT,
+  0, // WIDE,
+};
+
+static bool
+is_jump(enum opcode op)
+{
+  return (op == JUMP_ABS_IF_TRUE
+          || op == COMPARE_LT_CONST_JUMP_ABS_IF_TRUE);
+}
+
+int bytecode::compute_stack_depths(std::vector<int> *depths) const
 {
-  m_locations[pc].m_filename = filename;
-  m_locations[pc].m_linenum = linenum;
-  m_locations[pc].m_colnum = colnum;
+  std::vector<int> depth_at(m_len, -1);
+  std::vector<int> worklist;
+  int max_depth = 1; // 1 initial arg
+
+  if (m_len > 0) {
+    depth_at[0] = 1;
+    worklist.push_back(0);
+  }
+  while (!worklist.empty()) {
+    int pc = worklist.back();
+    worklist.pop_back();
+    bool wide;
+    int depth = depth_at[pc];
+    enum opcode op = fetch_opcode(pc, wide);
+    depth += stack_effect[op];
+    assert(depth >= 0);
+    if (depth > max_depth) {
+      max_depth = depth;
+    }
+    int arg = 0;
+    for (int i = 0; i < num_args[op]; i++) {
+      arg = fetch_arg_int(pc, wide);
+    }
+
+    // Propagate the depth to the successors (the destination of a jump
+    // is always its final operand):
+    int succs[2];
+    int num_succs = 0;
+    if (op != RETURN_INT && pc < m_len) {
+      succs[num_succs++] = pc;
+    }
+    if (is_jump(op)) {
+      assert(arg >= 0 && arg < m_len);
+      succs[num_succs++] = arg;
+    }
+    for (int i = 0; i < num_succs; i++) {
+      if (depth_at[succs[i]] < 0) {
+        depth_at[succs[i]] = depth;
+        worklist.push_back(succs[i]);
+      } else {
+        // The depth must be the same however we get there:
+        assert(depth_at[succs[i]] == depth);
+      }
+    }
+  }
+
+  if (depths) {
+    depths->swap(depth_at);
+  }
+  return max_depth;
 }
 
 void bytecode::disassemble(FILE *out) const
@@ -45,8 +133,12 @@ void bytecode::disassemble(FILE *out) const
 void bytecode::disassemble_at(FILE *out, int &pc) const
 {
     fprintf(out, "[%i] : ", pc);
-    const location &loc = m_locations[pc];
-    enum opcode op = fetch_opcode(pc);
+    const location &loc = get_location(pc);
+    bool wide;
+    enum opcode op = fetch_opcode(pc, wide);
+    if (wide) {
+      fprintf(out, "WIDE ");
+    }
     switch (op) {
       case DUP:
         {
@@ -62,7 +154,7 @@ void bytecode::disassemble_at(FILE *out, int &pc) const
 
       case PUSH_INT_CONST:
         {
-          fprintf(out, "PUSH_INT_CONST %i", fetch_arg_int(pc));
+          fprintf(out, "PUSH_INT_CONST %i", fetch_arg_int(pc, wide));
         }
         break;
 
@@ -86,13 +178,13 @@ void bytecode::disassemble_at(FILE *out, int &pc) const
 
       case JUMP_ABS_IF_TRUE:
         {
-          fprintf(out, "JUMP_ABS_IF_TRUE %i", fetch_arg_int(pc));
+          fprintf(out, "JUMP_ABS_IF_TRUE %i", fetch_arg_int(pc, wide));
         }
         break;
 
       case CALL_INT:
         {
-          fprintf(out, "CALL_INT");
+          fprintf(out, "CALL_INT %i", fetch_arg_int(pc, wide));
         }
         break;
 
@@ -102,6 +194,22 @@ void bytecode::disassemble_at(FILE *out, int &pc) const
         }
         break;
 
+      case COMPARE_LT_CONST_JUMP_ABS_IF_TRUE:
+        {
+          int rhs = fetch_arg_int(pc, wide);
+          int dest = fetch_arg_int(pc, wide);
+          fprintf(out, "COMPARE_LT_CONST_JUMP_ABS_IF_TRUE %i %i", rhs, dest);
+        }
+        break;
+
+      case SUBTRACT_CONST_CALL_INT:
+        {
+          int rhs = fetch_arg_int(pc, wide);
+          int fn = fetch_arg_int(pc, wide);
+          fprintf(out, "SUBTRACT_CONST_CALL_INT %i %i", rhs, fn);
+        }
+        break;
+
       default:
         assert(0); // FIXME
     }
@@ -115,13 +223,14 @@ void bytecode::disassemble_at(FILE *out, int &pc) const
 class compilation_frame
 {
 public:
-  compilation_frame() :
-    m_depth(1) // 1 initial arg
+  compilation_frame(int max_depth) :
+    m_depth(1), // 1 initial arg
+    m_max_depth(max_depth)
   {}
 
+  /* The register above those used for the stack.  */
   regvm::input get_accum() {
-    return regvm::input(regvm::REGISTER,
-                        regvm::NUM_REGISTERS - 1);
+    return regvm::input(regvm::REGISTER, m_max_depth);
   }
 
   regvm::input pop_int();
@@ -136,6 +245,7 @@ public:
 
   //private:
   int m_depth;
+  int m_max_depth;
   std::vector<regvm::instr> m_instrs;
 };
 
@@ -159,24 +269,42 @@ void compilation_frame::push_int(regvm::input in, const location &loc)
 
 void compilation_frame::add_instr(const regvm::instr& ins)
 {
-  printf("add_instr: [%i] ", (int)m_instrs.size());
-  ins.disassemble(stdout);
   m_instrs.push_back(ins);
 }
 
 regvm::wordcode *
-bytecode::compile_to_regvm() const
+bytecode::compile_to_regvm(arena *scratch) const
 {
-  compilation_frame f;
+  arena own_scratch;
+  if (!scratch) {
+    scratch = &own_scratch;
+  }
+  compilation_frame f(m_max_stack_depth);
+  f.m_instrs.reserve(m_len);
   int pc = 0;
 
+  // The depth of the stack on entry to each opcode:
+  std::vector<int> depths;
+  compute_stack_depths(&depths);
+
   // Map from offset within src opcodes to index of first generated instr
-  std::map<int, int> index_map;
+  arena_vector<int>::type index_map(m_len, -1, scratch);
 
   while (pc < m_len) {
-    index_map.insert(std::make_pair(pc, f.next_instr_idx()));
-    const location &loc = m_locations[pc];
-    enum opcode op = fetch_opcode(pc);
+    index_map[pc] = f.next_instr_idx();
+    const location &loc = get_location(pc);
+    int depth = depths[pc];
+    bool wide;
+    enum opcode op = fetch_opcode(pc, wide);
+    if (depth < 0) {
+      // Unreachable (e.g. dead code after a RETURN_INT), so there's no
+      // depth to lower it at; skip it and its operands:
+      for (int i = 0; i < num_args[op]; i++) {
+        fetch_arg_int(pc, wide);
+      }
+      continue;
+    }
+    f.m_depth = depth;
     switch (op) {
       case DUP:
         {
@@ -222,7 +350,7 @@ bytecode::compile_to_regvm() const
       case PUSH_INT_CONST:
         {
           f.push_int(regvm::input(regvm::CONSTANT,
-                                  fetch_arg_int(pc)),
+                                  fetch_arg_int(pc, wide)),
                      loc);
         }
         break;
@@ -269,7 +397,7 @@ bytecode::compile_to_regvm() const
       case JUMP_ABS_IF_TRUE:
         {
           regvm::input flag = f.pop_bool();
-          int dest = fetch_arg_int(pc);
+          int dest = fetch_arg_int(pc, wide);
           f.add_instr(regvm::instr(regvm::JUMP_ABS_IF_TRUE,
                                    0,
                                    flag,
@@ -282,10 +410,12 @@ bytecode::compile_to_regvm() const
       case CALL_INT:
         {
           regvm::input arg = f.pop_int();
+          int fn = fetch_arg_int(pc, wide);
           regvm::input accum = f.get_accum();
           f.add_instr(regvm::instr(regvm::CALL_INT,
                                    accum.m_value,
                                    arg,
+                                   regvm::input(regvm::CONSTANT, fn),
                                    loc));
           f.push_int(accum, loc);
         }
@@ -301,6 +431,501 @@ bytecode::compile_to_regvm() const
         }
         break;
 
+      case COMPARE_LT_CONST_JUMP_ABS_IF_TRUE:
+        {
+          regvm::input top(regvm::REGISTER, f.m_depth - 1);
+          int rhs = fetch_arg_int(pc, wide);
+          int dest = fetch_arg_int(pc, wide);
+          regvm::input accum = f.get_accum();
+          f.add_instr(regvm::instr(regvm::BINARY_INT_COMPARE_LT,
+                                   accum.m_value,
+                                   top,
+                                   regvm::input(regvm::CONSTANT, rhs),
+                                   loc));
+          f.add_instr(regvm::instr(regvm::JUMP_ABS_IF_TRUE,
+                                   0,
+                                   accum,
+                                   regvm::input(regvm::CONSTANT, dest),
+                                   loc));
+          // the dest address gets patched below
+        }
+        break;
+
+      case SUBTRACT_CONST_CALL_INT:
+        {
+          regvm::input arg = f.pop_int();
+          int rhs = fetch_arg_int(pc, wide);
+          int fn = fetch_arg_int(pc, wide);
+          regvm::input accum = f.get_accum();
+          f.add_instr(regvm::instr(regvm::BINARY_INT_SUBTRACT,
+                                   accum.m_value,
+                                   arg,
+                                   regvm::input(regvm::CONSTANT, rhs),
+                                   loc));
+          f.add_instr(regvm::instr(regvm::CALL_INT,
+                                   accum.m_value,
+                                   accum,
+                                   regvm::input(regvm::CONSTANT, fn),
+                                   loc));
+          f.push_int(accum, loc);
+        }
+        break;
+
+      default:
+        assert(0); // FIXME
+      }
+  }
+
+  // Patch jumps (from referring to offsets in src bytecode
+  // to referring to indices in generated wordcode)
+  for (unsigned int i = 0; i < f.m_instrs.size(); i++) {
+    regvm::instr &ins = f.m_instrs[i];
+    if (regvm::JUMP_ABS_IF_TRUE == ins.m_op) {
+      ins.m_inputB.m_value = index_map[ins.m_inputB.m_value];
+    }
+  }
+
+  return new regvm::wordcode(&f.m_instrs);
+}
+
+
+/* Flag the offsets within "code" that are the destinations of jumps.  */
+template <class VECTOR>
+static void
+find_jump_targets(const bytecode &code, VECTOR &is_jump_target)
+{
+  is_jump_target.assign(code.get_len(), false);
+  int pc = 0;
+  while (pc < code.get_len()) {
+    bool wide;
+    enum opcode op = code.fetch_opcode(pc, wide);
+    int arg = 0;
+    for (int i = 0; i < num_args[op]; i++) {
+      arg = code.fetch_arg_int(pc, wide);
+    }
+    if (is_jump(op)) {
+      // The destination is always the final operand:
+      assert(arg >= 0 && arg < code.get_len());
+      is_jump_target[arg] = true;
+    }
+  }
+}
+
+/* Read, write, or append an operand within bytes being built up.  */
+static int
+get_arg_int(const std::vector<char> &bytes, int offset, bool wide)
+{
+  if (!wide) {
+    return bytes[offset];
+  }
+  unsigned value = 0;
+  for (int i = 3; i >= 0; i--) {
+    value = (value << 8) | (unsigned char)bytes[offset + i];
+  }
+  return (int)value;
+}
+
+static void
+set_arg_int(std::vector<char> &bytes, int offset, int value, bool wide)
+{
+  if (!wide) {
+    assert(value >= NARROW_MIN_OPERAND && value <= NARROW_MAX_OPERAND);
+    bytes[offset] = value;
+    return;
+  }
+  for (int i = 0; i < 4; i++) {
+    bytes[offset + i] = (char)((unsigned)value >> (8 * i));
+  }
+}
+
+static void
+append_arg_int(std::vector<char> &bytes, int value, bool wide)
+{
+  int offset = bytes.size();
+  bytes.resize(offset + (wide ? 4 : 1));
+  set_arg_int(bytes, offset, value, wide);
+}
+
+/* Does the given sequence of opcodes appear at "pc", without any jumps
+   into the middle of it?  (A WIDE prefix never matches, so only opcodes
+   with single-byte operands get fused.)  If so, write the operands of
+   the sequence to "args", and the offset after the sequence to
+   "end_pc".  */
+static bool
+match_sequence(const bytecode &code,
+               const std::vector<bool> &is_jump_target,
+               int pc,
+               const enum opcode *ops, int num_ops,
+               int *args, int *end_pc)
+{
+  int num_matched_args = 0;
+  for (int i = 0; i < num_ops; i++) {
+    if (pc >= code.get_len()) {
+      return false;
+    }
+    if (i > 0 && is_jump_target[pc]) {
+      return false;
+    }
+    if (code.fetch_opcode(pc) != ops[i]) {
+      return false;
+    }
+    for (int j = 0; j < num_args[ops[i]]; j++) {
+      args[num_matched_args++] = code.fetch_arg_int(pc);
+    }
+  }
+  *end_pc = pc;
+  return true;
+}
+
+bytecode *
+bytecode::fuse_superinstructions() const
+{
+  static const enum opcode compare_lt_const_jump[] = {
+    DUP,
+    PUSH_INT_CONST,
+    BINARY_INT_COMPARE_LT,
+    JUMP_ABS_IF_TRUE
+  };
+  static const enum opcode subtract_const_call[] = {
+    PUSH_INT_CONST,
+    BINARY_INT_SUBTRACT,
+    CALL_INT
+  };
+
+  // Locate the jump targets; we can't fuse a sequence that is jumped into:
+  std::vector<bool> is_jump_target;
+  find_jump_targets(*this, is_jump_target);
+  int pc;
+
+  std::vector<char> bytes;
+
+  // Map from offset within the old bytecode to offset within the new:
+  std::vector<int> offset_map(m_len, -1);
+
+  // Offsets within "bytes" of jump destinations, initially referring
+  // to offsets within the old bytecode, and whether each is wide:
+  std::vector<std::pair<int, bool> > jump_operands;
+
+  // Offsets of each new opcode, and of the old opcode whose location
+  // it takes:
+  std::vector<std::pair<int, int> > new_to_old;
+
+  pc = 0;
+  while (pc < m_len) {
+    int start = pc;
+    int args[2];
+    offset_map[start] = bytes.size();
+    new_to_old.push_back(std::make_pair((int)bytes.size(), start));
+
+    if (match_sequence(*this, is_jump_target, pc,
+                       compare_lt_const_jump, 4,
+                       args, &pc)) {
+      bytes.push_back(COMPARE_LT_CONST_JUMP_ABS_IF_TRUE);
+      bytes.push_back(args[0]);
+      jump_operands.push_back(std::make_pair((int)bytes.size(), false));
+      bytes.push_back(args[1]);
+    } else if (match_sequence(*this, is_jump_target, pc,
+                              subtract_const_call, 3,
+                              args, &pc)) {
+      bytes.push_back(SUBTRACT_CONST_CALL_INT);
+      bytes.push_back(args[0]);
+      bytes.push_back(args[1]);
+    } else {
+      // Copy the opcode as it is, keeping the width of its operands:
+      bool wide;
+      enum opcode op = fetch_opcode(pc, wide);
+      if (wide) {
+        bytes.push_back(WIDE);
+      }
+      bytes.push_back(op);
+      for (int i = 0; i < num_args[op]; i++) {
+        if (is_jump(op) && i == num_args[op] - 1) {
+          jump_operands.push_back(std::make_pair((int)bytes.size(), wide));
+        }
+        append_arg_int(bytes, fetch_arg_int(pc, wide), wide);
+      }
+    }
+  }
+
+  // Patch jumps (the code only gets shorter, so the new destinations
+  // still fit in their operands):
+  for (unsigned int i = 0; i < jump_operands.size(); i++) {
+    int offset = jump_operands[i].first;
+    bool wide = jump_operands[i].second;
+    int old_dest = get_arg_int(bytes, offset, wide);
+    assert(offset_map[old_dest] >= 0);
+    set_arg_int(bytes, offset, offset_map[old_dest], wide);
+  }
+
+  bytecode *result = new bytecode(bytes);
+  for (unsigned int i = 0; i < new_to_old.size(); i++) {
+    const location &loc = get_location(new_to_old[i].second);
+    result->set_location(new_to_old[i].first,
+                         loc.m_filename, loc.m_linenum, loc.m_colnum);
+  }
+  return result;
+}
+
+/* State for compile_to_regvm_optimized: the regvm value held in each
+   slot of the stack, tracked at compile-time.
+
+   Slot i has a "home" virtual register i, which holds it at the
+   boundaries of basic blocks; elsewhere a slot can refer to a constant
+   or to any virtual register, so that pushing a constant or
+   duplicating a value generates no code.  Virtual registers from
+   "num_slots" upwards are temporaries.  */
+class abstract_frame
+{
+public:
+  abstract_frame(int num_slots, arena *scratch) :
+    m_next_vreg(num_slots),
+    m_stack(scratch)
+  {
+    m_stack.reserve(num_slots);
+    reset(1); // 1 initial arg
+  }
+
+  /* Set the stack to "depth" slots, each in its home.  */
+  void reset(int depth);
+
+  regvm::input pop_int();
+  regvm::input peek_int() const { return m_stack.back(); }
+  void push_int(regvm::input in) { m_stack.push_back(in); }
+  int get_depth() const { return m_stack.size(); }
+
+  regvm::input new_temp() {
+    return regvm::input(regvm::REGISTER, m_next_vreg++);
+  }
+
+  /* Emit copies so that every slot is in its home, as required at the
+     boundaries of basic blocks.  "keep" (if non-NULL) is a value that
+     is still needed afterwards, and is updated if it gets moved.  */
+  void flush(const location &loc, regvm::input *keep);
+
+  void add_instr(const regvm::instr &ins) { m_instrs.push_back(ins); }
+  int next_instr_idx() const { return m_instrs.size(); }
+
+  std::vector<regvm::instr> m_instrs;
+  int m_next_vreg;
+
+private:
+  static regvm::input home(int slot) {
+    return regvm::input(regvm::REGISTER, slot);
+  }
+
+  arena_vector<regvm::input>::type m_stack;
+};
+
+void abstract_frame::reset(int depth)
+{
+  m_stack.clear();
+  for (int i = 0; i < depth; i++) {
+    m_stack.push_back(home(i));
+  }
+}
+
+regvm::input abstract_frame::pop_int()
+{
+  assert(!m_stack.empty());
+  regvm::input result = m_stack.back();
+  m_stack.pop_back();
+  return result;
+}
+
+void abstract_frame::flush(const location &loc, regvm::input *keep)
+{
+  int depth = get_depth();
+
+  // Any home that is about to be overwritten, but whose value is still
+  // referred to elsewhere, must first be copied somewhere safe:
+  for (int j = 0; j < depth; j++) {
+    if (m_stack[j] == home(j)) {
+      continue;
+    }
+    bool is_needed = (keep && *keep == home(j));
+    for (int k = 0; k < depth; k++) {
+      if (m_stack[k] == home(j)) {
+        is_needed = true;
+      }
+    }
+    if (!is_needed) {
+      continue;
+    }
+    regvm::input temp = new_temp();
+    add_instr(regvm::instr(regvm::COPY_INT, temp.m_value, home(j), loc));
+    for (int k = 0; k < depth; k++) {
+      if (m_stack[k] == home(j)) {
+        m_stack[k] = temp;
+      }
+    }
+    if (keep && *keep == home(j)) {
+      *keep = temp;
+    }
+  }
+
+  // Now move everything into its home:
+  for (int j = 0; j < depth; j++) {
+    if (m_stack[j] != home(j)) {
+      add_instr(regvm::instr(regvm::COPY_INT, j, m_stack[j], loc));
+      m_stack[j] = home(j);
+    }
+  }
+}
+
+regvm::wordcode *
+bytecode::compile_to_regvm_optimized(arena *scratch) const
+{
+  arena own_scratch;
+  if (!scratch) {
+    scratch = &own_scratch;
+  }
+  abstract_frame f(m_max_stack_depth, scratch);
+  f.m_instrs.reserve(m_len);
+  arena_vector<bool>::type is_jump_target(scratch);
+  find_jump_targets(*this, is_jump_target);
+
+  // The depth of the stack on entry to each opcode (or -1 if it's
+  // unreachable), giving the depth at the start of each basic block
+  // even when no jump to it has been seen yet:
+  std::vector<int> depths;
+  compute_stack_depths(&depths);
+
+  // Map from offset within src opcodes to index of first generated instr
+  arena_vector<int>::type index_map(m_len, -1, scratch);
+
+  bool is_reachable = true;
+  int pc = 0;
+  while (pc < m_len) {
+    const location &loc = get_location(pc);
+    int depth = depths[pc];
+    bool wide;
+    if (depth < 0) {
+      // Unreachable, so generate nothing for it, skipping its operands:
+      index_map[pc] = f.next_instr_idx();
+      enum opcode op = fetch_opcode(pc, wide);
+      for (int i = 0; i < num_args[op]; i++) {
+        fetch_arg_int(pc, wide);
+      }
+      is_reachable = false;
+      continue;
+    }
+    if (is_jump_target[pc]) {
+      // Start of a basic block: everything must be in its home.
+      if (is_reachable) {
+        f.flush(loc, NULL);
+        assert(f.get_depth() == depth);
+      } else {
+        f.reset(depth);
+      }
+      is_reachable = true;
+    }
+    index_map[pc] = f.next_instr_idx();
+    enum opcode op = fetch_opcode(pc, wide);
+    switch (op) {
+      case DUP:
+        f.push_int(f.peek_int());
+        break;
+
+      case ROT:
+        {
+          regvm::input first = f.pop_int();
+          regvm::input second = f.pop_int();
+          f.push_int(first);
+          f.push_int(second);
+        }
+        break;
+
+      case PUSH_INT_CONST:
+        f.push_int(regvm::input(regvm::CONSTANT, fetch_arg_int(pc, wide)));
+        break;
+
+      case BINARY_INT_ADD:
+      case BINARY_INT_SUBTRACT:
+      case BINARY_INT_COMPARE_LT:
+        {
+          regvm::input rhs = f.pop_int();
+          regvm::input lhs = f.pop_int();
+          regvm::input result = f.new_temp();
+          enum regvm::opcode regop =
+            ((op == BINARY_INT_ADD) ? regvm::BINARY_INT_ADD
+             : (op == BINARY_INT_SUBTRACT) ? regvm::BINARY_INT_SUBTRACT
+             : regvm::BINARY_INT_COMPARE_LT);
+          f.add_instr(regvm::instr(regop, result.m_value, lhs, rhs, loc));
+          f.push_int(result);
+        }
+        break;
+
+      case JUMP_ABS_IF_TRUE:
+        {
+          regvm::input flag = f.pop_int();
+          int dest = fetch_arg_int(pc, wide);
+          f.flush(loc, &flag);
+          f.add_instr(regvm::instr(regvm::JUMP_ABS_IF_TRUE,
+                                   0,
+                                   flag,
+                                   regvm::input(regvm::CONSTANT, dest),
+                                   loc));
+          // the dest address gets patched below
+        }
+        break;
+
+      case CALL_INT:
+        {
+          regvm::input arg = f.pop_int();
+          int fn = fetch_arg_int(pc, wide);
+          regvm::input result = f.new_temp();
+          f.add_instr(regvm::instr(regvm::CALL_INT, result.m_value, arg,
+                                   regvm::input(regvm::CONSTANT, fn), loc));
+          f.push_int(result);
+        }
+        break;
+
+      case RETURN_INT:
+        {
+          regvm::input result = f.pop_int();
+          f.add_instr(regvm::instr(regvm::RETURN_INT, 0, result, loc));
+          is_reachable = false;
+        }
+        break;
+
+      case COMPARE_LT_CONST_JUMP_ABS_IF_TRUE:
+        {
+          regvm::input lhs = f.peek_int();
+          int rhs = fetch_arg_int(pc, wide);
+          int dest = fetch_arg_int(pc, wide);
+          regvm::input flag = f.new_temp();
+          f.add_instr(regvm::instr(regvm::BINARY_INT_COMPARE_LT,
+                                   flag.m_value,
+                                   lhs,
+                                   regvm::input(regvm::CONSTANT, rhs),
+                                   loc));
+          f.flush(loc, &flag);
+          f.add_instr(regvm::instr(regvm::JUMP_ABS_IF_TRUE,
+                                   0,
+                                   flag,
+                                   regvm::input(regvm::CONSTANT, dest),
+                                   loc));
+        }
+        break;
+
+      case SUBTRACT_CONST_CALL_INT:
+        {
+          regvm::input arg = f.pop_int();
+          int rhs = fetch_arg_int(pc, wide);
+          int fn = fetch_arg_int(pc, wide);
+          regvm::input diff = f.new_temp();
+          f.add_instr(regvm::instr(regvm::BINARY_INT_SUBTRACT,
+                                   diff.m_value,
+                                   arg,
+                                   regvm::input(regvm::CONSTANT, rhs),
+                                   loc));
+          regvm::input result = f.new_temp();
+          f.add_instr(regvm::instr(regvm::CALL_INT, result.m_value, diff,
+                                   regvm::input(regvm::CONSTANT, fn), loc));
+          f.push_int(result);
+        }
+        break;
+
       default:
         assert(0); // FIXME
       }
@@ -311,11 +936,67 @@ bytecode::compile_to_regvm() const
   for (unsigned int i = 0; i < f.m_instrs.size(); i++) {
     regvm::instr &ins = f.m_instrs[i];
     if (regvm::JUMP_ABS_IF_TRUE == ins.m_op) {
-      ins.m_inputB.m_value = index_map.find(ins.m_inputB.m_value)->second;
+      ins.m_inputB.m_value = index_map[ins.m_inputB.m_value];
     }
   }
 
-  return new regvm::wordcode(f.m_instrs);
+  regvm::allocate_registers(f.m_instrs, f.m_next_vreg, scratch);
+  return new regvm::wordcode(&f.m_instrs);
+}
+
+module::~module()
+{
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    delete m_functions[i];
+  }
+}
+
+int module::add_function(bytecode *code)
+{
+  m_functions.push_back(code);
+  return m_functions.size() - 1;
+}
+
+void module::disassemble(FILE *out) const
+{
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    fprintf(out, "function %i:\n", i);
+    m_functions[i]->disassemble(out);
+  }
+}
+
+regvm::module *
+module::compile_to_regvm() const
+{
+  regvm::module *result = new regvm::module();
+  arena scratch;
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    result->add_function(m_functions[i]->compile_to_regvm(&scratch));
+    scratch.release();
+  }
+  return result;
+}
+
+regvm::module *
+module::compile_to_regvm_optimized() const
+{
+  regvm::module *result = new regvm::module();
+  arena scratch;
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    result->add_function(m_functions[i]->compile_to_regvm_optimized(&scratch));
+    scratch.release();
+  }
+  return result;
+}
+
+module *
+module::fuse_superinstructions() const
+{
+  module *result = new module();
+  for (unsigned i = 0; i < m_functions.size(); i++) {
+    result->add_function(m_functions[i]->fuse_superinstructions());
+  }
+  return result;
 }
 
 enum opcode
@@ -330,15 +1011,42 @@ bytecode::fetch_arg_int(int &pc) const
   return static_cast<int>(m_bytes[pc++]);
 }
 
-int vm::interpret(int input)
+int
+bytecode::fetch_wide_arg_int(int &pc) const
 {
-  frame f;
+  const unsigned char *bytes =
+    reinterpret_cast<const unsigned char *>(m_bytes + pc);
+  pc += 4;
+  return static_cast<int>(bytes[0]
+                          | (bytes[1] << 8)
+                          | (bytes[2] << 16)
+                          | ((unsigned)bytes[3] << 24));
+}
+
+enum opcode
+bytecode::fetch_opcode(int &pc, bool &wide) const
+{
+  enum opcode op = fetch_opcode(pc);
+  wide = (op == WIDE);
+  if (wide) {
+    op = fetch_opcode(pc);
+  }
+  return op;
+}
+
+template <class TRACE>
+int vm::interpret_function(int fn, int input)
+{
+  const bytecode *code = m_module->get_function(fn);
+  int base = alloc_frame(code);
+  frame f(&m_value_stack[base], code->get_max_stack_depth());
   int pc = 0;
-  debug_begin_frame(input);
+  m_current_fn = fn;
+  TRACE::begin_frame(*this, input);
   f.push_int(input);
   while (1) {
-    debug_begin_opcode(f, pc);
-    enum opcode op = m_bytecode->fetch_opcode(pc);
+    TRACE::begin_opcode(*this, f, pc);
+    enum opcode op = code->fetch_opcode(pc);
     switch (op) {
       case DUP:
         {
@@ -359,7 +1067,7 @@ int vm::interpret(int input)
 
       case PUSH_INT_CONST:
         {
-          f.push_int(m_bytecode->fetch_arg_int(pc));
+          f.push_int(code->fetch_arg_int(pc));
         }
         break;
 
@@ -393,8 +1101,9 @@ int vm::interpret(int input)
       case JUMP_ABS_IF_TRUE:
         {
           bool flag = f.pop_bool();
-          int dest = m_bytecode->fetch_arg_int(pc);
+          int dest = code->fetch_arg_int(pc);
           if (flag) {
+            TRACE::jump(*this, pc, dest);
             pc = dest;
           }
         }
@@ -403,7 +1112,10 @@ int vm::interpret(int input)
       case CALL_INT:
         {
           int arg = f.pop_int();
-          int result = interpret(arg); //recurse
+          int callee = code->fetch_arg_int(pc);
+          int result = interpret_function<TRACE>(callee, arg); //recurse
+          m_current_fn = fn;
+          f.relocate(&m_value_stack[base]);
           f.push_int(result);
         }
         break;
@@ -411,25 +1123,544 @@ int vm::interpret(int input)
       case RETURN_INT:
         {
           int result = f.pop_int();
-          debug_end_frame(pc, result);
+          release_frame(base);
+          TRACE::end_frame(*this, pc, result);
           return result;
         }
 
+      case COMPARE_LT_CONST_JUMP_ABS_IF_TRUE:
+        {
+          int lhs = f.peek_int();
+          int rhs = code->fetch_arg_int(pc);
+          int dest = code->fetch_arg_int(pc);
+          if (lhs < rhs) {
+            TRACE::jump(*this, pc, dest);
+            pc = dest;
+          }
+        }
+        break;
+
+      case SUBTRACT_CONST_CALL_INT:
+        {
+          int arg = f.pop_int() - code->fetch_arg_int(pc);
+          int callee = code->fetch_arg_int(pc);
+          int result = interpret_function<TRACE>(callee, arg); //recurse
+          m_current_fn = fn;
+          f.relocate(&m_value_stack[base]);
+          f.push_int(result);
+        }
+        break;
+
+      case WIDE:
+        {
+          // Kept out of the cases above, so that they needn't check
+          // the width of their operands:
+          op = code->fetch_opcode(pc);
+          int arg = code->fetch_wide_arg_int(pc);
+          switch (op) {
+            case PUSH_INT_CONST:
+              f.push_int(arg);
+              break;
+
+            case JUMP_ABS_IF_TRUE:
+              if (f.pop_bool()) {
+                TRACE::jump(*this, pc, arg);
+                pc = arg;
+              }
+              break;
+
+            case COMPARE_LT_CONST_JUMP_ABS_IF_TRUE:
+              {
+                int dest = code->fetch_wide_arg_int(pc);
+                if (f.peek_int() < arg) {
+                  TRACE::jump(*this, pc, dest);
+                  pc = dest;
+                }
+              }
+              break;
+
+            case CALL_INT:
+            case SUBTRACT_CONST_CALL_INT:
+              {
+                int callee_arg = f.pop_int();
+                if (op == SUBTRACT_CONST_CALL_INT) {
+                  callee_arg -= arg;
+                  arg = code->fetch_wide_arg_int(pc);
+                }
+                int result = interpret_function<TRACE>(arg, callee_arg);
+                m_current_fn = fn;
+                f.relocate(&m_value_stack[base]);
+                f.push_int(result);
+              }
+              break;
+
+            default:
+              assert(0); // FIXME
+          }
+        }
+        break;
+
       default:
         assert(0); // FIXME
       }
-    debug_end_opcode(pc);
+    TRACE::end_opcode(*this, pc);
   }
 }
 
+template int vm::interpret_function<no_trace>(int fn, int input);
+template int vm::interpret_function<stdout_trace>(int fn, int input);
+template int vm::interpret_function<count_trace>(int fn, int input);
+template int vm::interpret_function<hotness_trace>(int fn, int input);
+template int vm::interpret_function<profile_trace>(int fn, int input);
+
+/* Decode function "fn" into m_threaded_code[fn], given the handler
+   addresses within interpret_threaded, indexed by opcode.  Each opcode
+   becomes the address of its handler, followed by its operands (if
+   any), so a WIDE prefix needs no handler of its own.  Jump
+   destinations are rewritten from bytecode offsets to indices within
+   the threaded code.  */
+void vm::build_threaded_code(int fn, const void * const *labels)
+{
+  const bytecode *code = m_module->get_function(fn);
+  std::vector<threaded_slot> &slots = m_threaded_code[fn];
+  int len = code->get_len();
+  std::vector<int> index_map(len, -1);
+
+  // 1st pass: locate the slot for each opcode:
+  int pc = 0;
+  int num_slots = 0;
+  while (pc < len) {
+    index_map[pc] = num_slots++;
+    bool wide;
+    enum opcode op = code->fetch_opcode(pc, wide);
+    for (int i = 0; i < num_args[op]; i++) {
+      code->fetch_arg_int(pc, wide);
+      num_slots++;
+    }
+  }
+
+  // 2nd pass: fill in the slots:
+  slots.resize(num_slots);
+  pc = 0;
+  int idx = 0;
+  while (pc < len) {
+    bool wide;
+    enum opcode op = code->fetch_opcode(pc, wide);
+    slots[idx++].m_label = labels[op];
+    switch (op) {
+      case JUMP_ABS_IF_TRUE:
+        {
+          int dest = code->fetch_arg_int(pc, wide);
+          assert(dest >= 0 && dest < len);
+          assert(index_map[dest] >= 0);
+          slots[idx++].m_operand = index_map[dest];
+        }
+        break;
+
+      case COMPARE_LT_CONST_JUMP_ABS_IF_TRUE:
+        {
+          slots[idx++].m_operand = code->fetch_arg_int(pc, wide);
+          int dest = code->fetch_arg_int(pc, wide);
+          assert(dest >= 0 && dest < len);
+          assert(index_map[dest] >= 0);
+          slots[idx++].m_operand = index_map[dest];
+        }
+        break;
+
+      default:
+        for (int i = 0; i < num_args[op]; i++) {
+          slots[idx++].m_operand = code->fetch_arg_int(pc, wide);
+        }
+        break;
+    }
+  }
+}
+
+int vm::interpret_threaded(int fn, int input)
+{
+  /* Handler addresses, indexed by opcode.  */
+  static const void * const labels[] = {
+    &&do_DUP,
+    &&do_ROT,
+    &&do_PUSH_INT_CONST,
+    &&do_BINARY_INT_ADD,
+    &&do_BINARY_INT_SUBTRACT,
+    &&do_BINARY_INT_COMPARE_LT,
+    &&do_JUMP_ABS_IF_TRUE,
+    &&do_CALL_INT,
+    &&do_RETURN_INT,
+    &&do_COMPARE_LT_CONST_JUMP_ABS_IF_TRUE,
+    &&do_SUBTRACT_CONST_CALL_INT,
+  };
+
+  if ((int)m_threaded_code.size() <= fn) {
+    m_threaded_code.resize(m_module->get_num_functions());
+  }
+  if (m_threaded_code[fn].empty()) {
+    build_threaded_code(fn, labels);
+  }
+
+#define DISPATCH() goto *(ip++)->m_label
+
+  const bytecode *bcode = m_module->get_function(fn);
+  const threaded_slot *code = &m_threaded_code[fn][0];
+  const threaded_slot *ip = code;
+  int base = alloc_frame(bcode);
+  frame f(&m_value_stack[base], bcode->get_max_stack_depth());
+  f.push_int(input);
+  DISPATCH();
+
+ do_DUP:
+  {
+    int top = f.pop_int();
+    f.push_int(top);
+    f.push_int(top);
+  }
+  DISPATCH();
+
+ do_ROT:
+  {
+    int first = f.pop_int();
+    int second = f.pop_int();
+    f.push_int(first);
+    f.push_int(second);
+  }
+  DISPATCH();
+
+ do_PUSH_INT_CONST:
+  f.push_int((ip++)->m_operand);
+  DISPATCH();
+
+ do_BINARY_INT_ADD:
+  {
+    int rhs = f.pop_int();
+    int lhs = f.pop_int();
+    f.push_int(lhs + rhs);
+  }
+  DISPATCH();
+
+ do_BINARY_INT_SUBTRACT:
+  {
+    int rhs = f.pop_int();
+    int lhs = f.pop_int();
+    f.push_int(lhs - rhs);
+  }
+  DISPATCH();
+
+ do_BINARY_INT_COMPARE_LT:
+  {
+    int rhs = f.pop_int();
+    int lhs = f.pop_int();
+    f.push_bool(lhs < rhs);
+  }
+  DISPATCH();
+
+ do_JUMP_ABS_IF_TRUE:
+  {
+    bool flag = f.pop_bool();
+    int dest = (ip++)->m_operand;
+    if (flag) {
+      ip = code + dest;
+    }
+  }
+  DISPATCH();
+
+ do_CALL_INT:
+  {
+    int arg = f.pop_int();
+    int callee = (ip++)->m_operand;
+    int result = interpret_threaded(callee, arg); //recurse
+    f.relocate(&m_value_stack[base]);
+    f.push_int(result);
+  }
+  DISPATCH();
+
+ do_RETURN_INT:
+  {
+    int result = f.pop_int();
+    release_frame(base);
+    return result;
+  }
+
+ do_COMPARE_LT_CONST_JUMP_ABS_IF_TRUE:
+  {
+    int lhs = f.peek_int();
+    int rhs = (ip++)->m_operand;
+    int dest = (ip++)->m_operand;
+    if (lhs < rhs) {
+      ip = code + dest;
+    }
+  }
+  DISPATCH();
+
+ do_SUBTRACT_CONST_CALL_INT:
+  {
+    int arg = f.pop_int() - (ip++)->m_operand;
+    int callee = (ip++)->m_operand;
+    int result = interpret_threaded(callee, arg); //recurse
+    f.relocate(&m_value_stack[base]);
+    f.push_int(result);
+  }
+  DISPATCH();
+
+#undef DISPATCH
+}
+
+int vm::interpret_frame_stack(int input)
+{
+  int fn = m_entry;
+  const bytecode *code = m_module->get_function(fn);
+  int frame_size = code->get_max_stack_depth();
+  m_error = NULL;
+  if (m_value_stack.size() < (size_t)frame_size) {
+    m_value_stack.resize(frame_size);
+  }
+  if (m_call_stack.empty()) {
+    m_call_stack.resize(16);
+  }
+
+  /* The values of all frames are held in m_value_stack, with the
+     current frame's values starting at "base".  Each frame can use at
+     most "frame_size" slots (which depends on its function), so we only
+     need to check for space when entering a new frame.  */
+  int *stack = &m_value_stack[0];
+  int base = 0;
+  int sp = 0;
+  int pc = 0;
+
+  /* Saved callers are held in m_call_stack[0..depth).  */
+  call_record *calls = &m_call_stack[0];
+  int depth = 0;
+
+#define PUSH(VAL) \
+  do { assert(sp - base < frame_size); stack[sp++] = (VAL); } while (0)
+#define POP() (stack[--sp])
+#define PEEK() (stack[sp - 1])
+
+  PUSH(input);
+  while (1) {
+    enum opcode op = code->fetch_opcode(pc);
+    int arg, callee;
+    switch (op) {
+      case DUP:
+        {
+          int top = PEEK();
+          PUSH(top);
+        }
+        break;
+
+      case ROT:
+        {
+          int first = stack[sp - 1];
+          stack[sp - 1] = stack[sp - 2];
+          stack[sp - 2] = first;
+        }
+        break;
+
+      case PUSH_INT_CONST:
+        PUSH(code->fetch_arg_int(pc));
+        break;
+
+      case BINARY_INT_ADD:
+        {
+          int rhs = POP();
+          int lhs = POP();
+          PUSH(lhs + rhs);
+        }
+        break;
+
+      case BINARY_INT_SUBTRACT:
+        {
+          int rhs = POP();
+          int lhs = POP();
+          PUSH(lhs - rhs);
+        }
+        break;
+
+      case BINARY_INT_COMPARE_LT:
+        {
+          int rhs = POP();
+          int lhs = POP();
+          PUSH(lhs < rhs ? 1 : 0);
+        }
+        break;
+
+      case JUMP_ABS_IF_TRUE:
+        {
+          bool flag = POP() != 0;
+          int dest = code->fetch_arg_int(pc);
+          if (flag) {
+            pc = dest;
+          }
+        }
+        break;
+
+      case CALL_INT:
+        arg = POP();
+        callee = code->fetch_arg_int(pc);
+        goto do_call;
+
+      case SUBTRACT_CONST_CALL_INT:
+        arg = POP() - code->fetch_arg_int(pc);
+        callee = code->fetch_arg_int(pc);
+        goto do_call;
+
+      do_call:
+        {
+          if (depth >= m_max_call_depth) {
+            m_error = "maximum call depth exceeded";
+            return 0;
+          }
+          if (depth == (int)m_call_stack.size()) {
+            m_call_stack.resize(2 * depth);
+            calls = &m_call_stack[0];
+          }
+          calls[depth].m_fn = fn;
+          calls[depth].m_return_pc = pc;
+          calls[depth].m_base = base;
+          depth++;
+          fn = callee;
+          code = m_module->get_function(fn);
+          frame_size = code->get_max_stack_depth();
+          base = sp;
+          if (m_value_stack.size() < (size_t)(base + frame_size)) {
+            m_value_stack.resize(2 * (base + frame_size));
+            stack = &m_value_stack[0];
+          }
+          pc = 0;
+          PUSH(arg);
+        }
+        break;
+
+      case RETURN_INT:
+        {
+          int result = POP();
+          if (depth == 0) {
+            return result;
+          }
+          depth--;
+          sp = base;
+          fn = calls[depth].m_fn;
+          code = m_module->get_function(fn);
+          frame_size = code->get_max_stack_depth();
+          base = calls[depth].m_base;
+          pc = calls[depth].m_return_pc;
+          PUSH(result);
+        }
+        break;
+
+      case COMPARE_LT_CONST_JUMP_ABS_IF_TRUE:
+        {
+          int lhs = PEEK();
+          int rhs = code->fetch_arg_int(pc);
+          int dest = code->fetch_arg_int(pc);
+          if (lhs < rhs) {
+            pc = dest;
+          }
+        }
+        break;
+
+      case WIDE:
+        op = code->fetch_opcode(pc);
+        arg = code->fetch_wide_arg_int(pc);
+        switch (op) {
+          case PUSH_INT_CONST:
+            PUSH(arg);
+            break;
+
+          case JUMP_ABS_IF_TRUE:
+            if (POP() != 0) {
+              pc = arg;
+            }
+            break;
+
+          case COMPARE_LT_CONST_JUMP_ABS_IF_TRUE:
+            {
+              int dest = code->fetch_wide_arg_int(pc);
+              if (PEEK() < arg) {
+                pc = dest;
+              }
+            }
+            break;
+
+          case CALL_INT:
+            callee = arg;
+            arg = POP();
+            goto do_call;
+
+          case SUBTRACT_CONST_CALL_INT:
+            callee = code->fetch_wide_arg_int(pc);
+            arg = POP() - arg;
+            goto do_call;
+
+          default:
+            assert(0); // FIXME
+        }
+        break;
+
+      default:
+        assert(0); // FIXME
+      }
+  }
+
+#undef PUSH
+#undef POP
+#undef PEEK
+}
+
+size_t vm::interpret_batch(const int *in, int *out, size_t n)
+{
+  size_t i;
+  switch (m_engine) {
+    case ENGINE_THREADED:
+      for (i = 0; i < n; i++) {
+        out[i] = interpret_threaded(m_entry, in[i]);
+      }
+      break;
+
+    case ENGINE_FRAME_STACK:
+      for (i = 0; i < n; i++) {
+        out[i] = interpret_frame_stack(in[i]);
+        if (m_error) {
+          return i;
+        }
+      }
+      break;
+
+    default:
+      for (i = 0; i < n; i++) {
+        out[i] = interpret_function<no_trace>(m_entry, in[i]);
+      }
+      break;
+  }
+  return n;
+}
+
 int frame::pop_int()
 {
   return m_stack[--m_depth];
 }
 
+int frame::peek_int() const
+{
+  return m_stack[m_depth - 1];
+}
+
+/* Carve a frame for the given function from the top of the value
+   stack, returning the offset of its first slot.  */
+int vm::alloc_frame(const bytecode *code)
+{
+  int base = m_stack_top;
+  m_stack_top += code->get_max_stack_depth();
+  if (m_value_stack.size() < (size_t)m_stack_top) {
+    m_value_stack.resize(2 * m_stack_top);
+  }
+  return base;
+}
+
 void frame::push_int(int val)
 {
-  assert(m_depth < 16);
+  assert(m_depth < m_capacity);
   m_stack[m_depth++] = val;
 }
 
@@ -440,6 +1671,28 @@ void frame::debug_stack(FILE *out) const
   }
 }
 
+static const char *const opcode_names[NUM_OPCODES] = {
+  "DUP",
+  "ROT",
+  "PUSH_INT_CONST",
+  "BINARY_INT_ADD",
+  "BINARY_INT_SUBTRACT",
+  "BINARY_INT_COMPARE_LT",
+  "JUMP_ABS_IF_TRUE",
+  "CALL_INT",
+  "RETURN_INT",
+  "COMPARE_LT_CONST_JUMP_ABS_IF_TRUE",
+  "SUBTRACT_CONST_CALL_INT",
+  "WIDE",
+};
+
+const char *vm::get_opcode_name(int pc) const
+{
+  const bytecode *code = m_module->get_function(m_current_fn);
+  bool wide;
+  return opcode_names[code->fetch_opcode(pc, wide)];
+}
+
 void vm::debug_begin_frame(int arg)
 {
   printf("BEGIN FRAME: arg=%i\n", arg);
@@ -453,7 +1706,7 @@ void vm::debug_end_frame(int pc, int result)
 void vm::debug_begin_opcode(const frame &f, int pc)
 {
   printf("begin opcode: ");
-  m_bytecode->disassemble_at(stdout, pc);
+  m_module->get_function(m_current_fn)->disassemble_at(stdout, pc);
   printf("  stack: \n");
   f.debug_stack(stdout);
 }
@@ -17,10 +17,17 @@
    <http://www.gnu.org/licenses/>.
 */
 
+#include <vector>
+
 #include "location.h"
+#include "trace.h"
+
+class arena;
+class exec_profile;
 
 namespace regvm {
   class wordcode;
+  class module;
 };
 
 namespace stackvm {
@@ -34,27 +41,91 @@ enum opcode {
   BINARY_INT_SUBTRACT,
   BINARY_INT_COMPARE_LT,
   JUMP_ABS_IF_TRUE,
+
+  /* Call the function with the given index within the module, passing
+     the top of the stack, and replace it with the result.  Operand:
+     the index of the function.  */
   CALL_INT,
+
   RETURN_INT,
+
+  /* Superinstructions, generated by bytecode::fuse_superinstructions.  */
+
+  /* Fused "DUP, PUSH_INT_CONST c, BINARY_INT_COMPARE_LT,
+     JUMP_ABS_IF_TRUE dest": jump to dest if the top of the stack is
+     less than c, leaving the stack unchanged.  Operands: c, dest.  */
+  COMPARE_LT_CONST_JUMP_ABS_IF_TRUE,
+
+  /* Fused "PUSH_INT_CONST c, BINARY_INT_SUBTRACT, CALL_INT fn":
+     replace the top of the stack with the result of calling fn with it
+     minus c.  Operands: c, fn.  */
+  SUBTRACT_CONST_CALL_INT,
+
+  /* Prefix: the operands of the following opcode are each 4-byte
+     (little-endian) values, rather than single signed bytes, for
+     constants, destinations and function indices outside of
+     -128..127.  */
+  WIDE,
+
+  NUM_OPCODES
 };
 
+/* The range of operands that fit in a single byte, without WIDE.  */
+const int NARROW_MIN_OPERAND = -128;
+const int NARROW_MAX_OPERAND = 127;
+
 class bytecode
 {
 public:
   bytecode(const char *bytes, int len)
     : m_bytes(bytes),
-      m_len(len),
-      m_locations(new location[len])
-  {}
+      m_len(len)
+  {
+    m_max_stack_depth = compute_stack_depths(NULL);
+  }
 
-  void set_location(int pc, const char *filename, int linenum, int colnum);
+  /* Construct a bytecode owning a copy of the given bytes.  */
+  bytecode(const std::vector<char> &bytes)
+    : m_owned_bytes(bytes),
+      m_bytes(&m_owned_bytes[0]),
+      m_len(bytes.size())
+  {
+    m_max_stack_depth = compute_stack_depths(NULL);
+  }
+
+  /* Give the opcode at "pc" a source location; it also applies to the
+     following opcodes, up to the next one given a location.  */
+  void set_location(int pc, const char *filename, int linenum, int colnum)
+  {
+    m_locations.set(pc, filename, linenum, colnum);
+  }
+
+  const location &get_location(int pc) const
+  {
+    return m_locations.lookup(pc);
+  }
 
   void disassemble(FILE *out) const;
 
   void disassemble_at(FILE *out, int &pc) const;
 
+  /* Lower to regvm code, mapping each stack slot directly to a
+     register.  Temporaries are allocated from "scratch" if given, for
+     the caller to release, and from an arena of our own otherwise.  */
   regvm::wordcode *
-  compile_to_regvm() const;
+  compile_to_regvm(arena *scratch = NULL) const;
+
+  /* Lower to regvm code, tracking the contents of the stack at
+     compile-time so that constants and registers are used directly as
+     operands, and then allocating registers.  Temporaries are handled
+     as for compile_to_regvm.  */
+  regvm::wordcode *
+  compile_to_regvm_optimized(arena *scratch = NULL) const;
+
+  /* Peephole pass: build a copy of this bytecode in which hot opcode
+     sequences are replaced by superinstructions.  */
+  bytecode *
+  fuse_superinstructions() const;
 
   enum opcode
   fetch_opcode(int &pc) const;
@@ -62,21 +133,105 @@ public:
   int
   fetch_arg_int(int &pc) const;
 
+  int
+  fetch_wide_arg_int(int &pc) const;
+
+  /* As above, but skipping over any WIDE prefix, setting "wide" if
+     there was one; fetch the operands with the corresponding
+     fetch_arg_int.  */
+  enum opcode
+  fetch_opcode(int &pc, bool &wide) const;
+
+  int
+  fetch_arg_int(int &pc, bool wide) const
+  {
+    return wide ? fetch_wide_arg_int(pc) : fetch_arg_int(pc);
+  }
+
+  int get_len() const { return m_len; }
+
+  /* The most values that are ever on the stack within one frame.  */
+  int get_max_stack_depth() const { return m_max_stack_depth; }
+
+  /* Determine the depth of the stack on entry to each opcode (or -1
+     for unreachable ones), writing them to "depths" (if non-NULL) and
+     returning the maximum depth reached.  */
+  int compute_stack_depths(std::vector<int> *depths) const;
+
 private:
+  // Not copyable, as the location table isn't:
+  bytecode(const bytecode &);
+  bytecode &operator=(const bytecode &);
+
+private:
+  std::vector<char> m_owned_bytes;
   const char *m_bytes;
   int m_len;
-  location *m_locations;
+  location_table m_locations;
+  int m_max_stack_depth;
+};
+
+/* A program: a set of functions, which CALL_INT refers to by their
+   index within the module.  */
+class module
+{
+public:
+  module() {}
+  ~module();
+
+  /* Add a function, which the module takes ownership of, returning its
+     index.  */
+  int add_function(bytecode *code);
+
+  int get_num_functions() const { return m_functions.size(); }
+  bytecode *get_function(int fn) const { return m_functions[fn]; }
+
+  void disassemble(FILE *out) const;
+
+  /* Lower each function to regvm, with bytecode::compile_to_regvm or
+     bytecode::compile_to_regvm_optimized, giving a regvm::module with
+     the same indices.  The functions share an arena for their
+     temporaries, which is released after each.  */
+  regvm::module *
+  compile_to_regvm() const;
+
+  regvm::module *
+  compile_to_regvm_optimized() const;
+
+  /* Apply bytecode::fuse_superinstructions to each function.  */
+  module *
+  fuse_superinstructions() const;
+
+private:
+  // Not copyable, as we own the functions:
+  module(const module &);
+  module &operator=(const module &);
+
+private:
+  std::vector<bytecode *> m_functions;
 };
 
+/* The default limit on the depth of calls for ENGINE_FRAME_STACK.  */
+const int DEFAULT_MAX_CALL_DEPTH = 100000;
+
+/* The stack of one frame: a view of "capacity" slots within a vm's
+   value stack.  */
 class frame
 {
 public:
-  frame()
-    : m_depth(0)
+  frame(int *stack, int capacity)
+    : m_stack(stack),
+      m_depth(0),
+      m_capacity(capacity)
   {}
 
+  /* The vm's value stack can be reallocated while this frame is
+     suspended in a call; point the frame at the new location.  */
+  void relocate(int *stack) { m_stack = stack; }
+
   int pop_int();
   void push_int(int);
+  int peek_int() const;
 
   bool pop_bool() { return pop_int() != 0; }
   void push_bool(bool flag) { push_int(flag ? 1 : 0); }
@@ -84,25 +239,118 @@ public:
   void debug_stack(FILE *out) const;
 
 private:
-  int m_stack[16];
+  int *m_stack;
   int m_depth;
+  int m_capacity;
+};
+
+/* The ways in which a vm can execute bytecode.  */
+enum engine {
+  /* A "switch" statement over each opcode as it is fetched.  */
+  ENGINE_SWITCH,
+
+  /* Direct-threaded code: the bytecode is decoded once into an array
+     of label addresses and operands (using GCC's labels-as-values
+     extension), and each handler jumps straight to the next.  This
+     engine does not support tracing.  */
+  ENGINE_THREADED,
+
+  /* As ENGINE_SWITCH, but rather than recursing on the C++ stack,
+     CALL_INT pushes a record onto an explicit, growable stack of
+     frames.  The depth of calls is limited by set_max_call_depth; if
+     the limit is exceeded, interpretation stops and get_error
+     describes the problem.  This engine does not support tracing.  */
+  ENGINE_FRAME_STACK,
+};
+
+/* The state of a caller, saved by CALL_INT within ENGINE_FRAME_STACK.  */
+struct call_record
+{
+  int m_fn;
+  int m_return_pc;
+  int m_base;
 };
 
+/* An entry in the direct-threaded form of a bytecode.  */
+union threaded_slot
+{
+  const void *m_label;
+  int m_operand;
+};
+
+/* Runs the functions of a module, starting from its "entry" function.
+
+   A vm holds the stacks of the frames it is running, so it must only be
+   used by one thread at a time, but interpretation doesn't modify the
+   module, so any number of vms (e.g. one per thread) can run the same
+   module at once.  Tracing is only done by the interpret<TRACE>
+   variants; the untraced entry points never touch stdout.  */
 class vm
 {
 public:
-  vm(bytecode *code)
-    : m_bytecode(code)
+  vm(module *mod, int entry = 0)
+    : m_module(mod),
+      m_entry(entry),
+      m_current_fn(entry),
+      m_engine(ENGINE_SWITCH),
+      m_stack_top(0),
+      m_max_call_depth(DEFAULT_MAX_CALL_DEPTH),
+      m_error(NULL),
+      m_profile(NULL)
   {}
   ~vm() {}
 
-  int interpret(int arg);
+  void set_engine(enum engine engine) { m_engine = engine; }
+  enum engine get_engine() const { return m_engine; }
+
+  /* Run the entry function using the switch engine, calling the hooks
+     of the given tracing policy (see trace.h) as it goes.  */
+  template <class TRACE>
+  int interpret(int arg) { return interpret_function<TRACE>(m_entry, arg); }
+
+  /* Run the entry function untraced, using the selected engine.  */
+  int interpret(int arg)
+  {
+    switch (m_engine) {
+    case ENGINE_THREADED:
+      return interpret_threaded(m_entry, arg);
+    case ENGINE_FRAME_STACK:
+      return interpret_frame_stack(arg);
+    default:
+      return interpret<no_trace>(arg);
+    }
+  }
+
+  int interpret_threaded(int arg) { return interpret_threaded(m_entry, arg); }
+  int interpret_frame_stack(int arg);
+
+  /* Run the entry function untraced over each of the "n" values in
+     "in", writing the results to "out", using the selected engine.
+     The engine is chosen, and any decoding done, once for the whole
+     batch rather than per call.  Returns the number of results
+     written, which is less than "n" if a call failed (see
+     get_error).  */
+  size_t interpret_batch(const int *in, int *out, size_t n);
+
+  void set_max_call_depth(int depth) { m_max_call_depth = depth; }
+
+  /* A description of why the most recent call to interpret failed,
+     or NULL if it succeeded.  */
+  const char *get_error() const { return m_error; }
+
   void *compile();
 
-private:
-  template <class T>
-  typename T::return_type
-  dispatch(typename T::input_type input);
+  exec_counts &get_counts() { return m_counts; }
+
+  /* Where interpret<profile_trace> records its profile (see
+     profile.h), which is owned by the caller.  */
+  void set_profile(exec_profile *profile) { m_profile = profile; }
+  exec_profile *get_profile() const { return m_profile; }
+
+  /* The function being run by the switch engine, and the name of the
+     opcode at "pc" within it, for the tracing hooks.  */
+  int get_current_fn() const { return m_current_fn; }
+  const char *get_opcode_name(int pc) const;
 
   void debug_begin_frame(int arg);
   void debug_end_frame(int pc, int result);
@@ -110,7 +358,47 @@ private:
   void debug_end_opcode(int pc);
 
 private:
-  bytecode *m_bytecode;
+  template <class T>
+  typename T::return_type
+  dispatch(typename T::input_type input);
+
+  template <class TRACE>
+  int interpret_function(int fn, int arg);
+
+  int interpret_threaded(int fn, int arg);
+
+  void build_threaded_code(int fn, const void * const *labels);
+
+  int alloc_frame(const bytecode *code);
+  void release_frame(int base) { m_stack_top = base; }
+
+private:
+  module *m_module;
+  int m_entry;
+
+  /* The function being run by the switch engine, for the debug
+     hooks.  */
+  int m_current_fn;
+
+  enum engine m_engine;
+  exec_counts m_counts;
+
+  /* Lazily-built direct-threaded form of each function, for use by
+     ENGINE_THREADED.  */
+  std::vector<std::vector<threaded_slot> > m_threaded_code;
+
+  /* The stacks of all frames, held contiguously.  Each frame takes
+     its function's maximum stack depth, starting at m_stack_top when
+     it is entered.  This is kept between calls to avoid reallocating
+     it.  */
+  std::vector<int> m_value_stack;
+  int m_stack_top;
+
+  /* State for ENGINE_FRAME_STACK.  */
+  std::vector<call_record> m_call_stack;
+  int m_max_call_depth;
+  const char *m_error;
+  exec_profile *m_profile;
 };
 
 }; // namespace stackvm
@@ -0,0 +1,214 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+#include <assert.h>
+
+#include "threadpool.h"
+
+thread_pool::thread_pool(int num_threads)
+  : m_generation(0),
+    m_num_busy(0),
+    m_stopping(false),
+    m_runner(NULL),
+    m_in(NULL),
+    m_out(NULL),
+    m_grain(1),
+    m_failed(false),
+    m_num_steals(0)
+{
+  assert(num_threads > 0);
+  pthread_mutex_init(&m_lock, NULL);
+  pthread_cond_init(&m_work_cond, NULL);
+  pthread_cond_init(&m_done_cond, NULL);
+  for (int i = 0; i < num_threads; i++) {
+    worker *w = new worker;
+    w->m_pool = this;
+    w->m_index = i;
+    pthread_mutex_init(&w->m_lock, NULL);
+    w->m_begin = w->m_end = 0;
+    m_workers.push_back(w);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    int err = pthread_create(&m_workers[i]->m_thread, NULL,
+                             worker_main, m_workers[i]);
+    assert(err == 0); // FIXME
+    (void)err;
+  }
+}
+
+thread_pool::~thread_pool()
+{
+  pthread_mutex_lock(&m_lock);
+  m_stopping = true;
+  pthread_cond_broadcast(&m_work_cond);
+  pthread_mutex_unlock(&m_lock);
+
+  for (unsigned i = 0; i < m_workers.size(); i++) {
+    pthread_join(m_workers[i]->m_thread, NULL);
+    pthread_mutex_destroy(&m_workers[i]->m_lock);
+    delete m_workers[i];
+  }
+  pthread_cond_destroy(&m_done_cond);
+  pthread_cond_destroy(&m_work_cond);
+  pthread_mutex_destroy(&m_lock);
+}
+
+bool thread_pool::run_batch(batch_runner *runner,
+                            const int *in, int *out, size_t n,
+                            size_t grain)
+{
+  assert(grain > 0);
+  int num_workers = m_workers.size();
+
+  pthread_mutex_lock(&m_lock);
+  assert(m_num_busy == 0);
+  m_runner = runner;
+  m_in = in;
+  m_out = out;
+  m_grain = grain;
+  m_failed = false;
+  m_num_steals = 0;
+
+  // Split the inputs evenly between the workers.  They're all idle, but
+  // take their locks anyway, as a thief may be looking at their ranges:
+  for (int i = 0; i < num_workers; i++) {
+    worker *w = m_workers[i];
+    pthread_mutex_lock(&w->m_lock);
+    w->m_begin = n * i / num_workers;
+    w->m_end = n * (i + 1) / num_workers;
+    pthread_mutex_unlock(&w->m_lock);
+  }
+
+  m_generation++;
+  m_num_busy = num_workers;
+  pthread_cond_broadcast(&m_work_cond);
+  while (m_num_busy > 0) {
+    pthread_cond_wait(&m_done_cond, &m_lock);
+  }
+  bool ok = !m_failed;
+  pthread_mutex_unlock(&m_lock);
+  return ok;
+}
+
+void *thread_pool::worker_main(void *arg)
+{
+  worker *w = (worker *)arg;
+  w->m_pool->run_worker(w);
+  return NULL;
+}
+
+void thread_pool::run_worker(worker *w)
+{
+  long generation = 0;
+  pthread_mutex_lock(&m_lock);
+  while (1) {
+    while (m_generation == generation && !m_stopping) {
+      pthread_cond_wait(&m_work_cond, &m_lock);
+    }
+    if (m_stopping) {
+      break;
+    }
+    generation = m_generation;
+    batch_runner *runner = m_runner;
+    const int *in = m_in;
+    int *out = m_out;
+    pthread_mutex_unlock(&m_lock);
+
+    // Work through our own range, then through those of the others:
+    bool ok = true;
+    long num_steals = 0;
+    size_t begin, end;
+    while (1) {
+      if (!take_chunk(w, &begin, &end)) {
+        if (!steal(w, &begin, &end)) {
+          break;
+        }
+        num_steals++;
+      }
+      if (!runner->run(w->m_index, in + begin, out + begin, end - begin)) {
+        ok = false;
+      }
+    }
+
+    pthread_mutex_lock(&m_lock);
+    if (!ok) {
+      m_failed = true;
+    }
+    m_num_steals += num_steals;
+    if (--m_num_busy == 0) {
+      pthread_cond_signal(&m_done_cond);
+    }
+  }
+  pthread_mutex_unlock(&m_lock);
+}
+
+/* Take up to a grain of inputs from the front of the worker's own
+   range, returning false if it is empty.  */
+bool thread_pool::take_chunk(worker *w, size_t *begin, size_t *end)
+{
+  pthread_mutex_lock(&w->m_lock);
+  bool found = w->m_begin < w->m_end;
+  if (found) {
+    *begin = w->m_begin;
+    *end = w->m_end - w->m_begin > m_grain ? w->m_begin + m_grain : w->m_end;
+    w->m_begin = *end;
+  }
+  pthread_mutex_unlock(&w->m_lock);
+  return found;
+}
+
+/* Steal from the back of the first non-empty range of another worker:
+   half of it, if that's more than a grain, in which case the rest of
+   the stolen part becomes the thief's own range, or otherwise all of
+   it.  The first chunk of the stolen part is returned.  Returns false
+   if every range is empty.
+
+   The back half is taken, as the victim is working from the front: the
+   two don't then compete for the same inputs, and each is left with a
+   contiguous range.  */
+bool thread_pool::steal(worker *thief, size_t *begin, size_t *end)
+{
+  int num_workers = m_workers.size();
+  for (int i = 1; i < num_workers; i++) {
+    worker *victim = m_workers[(thief->m_index + i) % num_workers];
+    pthread_mutex_lock(&victim->m_lock);
+    size_t remaining = victim->m_end - victim->m_begin;
+    if (remaining == 0) {
+      pthread_mutex_unlock(&victim->m_lock);
+      continue;
+    }
+    size_t stolen_begin = victim->m_begin;
+    if (remaining > m_grain) {
+      stolen_begin += remaining / 2;
+    }
+    size_t stolen_end = victim->m_end;
+    victim->m_end = stolen_begin;
+    pthread_mutex_unlock(&victim->m_lock);
+
+    *begin = stolen_begin;
+    *end = stolen_end - stolen_begin > m_grain
+      ? stolen_begin + m_grain : stolen_end;
+    pthread_mutex_lock(&thief->m_lock);
+    thief->m_begin = *end;
+    thief->m_end = stolen_end;
+    pthread_mutex_unlock(&thief->m_lock);
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,155 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stddef.h>
+#include <vector>
+
+/* Running a batch of inputs through a function on several threads.
+
+   A thread_pool owns a number of worker threads.  run_batch splits the
+   range of inputs evenly between them, and each worker takes small
+   chunks ("grains") from the front of its own range.  The cost of a
+   guest function can vary enormously with its input (consider
+   fibonacci), so a worker which runs out of work steals the back half
+   of the remaining range of another, rather than going idle.
+
+   The work itself is done by a batch_runner, which is called from each
+   worker thread with the index of the worker, so that it can keep
+   per-thread state, such as a vm.  */
+
+class batch_runner
+{
+public:
+  virtual ~batch_runner() {}
+
+  /* Set out[i] for each i below n from in[i], on the given worker
+     thread, returning false on failure.  */
+  virtual bool run(int worker, const int *in, int *out, size_t n) = 0;
+};
+
+/* Runs batches in a vm per worker thread.  A vm can't be used by more
+   than one thread at once, but any number of vms can interpret the same
+   module concurrently.  */
+template <class VM>
+class vm_batch_runner : public batch_runner
+{
+public:
+  /* "vms" holds one vm per worker, owned by the caller.  */
+  vm_batch_runner(const std::vector<VM *> &vms)
+    : m_vms(vms)
+  {}
+
+  bool run(int worker, const int *in, int *out, size_t n)
+  {
+    return m_vms[worker]->interpret_batch(in, out, n) == n;
+  }
+
+private:
+  std::vector<VM *> m_vms;
+};
+
+/* Runs batches through the result of regvm::module::compile_batch,
+   which has no state of its own, so it can be shared by all workers.  */
+class compiled_batch_runner : public batch_runner
+{
+public:
+  typedef void (*compiled_batch) (const int *in, int *out, size_t n);
+
+  compiled_batch_runner(compiled_batch code)
+    : m_code(code)
+  {}
+
+  bool run(int, const int *in, int *out, size_t n)
+  {
+    m_code(in, out, n);
+    return true;
+  }
+
+private:
+  compiled_batch m_code;
+};
+
+class thread_pool
+{
+public:
+  /* Start the given number of worker threads.  */
+  explicit thread_pool(int num_threads);
+
+  /* Stop the worker threads.  */
+  ~thread_pool();
+
+  int get_num_threads() const { return m_workers.size(); }
+
+  /* Set out[i] for each i below n from in[i] using the runner, spread
+     across all of the workers, blocking until all are done, with each
+     worker handling "grain" inputs at a time.  Returns false if any
+     call of the runner failed.  Only one batch can run at a time.  */
+  bool run_batch(batch_runner *runner, const int *in, int *out, size_t n,
+                 size_t grain = 64);
+
+  /* The number of ranges stolen from one worker by another during the
+     most recent batch.  */
+  long get_num_steals() const { return m_num_steals; }
+
+private:
+  /* The part of the batch not yet taken by a worker, along with the
+     worker's thread.  Each is on its own cache line, so that workers
+     taking chunks from their own ranges don't contend.  */
+  struct worker
+  {
+    pthread_t m_thread;
+    thread_pool *m_pool;
+    int m_index;
+    pthread_mutex_t m_lock;
+    size_t m_begin;
+    size_t m_end;
+  } __attribute__((aligned(64)));
+
+  static void *worker_main(void *arg);
+  void run_worker(worker *w);
+  bool take_chunk(worker *w, size_t *begin, size_t *end);
+  bool steal(worker *thief, size_t *begin, size_t *end);
+
+  // Not copyable, as we own threads:
+  thread_pool(const thread_pool &);
+  thread_pool &operator=(const thread_pool &);
+
+private:
+  std::vector<worker *> m_workers;
+
+  /* m_lock guards the fields below.  m_work_cond is signalled when a
+     batch starts (or we're stopping), and m_done_cond when a worker
+     finishes its part of one.  Each batch has a new m_generation, so
+     that a worker doesn't run the same batch twice.  */
+  pthread_mutex_t m_lock;
+  pthread_cond_t m_work_cond;
+  pthread_cond_t m_done_cond;
+  long m_generation;
+  int m_num_busy;
+  bool m_stopping;
+
+  /* The current batch.  */
+  batch_runner *m_runner;
+  const int *m_in;
+  int *m_out;
+  size_t m_grain;
+  bool m_failed;
+  long m_num_steals;
+};
@@ -0,0 +1,133 @@
+/*
+   Copyright 2013 David Malcolm <dmalcolm@redhat.com>
+   Copyright 2013 Red Hat, Inc.
+
+   This is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Tracing policies for the interpreters.
+
+   Both stackvm::vm::interpret and regvm::vm::interpret are templates
+   on one of these classes, and call its hooks at frame and opcode
+   boundaries, and whenever a jump is taken.  The hooks of no_trace are
+   empty inline functions, so the untraced interpreter loop contains no
+   tracing code at all.  */
+
+struct no_trace
+{
+  template <class VM>
+  static void begin_frame(VM &, int) {}
+
+  template <class VM>
+  static void end_frame(VM &, int, int) {}
+
+  template <class VM, class FRAME>
+  static void begin_opcode(VM &, const FRAME &, int) {}
+
+  template <class VM>
+  static void end_opcode(VM &, int) {}
+
+  /* A jump is taken to "to" from the instruction preceding "from"; it
+     is a backward branch if "to" < "from".  */
+  template <class VM>
+  static void jump(VM &, int, int) {}
+
+  /* The conditional jump at "pc" was executed, and "taken" says
+     whether it jumped.  Only regvm calls this, as the JIT works from
+     its pcs.  */
+  template <class VM>
+  static void branch(VM &, int, bool) {}
+};
+
+/* Write a disassembly of each opcode and a dump of the frame to
+   stdout as it is executed.  */
+struct stdout_trace
+{
+  template <class VM>
+  static void begin_frame(VM &vm, int arg) { vm.debug_begin_frame(arg); }
+
+  template <class VM>
+  static void end_frame(VM &vm, int pc, int result) {
+    vm.debug_end_frame(pc, result);
+  }
+
+  template <class VM, class FRAME>
+  static void begin_opcode(VM &vm, const FRAME &f, int pc) {
+    vm.debug_begin_opcode(f, pc);
+  }
+
+  template <class VM>
+  static void end_opcode(VM &vm, int pc) { vm.debug_end_opcode(pc); }
+
+  template <class VM>
+  static void jump(VM &, int, int) {}
+
+  template <class VM>
+  static void branch(VM &, int, bool) {}
+};
+
+/* Totals gathered by count_trace.  */
+struct exec_counts
+{
+  exec_counts()
+    : m_frames(0),
+      m_opcodes(0),
+      m_backward_jumps(0)
+  {}
+
+  long m_frames;
+  long m_opcodes;
+  long m_backward_jumps;
+};
+
+/* Count frames, opcodes and backward jumps into the vm's exec_counts,
+   for computing throughput.  */
+struct count_trace : public no_trace
+{
+  template <class VM>
+  static void begin_frame(VM &vm, int) { vm.get_counts().m_frames++; }
+
+  template <class VM, class FRAME>
+  static void begin_opcode(VM &vm, const FRAME &, int) {
+    vm.get_counts().m_opcodes++;
+  }
+
+  template <class VM>
+  static void jump(VM &vm, int from, int to) {
+    if (to < from) {
+      vm.get_counts().m_backward_jumps++;
+    }
+  }
+};
+
+/* As count_trace, but without counting opcodes: just enough to tell
+   how hot the code is, for deciding when to compile it.  */
+struct hotness_trace : public no_trace
+{
+  template <class VM>
+  static void begin_frame(VM &vm, int) { vm.get_counts().m_frames++; }
+
+  template <class VM>
+  static void jump(VM &vm, int from, int to) {
+    if (to < from) {
+      vm.get_counts().m_backward_jumps++;
+    }
+  }
+};
+
+#endif